@@ -12,670 +12,7200 @@
 #include <sstream>
 #include <iomanip>
 #include <ctime>
+#include <set>
+#include <sched.h>
+#include <thread>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/utsname.h>
+#include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <linux/sockios.h>
+#include <cstring>
+#include <cerrno>
+#include <future>
+#include <mutex>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <functional>
+#include <memory>
+#include <linux/fs.h>
+#include <netdb.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/rtnetlink.h>
+#include <linux/tcp.h>
+#include <cmath>
+#include <limits>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
 
 namespace fs = std::filesystem;
 
-class ColdVM {
+// Lectura de ficheros de sysfs/procfs (una sola línea)
+static std::string readFirstLine(const std::string& path) {
+    std::ifstream file(path);
+    std::string line;
+    if (file) std::getline(file, line);
+    return line;
+}
+
+// Los hijos no heredan las señales bloqueadas para el signalfd del supervisor
+static void resetChildSignals() {
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, nullptr);
+}
+
+// Ejecuta un programa (sin shell) y devuelve su salida estándar
+static std::string captureProgram(const std::vector<std::string>& argv) {
+    std::string output;
+    int fds[2];
+    if (argv.empty() || pipe2(fds, O_CLOEXEC) != 0) return output;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        resetChildSignals();
+        dup2(fds[1], STDOUT_FILENO);
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) dup2(devnull, STDERR_FILENO);
+        std::vector<char*> args;
+        for (const auto& arg : argv) args.push_back(const_cast<char*>(arg.c_str()));
+        args.push_back(nullptr);
+        execvp(args[0], args.data());
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return output;
+    }
+
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) output.append(buffer, (size_t)n);
+    }
+    close(fds[0]);
+    waitpid(pid, nullptr, 0);
+    return output;
+}
+
+// Busca un ejecutable en $PATH sin lanzar una shell (vacío si no existe)
+static std::string findInPath(const std::string& name) {
+    if (name.find('/') != std::string::npos) {
+        return access(name.c_str(), X_OK) == 0 ? name : "";
+    }
+    const char* env = getenv("PATH");
+    std::stringstream ss(env ? env : "/usr/local/bin:/usr/bin:/bin");
+    std::string dir;
+    while (std::getline(ss, dir, ':')) {
+        if (dir.empty()) dir = ".";
+        std::string candidate = dir + "/" + name;
+        if (access(candidate.c_str(), X_OK) == 0 && !fs::is_directory(candidate)) return candidate;
+    }
+    return "";
+}
+
+// FNV-1a de 64 bits en hexadecimal, para claves de caché
+static std::string hashString(const std::string& data) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    std::ostringstream out;
+    out << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return out.str();
+}
+
+// Ficheros clave=valor usados como caché en ./run
+static std::map<std::string, std::string> loadKeyValueFile(const std::string& path) {
+    std::map<std::string, std::string> values;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t eq = line.find('=');
+        if (eq != std::string::npos) values[line.substr(0, eq)] = line.substr(eq + 1);
+    }
+    return values;
+}
+
+static bool saveKeyValueFile(const std::string& path, const std::map<std::string, std::string>& values) {
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::trunc);
+        if (!file) return false;
+        for (const auto& [key, value] : values) file << key << "=" << value << "\n";
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// Perfil de VM en un subconjunto de TOML: [sección], clave = valor con
+// cadenas, números, true/false y arrays de una línea. Se aplana a
+// "sección.clave" (arrays: "clave.0", "clave.1"...) y los booleanos a 1/0.
+static bool parseProfile(const std::string& text, std::map<std::string, std::string>& values, std::string& failure) {
+    std::istringstream in(text);
+    std::string line, section;
+    int number = 0;
+    auto parseValue = [](const std::string& raw, std::string& value) {
+        if (raw == "true" || raw == "false") {
+            value = raw == "true" ? "1" : "0";
+            return true;
+        }
+        if (raw.size() >= 2 && (raw[0] == '"' || raw[0] == '\'') && raw.back() == raw[0]) {
+            value.clear();
+            for (size_t i = 1; i + 1 < raw.size(); i++) {
+                if (raw[0] == '"' && raw[i] == '\\' && i + 2 < raw.size()) i++;
+                value += raw[i];
+            }
+            return true;
+        }
+        value = raw;
+        return !raw.empty() && raw.find_first_not_of("0123456789.-+_") == std::string::npos;
+    };
+    auto trim = [](std::string text) {
+        text.erase(0, text.find_first_not_of(" \t"));
+        text.erase(text.find_last_not_of(" \t\r") + 1);
+        return text;
+    };
+    while (std::getline(in, line)) {
+        number++;
+        // Los comentarios sólo se cortan fuera de comillas
+        bool quoted = false;
+        for (size_t i = 0; i < line.size(); i++) {
+            if (line[i] == '"' || line[i] == '\'') quoted = !quoted;
+            if (line[i] == '#' && !quoted) {
+                line.erase(i);
+                break;
+            }
+        }
+        line = trim(line);
+        if (line.empty()) continue;
+        if (line.front() == '[' && line.back() == ']') {
+            section = trim(line.substr(1, line.size() - 2));
+            continue;
+        }
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            failure = "line " + std::to_string(number) + ": expected key = value";
+            return false;
+        }
+        std::string key = trim(line.substr(0, eq));
+        std::string raw = trim(line.substr(eq + 1));
+        if (!section.empty()) key = section + "." + key;
+        if (raw.size() >= 2 && raw.front() == '[' && raw.back() == ']') {
+            std::string items = raw.substr(1, raw.size() - 2);
+            int index = 0;
+            size_t start = 0;
+            while (start < items.size()) {
+                size_t comma = items.find(',', start);
+                std::string item = trim(items.substr(start, comma == std::string::npos ? std::string::npos : comma - start));
+                start = comma == std::string::npos ? items.size() : comma + 1;
+                if (item.empty()) continue;
+                std::string value;
+                if (!parseValue(item, value)) {
+                    failure = "line " + std::to_string(number) + ": bad array item " + item;
+                    return false;
+                }
+                values[key + "." + std::to_string(index++)] = value;
+            }
+            continue;
+        }
+        std::string value;
+        if (!parseValue(raw, value)) {
+            failure = "line " + std::to_string(number) + ": bad value " + raw;
+            return false;
+        }
+        values[key] = value;
+    }
+    return true;
+}
+
+// Extrae el valor de "clave": "texto" de un JSON (primera aparición)
+static std::string jsonStringField(const std::string& json, const std::string& key) {
+    size_t pos = json.find("\"" + key + "\"");
+    if (pos == std::string::npos) return "";
+    pos = json.find(':', pos);
+    if (pos == std::string::npos) return "";
+    pos = json.find_first_not_of(" \t\r\n", pos + 1);
+    if (pos == std::string::npos || json[pos] != '"') return "";
+    std::string value;
+    for (size_t i = pos + 1; i < json.size() && json[i] != '"'; i++) {
+        if (json[i] == '\\' && i + 1 < json.size()) i++;
+        value += json[i];
+    }
+    return value;
+}
+
+// Extrae el valor de "clave": número de un JSON (primera aparición)
+static double jsonNumberField(const std::string& json, const std::string& key, double fallback) {
+    size_t pos = json.find("\"" + key + "\"");
+    if (pos == std::string::npos) return fallback;
+    pos = json.find(':', pos);
+    if (pos == std::string::npos) return fallback;
+    try {
+        return std::stod(json.substr(pos + 1));
+    } catch (const std::exception&) {
+        return fallback;
+    }
+}
+
+// Extrae el valor de "clave": true/false de un JSON (primera aparición)
+static bool jsonBoolField(const std::string& json, const std::string& key) {
+    size_t pos = json.find("\"" + key + "\"");
+    if (pos == std::string::npos) return false;
+    pos = json.find(':', pos);
+    if (pos == std::string::npos) return false;
+    pos = json.find_first_not_of(" \t\r\n", pos + 1);
+    return pos != std::string::npos && json.compare(pos, 4, "true") == 0;
+}
+
+// Escapa texto para incrustarlo entre comillas en un JSON
+static std::string jsonEscape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if ((unsigned char)c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+            out += code;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+// Decodifica base64 (out-data de guest-exec-status)
+static std::string base64Decode(const std::string& input) {
+    static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    int bits = 0, buffer = 0;
+    for (char c : input) {
+        size_t value = alphabet.find(c);
+        if (value == std::string::npos) continue;
+        buffer = ((buffer << 6) | (int)value) & 0xffffff;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out += (char)((buffer >> bits) & 0xff);
+        }
+    }
+    return out;
+}
+
+// Objetos de primer nivel del array "clave": [...] (primera aparición)
+static std::vector<std::string> jsonArrayObjects(const std::string& json, const std::string& key) {
+    std::vector<std::string> objects;
+    size_t pos = json.find("\"" + key + "\"");
+    if (pos == std::string::npos) return objects;
+    pos = json.find(':', pos);
+    if (pos == std::string::npos) return objects;
+    pos = json.find_first_not_of(" \t\r\n", pos + 1);
+    if (pos == std::string::npos || json[pos] != '[') return objects;
+
+    int depth = 0;
+    bool inString = false;
+    size_t start = 0;
+    for (size_t i = pos; i < json.size(); i++) {
+        char c = json[i];
+        if (inString) {
+            if (c == '\\') i++;
+            else if (c == '"') inString = false;
+            continue;
+        }
+        if (c == '"') {
+            inString = true;
+        } else if (c == '[' || c == '{') {
+            if (c == '{' && depth == 1) start = i;
+            depth++;
+        } else if (c == ']' || c == '}') {
+            depth--;
+            if (c == '}' && depth == 1) objects.push_back(json.substr(start, i - start + 1));
+            if (depth == 0) break;
+        }
+    }
+    return objects;
+}
+
+// Convierte "0-3,8,10-11" en {0,1,2,3,8,10,11}
+static std::vector<int> parseCPUList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) continue;
+        try {
+            size_t dash = item.find('-');
+            if (dash == std::string::npos) {
+                cpus.push_back(std::stoi(item));
+            } else {
+                int first = std::stoi(item.substr(0, dash));
+                int last = std::stoi(item.substr(dash + 1));
+                for (int c = first; c <= last; c++) cpus.push_back(c);
+            }
+        } catch (const std::exception&) {
+            // Entrada malformada: ignorar
+        }
+    }
+    return cpus;
+}
+
+// Convierte {0,1,2,3,8} en "0-3,8" (formato de QEMU y sysfs)
+static std::string formatCPUList(std::vector<int> cpus) {
+    std::sort(cpus.begin(), cpus.end());
+    std::string out;
+    for (size_t i = 0; i < cpus.size(); ) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+        if (!out.empty()) out += ",";
+        out += std::to_string(cpus[i]);
+        if (j > i) out += "-" + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return out;
+}
+
+// Serializa la salida por consola de los hilos de preflight
+static std::mutex logMutex;
+
+// fork + execvp con una tubería CLOEXEC: si exec falla, el hijo escribe
+// errno y el padre lo recibe al instante en lugar de un exit(1) silencioso.
+// Con logPath, stdout y stderr del hijo van a ese fichero.
+static pid_t spawnProcess(const std::vector<std::string>& argv, std::string& failure,
+                          const std::string& logPath = "") {
+    int fds[2];
+    if (argv.empty() || pipe2(fds, O_CLOEXEC) != 0) {
+        failure = "cannot create exec pipe";
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        resetChildSignals();
+        if (!logPath.empty()) {
+            int logFd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (logFd >= 0) {
+                dup2(logFd, STDOUT_FILENO);
+                dup2(logFd, STDERR_FILENO);
+                close(logFd);
+            }
+        }
+        std::vector<char*> args;
+        for (const auto& arg : argv) args.push_back(const_cast<char*>(arg.c_str()));
+        args.push_back(nullptr);
+        execvp(args[0], args.data());
+        int err = errno;
+        ssize_t ignored = write(fds[1], &err, sizeof(err));
+        (void)ignored;
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        failure = "fork failed: " + std::string(strerror(errno));
+        return -1;
+    }
+
+    int err = 0;
+    ssize_t n;
+    do {
+        n = read(fds[0], &err, sizeof(err));
+    } while (n < 0 && errno == EINTR);
+    close(fds[0]);
+
+    if (n == (ssize_t)sizeof(err)) {
+        waitpid(pid, nullptr, 0);
+        failure = argv[0] + ": " + strerror(err);
+        return -1;
+    }
+    return pid;
+}
+
+// Ejecuta un programa (sin shell) y espera; devuelve su código de salida o -1
+static int runProgram(const std::vector<std::string>& argv) {
+    std::string failure;
+    pid_t pid = spawnProcess(argv, failure);
+    if (pid < 0) return -1;
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// "64K", "2M", "1G" o bytes; -1 si no es un tamaño
+static long long parseByteSize(const std::string& text) {
+    if (text.empty() || !isdigit((unsigned char)text[0])) return -1;
+    char* end = nullptr;
+    errno = 0;
+    long long value = strtoll(text.c_str(), &end, 10);
+    if (errno == ERANGE) return -1;
+    std::string suffix = end;
+    int shift = suffix.empty() ? 0 : suffix == "K" || suffix == "k" ? 10 : suffix == "M" ? 20 : suffix == "G" ? 30 : -1;
+    if (shift < 0 || value > (std::numeric_limits<long long>::max() >> shift)) return -1;
+    return value << shift;
+}
+
+// Milisegundos en reloj monótono
+static long long monotonicMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static long long monotonicUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Con las señales bloqueadas para el signalfd, Ctrl+C queda pendiente:
+// los bucles largos fuera del supervisor lo consultan aquí
+static bool interruptPending() {
+    sigset_t pending;
+    sigpending(&pending);
+    return sigismember(&pending, SIGINT) || sigismember(&pending, SIGTERM);
+}
+
+// Trazas de arranque en formato Chrome trace (chrome://tracing, Perfetto).
+// Desactivadas no cuestan más que una comprobación por tramo.
+class StartupTrace {
+public:
+    static StartupTrace& instance() {
+        static StartupTrace trace;
+        return trace;
+    }
+
+    void enable(const std::string& outputPath) { path = outputPath; }
+    bool enabled() const { return !path.empty(); }
+
+    // Tramo completo ("ph": "X") en el hilo que lo llama
+    void complete(const std::string& name, const std::string& category, const std::string& vm,
+                  long long startUs, long long durationUs) {
+        if (!enabled()) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back("{\"name\": \"" + name + "\", \"cat\": \"" + category + "\", \"ph\": \"X\", \"ts\": " +
+                         std::to_string(startUs) + ", \"dur\": " + std::to_string(durationUs) + ", \"pid\": " +
+                         std::to_string(getpid()) + ", \"tid\": " + std::to_string((long)syscall(SYS_gettid)) +
+                         ", \"args\": {\"vm\": \"" + vm + "\"}}");
+    }
+
+    // Hito sin duración ("ph": "i"), p. ej. QEMU listo o invitado arrancado
+    void instant(const std::string& name, const std::string& vm) {
+        if (!enabled()) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back("{\"name\": \"" + name + "\", \"cat\": \"milestone\", \"ph\": \"i\", \"s\": \"p\", \"ts\": " +
+                         std::to_string(monotonicUs()) + ", \"pid\": " + std::to_string(getpid()) +
+                         ", \"tid\": " + std::to_string((long)syscall(SYS_gettid)) +
+                         ", \"args\": {\"vm\": \"" + vm + "\"}}");
+    }
+
+    // Reescribe el fichero entero; se llama tras el arranque y al salir
+    bool write() {
+        if (!enabled()) return true;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::error_code ec;
+        fs::create_directories(fs::path(path).parent_path(), ec);
+        std::ofstream file(path, std::ios::trunc);
+        file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        file << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << getpid()
+             << ", \"args\": {\"name\": \"cold\"}}";
+        for (const auto& event : events) file << ",\n" << event;
+        file << "\n]}\n";
+        return (bool)file;
+    }
+
+    const std::string& outputPath() const { return path; }
+
 private:
-    std::string diskDir;
-    std::string romPath;
-    std::string firmwarePath;
-    std::string varsPath;
-    std::string noVNCPath;
-    bool useVNC;
-    bool useBridge;
-    std::string bridgeInterface;
-    pid_t qemuPid;
-    pid_t websockifyPid;
-    std::vector<std::string> diskFiles;
-    std::vector<std::string> isoFiles;
-    
-    // Configuración mejorada
-    int cpuCores;
-    int ramGB;
-    std::string cpuModel;
-    bool enableCamera;
-    bool enableAudio;
-    bool enableMicrophone;
+    std::string path;
+    std::mutex mutex;
+    std::vector<std::string> events;
+};
+
+// Tramo RAII: mide desde su creación hasta que sale de ámbito
+class TraceSpan {
+public:
+    TraceSpan(const std::string& spanName, const std::string& spanCategory, const std::string& spanVM)
+        : active(StartupTrace::instance().enabled()), startUs(active ? monotonicUs() : 0) {
+        if (active) {
+            name = spanName;
+            category = spanCategory;
+            vm = spanVM;
+        }
+    }
+    ~TraceSpan() {
+        if (active) StartupTrace::instance().complete(name, category, vm, startUs, monotonicUs() - startUs);
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    bool active;
+    long long startUs;
+    std::string name;
+    std::string category;
+    std::string vm;
+};
+
+// Cliente QMP mínimo sobre el socket unix de control de QEMU. Las
+// respuestas se emparejan por "id"; los eventos se guardan aparte.
+class QMPClient {
+public:
+    QMPClient() : fd(-1), nextId(1) {}
+    ~QMPClient() { disconnect(); }
+    QMPClient(const QMPClient&) = delete;
+    QMPClient& operator=(const QMPClient&) = delete;
+
+    // Conecta, lee el saludo y negocia qmp_capabilities
+    bool connectTo(const std::string& path, int timeoutMs) {
+        if (!openSocket(path)) return false;
+
+        std::string greeting;
+        if (!readLine(greeting, timeoutMs) || greeting.find("\"QMP\"") == std::string::npos) {
+            disconnect();
+            return false;
+        }
+        if (execute("qmp_capabilities", "", timeoutMs).find("\"return\"") == std::string::npos) {
+            disconnect();
+            return false;
+        }
+        return true;
+    }
+
+    // qemu-guest-agent no saluda: se sincroniza con guest-sync y un token
+    // único, y las respuestas atrasadas se descartan por su id
+    bool connectAgent(const std::string& path, int timeoutMs) {
+        if (!openSocket(path)) return false;
+        long long token = monotonicUs() & 0x7fffffff;
+        std::string reply = execute("guest-sync", "{\"id\": " + std::to_string(token) + "}", timeoutMs);
+        if ((long long)jsonNumberField(reply, "return", -1) != token) {
+            disconnect();
+            return false;
+        }
+        return true;
+    }
+
+    // Conexión al agente sin sincronizar, para quien lleva el guest-sync
+    // por su cuenta desde un bucle de eventos
+    bool attachAgent(const std::string& path) { return openSocket(path); }
+
+    // Envía un comando sin esperar la respuesta; devuelve su id o vacío.
+    // La respuesta llega luego por readAvailable() y takeReplies().
+    std::string submit(const std::string& command, const std::string& arguments = "") {
+        if (fd < 0) return "";
+        std::string id = "cold-" + std::to_string(nextId++);
+        std::string request = "{\"execute\": \"" + command + "\"";
+        if (!arguments.empty()) request += ", \"arguments\": " + arguments;
+        request += ", \"id\": \"" + id + "\"}\n";
+        if (!sendAll(request)) {
+            disconnect();
+            return "";
+        }
+        return id;
+    }
+
+    // Ejecuta un comando; arguments es un objeto JSON ya formateado.
+    // Devuelve la línea de respuesta ("return" o "error"), o vacío.
+    std::string execute(const std::string& command, const std::string& arguments = "", int timeoutMs = 5000) {
+        std::string id = submit(command, arguments);
+        if (id.empty()) return "";
+
+        long long deadline = monotonicMs() + timeoutMs;
+        std::string line;
+        while (readLine(line, (int)std::max(0LL, deadline - monotonicMs()))) {
+            if (line.find("\"event\"") != std::string::npos && line.find("\"id\"") == std::string::npos) {
+                events.push_back(line);
+                continue;
+            }
+            if (replyId(line) == id) return line;
+            keepReply(line);
+        }
+        return "";
+    }
+
+    // Lectura no bloqueante para bucles de eventos; false si QEMU cerró
+    bool readAvailable() {
+        if (fd < 0) return false;
+        char chunk[4096];
+        while (true) {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+            if (n > 0) {
+                buffer.append(chunk, (size_t)n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            disconnect();
+            return false;
+        }
+        size_t pos;
+        while ((pos = buffer.find('\n')) != std::string::npos) {
+            std::string line = buffer.substr(0, pos);
+            buffer.erase(0, pos + 1);
+            if (line.find("\"event\"") != std::string::npos && line.find("\"return\"") == std::string::npos) {
+                events.push_back(line);
+            } else {
+                keepReply(line);
+            }
+        }
+        return true;
+    }
+
+    std::vector<std::string> takeEvents() {
+        std::vector<std::string> out;
+        out.swap(events);
+        return out;
+    }
+
+    // Respuestas que nadie esperaba en execute(): las de submit() y las
+    // que llegaron después de su timeout
+    std::vector<std::string> takeReplies() {
+        std::vector<std::string> out;
+        out.swap(replies);
+        return out;
+    }
+
+    // El id de la respuesta va al final; query-jobs y otros llevan
+    // campos "id" propios dentro de "return"
+    static std::string replyId(const std::string& line) {
+        size_t tail = line.rfind("\"id\"");
+        return tail == std::string::npos ? "" : jsonStringField(line.substr(tail), "id");
+    }
+
+    int descriptor() const { return fd; }
+    bool connected() const { return fd >= 0; }
+
+    void disconnect() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        buffer.clear();
+        replies.clear();
+    }
+
+private:
+    int fd;
+    int nextId;
+    std::string buffer;
+    std::vector<std::string> events;
+    std::vector<std::string> replies;
+
+    // Acotado: en el monitor de QEMU nadie recoge las respuestas tardías
+    void keepReply(const std::string& line) {
+        if (line.find("\"return\"") == std::string::npos && line.find("\"error\"") == std::string::npos) return;
+        if (replies.size() >= 32) replies.erase(replies.begin());
+        replies.push_back(line);
+    }
+
+    bool openSocket(const std::string& path) {
+        disconnect();
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            disconnect();
+            return false;
+        }
+        return true;
+    }
+
+    bool sendAll(const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            sent += (size_t)n;
+        }
+        return true;
+    }
+
+    bool readLine(std::string& line, int timeoutMs) {
+        long long deadline = monotonicMs() + timeoutMs;
+        while (true) {
+            size_t pos = buffer.find('\n');
+            if (pos != std::string::npos) {
+                line = buffer.substr(0, pos);
+                buffer.erase(0, pos + 1);
+                return true;
+            }
+            int remaining = (int)(deadline - monotonicMs());
+            if (remaining <= 0) return false;
+
+            struct pollfd pfd = {fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, remaining);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) return false;
+
+            char chunk[4096];
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            buffer.append(chunk, (size_t)n);
+        }
+    }
+};
+
+// Canal TCP de texto por líneas entre el Cold de origen y el de destino
+// durante una migración en vivo (configuración, READY, DONE/FAILED)
+class ControlChannel {
+public:
+    ControlChannel() : fd(-1) {}
+    ~ControlChannel() { disconnect(); }
+    ControlChannel(const ControlChannel&) = delete;
+    ControlChannel& operator=(const ControlChannel&) = delete;
+
+    // Socket de escucha en todas las interfaces (IPv6 con IPv4 mapeado)
+    static int listenOn(int port) {
+        int sock = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0) return -1;
+        int on = 1, off = 0;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        struct sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port = htons((uint16_t)port);
+        addr.sin6_addr = in6addr_any;
+        if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 4) != 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    bool acceptFrom(int listenFd, std::string& peer) {
+        disconnect();
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        do {
+            fd = accept4(listenFd, (struct sockaddr*)&addr, &len, SOCK_CLOEXEC);
+        } while (fd < 0 && errno == EINTR);
+        if (fd < 0) return false;
+        char host[NI_MAXHOST] = "";
+        getnameinfo((struct sockaddr*)&addr, len, host, sizeof(host), nullptr, 0, NI_NUMERICHOST);
+        peer = host;
+        return true;
+    }
+
+    bool connectTo(const std::string& host, int port) {
+        disconnect();
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* results = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &results) != 0) return false;
+        for (struct addrinfo* ai = results; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) disconnect();
+        }
+        freeaddrinfo(results);
+        return fd >= 0;
+    }
+
+    bool sendLine(const std::string& line) {
+        std::string data = line + "\n";
+        size_t sent = 0;
+        while (fd >= 0 && sent < data.size()) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            sent += (size_t)n;
+        }
+        return fd >= 0;
+    }
+
+    // timeoutMs < 0 espera sin límite; false en timeout o si el otro lado cerró
+    bool readLine(std::string& line, int timeoutMs) {
+        long long deadline = monotonicMs() + timeoutMs;
+        while (fd >= 0) {
+            size_t pos = buffer.find('\n');
+            if (pos != std::string::npos) {
+                line = buffer.substr(0, pos);
+                buffer.erase(0, pos + 1);
+                return true;
+            }
+            int remaining = timeoutMs < 0 ? -1 : (int)(deadline - monotonicMs());
+            if (timeoutMs >= 0 && remaining <= 0) return false;
+
+            struct pollfd pfd = {fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, remaining);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) return false;
+
+            char chunk[4096];
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            buffer.append(chunk, (size_t)n);
+        }
+        return false;
+    }
+
+    void disconnect() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        buffer.clear();
+    }
+
+private:
+    int fd;
+    std::string buffer;
+};
+
+// Estado TCP de un cliente conectado a un puerto local (sock_diag)
+struct TCPClientSample {
+    std::string address;
+    int port = 0;
+    double rttMs = 0;
+    double deliveryMbps = 0;   // 0 = aún sin muestra
+    bool appLimited = true;    // el emisor no llenó el enlace
+};
+
+// Lee tcp_info de las conexiones establecidas en localPort mediante
+// NETLINK_SOCK_DIAG, el mismo mecanismo que "ss -ti"
+static std::vector<TCPClientSample> sampleTCPClients(int localPort) {
+    std::vector<TCPClientSample> samples;
+    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+    if (sock < 0) return samples;
+
+    for (int family : {AF_INET, AF_INET6}) {
+        struct {
+            struct nlmsghdr header;
+            struct inet_diag_req_v2 request;
+        } message;
+        memset(&message, 0, sizeof(message));
+        message.header.nlmsg_len = sizeof(message);
+        message.header.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+        message.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+        message.request.sdiag_family = (uint8_t)family;
+        message.request.sdiag_protocol = IPPROTO_TCP;
+        message.request.idiag_states = 1 << 1;   // TCP_ESTABLISHED
+        message.request.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+        if (send(sock, &message, sizeof(message), 0) < 0) continue;
+
+        bool done = false;
+        char buffer[16384];
+        while (!done) {
+            ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+            if (n <= 0) break;
+            for (struct nlmsghdr* h = (struct nlmsghdr*)buffer; NLMSG_OK(h, (size_t)n); h = NLMSG_NEXT(h, n)) {
+                if (h->nlmsg_type == NLMSG_DONE || h->nlmsg_type == NLMSG_ERROR) {
+                    done = true;
+                    break;
+                }
+                struct inet_diag_msg* diag = (struct inet_diag_msg*)NLMSG_DATA(h);
+                if (ntohs(diag->id.idiag_sport) != localPort) continue;
+
+                TCPClientSample sample;
+                char host[INET6_ADDRSTRLEN] = "";
+                inet_ntop(family, diag->id.idiag_dst, host, sizeof(host));
+                sample.address = host;
+                if (sample.address.rfind("::ffff:", 0) == 0) sample.address = sample.address.substr(7);
+                sample.port = ntohs(diag->id.idiag_dport);
+
+                int length = (int)(h->nlmsg_len - NLMSG_LENGTH(sizeof(*diag)));
+                for (struct rtattr* attr = (struct rtattr*)(diag + 1); RTA_OK(attr, length); attr = RTA_NEXT(attr, length)) {
+                    if (attr->rta_type != INET_DIAG_INFO) continue;
+                    struct tcp_info info;
+                    memset(&info, 0, sizeof(info));
+                    memcpy(&info, RTA_DATA(attr), std::min(sizeof(info), (size_t)RTA_PAYLOAD(attr)));
+                    sample.rttMs = info.tcpi_rtt / 1000.0;
+                    sample.deliveryMbps = info.tcpi_delivery_rate * 8.0 / 1e6;
+                    sample.appLimited = info.tcpi_delivery_rate_app_limited;
+                }
+                samples.push_back(sample);
+            }
+        }
+    }
+    close(sock);
+    return samples;
+}
+
+// Ajustes de codificación que noVNC pide a QEMU para un tipo de enlace
+struct DisplayTuning {
+    std::string tier;        // lan | fast | wan | slow
+    std::string encoding;    // raw | tight | zrle
+    int quality = 6;         // JPEG 0-9
+    int compression = 2;     // zlib 0-9
+    int fps = 30;
+
+    static DisplayTuning forTier(const std::string& tier) {
+        DisplayTuning tuning;
+        tuning.tier = tier;
+        if (tier == "lan") {
+            tuning.encoding = "raw";
+            tuning.quality = 9;
+            tuning.compression = 0;
+            tuning.fps = 60;
+        } else if (tier == "fast") {
+            tuning.encoding = "tight";
+            tuning.quality = 8;
+            tuning.compression = 2;
+            tuning.fps = 30;
+        } else if (tier == "wan") {
+            tuning.encoding = "tight";
+            tuning.quality = 5;
+            tuning.compression = 6;
+            tuning.fps = 20;
+        } else {
+            tuning.tier = "slow";
+            tuning.encoding = "tight";
+            tuning.quality = 2;
+            tuning.compression = 9;
+            tuning.fps = 10;
+        }
+        return tuning;
+    }
+
+    // Sin muestra de ancho de banda (enlace ocioso) decide sólo el RTT
+    static std::string classify(double rttMs, double mbps) {
+        bool unknown = mbps <= 0;
+        if (rttMs < 2 && (unknown || mbps >= 100)) return "lan";
+        if (rttMs < 20 && (unknown || mbps >= 20)) return "fast";
+        if (rttMs < 150 && (unknown || mbps >= 4)) return "wan";
+        return "slow";
+    }
+
+    std::string toJSON() const {
+        return "{\"tier\": \"" + tier + "\", \"encoding\": \"" + encoding + "\", \"quality\": " +
+               std::to_string(quality) + ", \"compression\": " + std::to_string(compression) +
+               ", \"fps\": " + std::to_string(fps) + "}";
+    }
+};
+
+// Estado del gobernador de pantalla para una dirección de cliente
+struct DisplayClient {
+    DisplayTuning tuning;
+    std::string pendingTier;
+    int pendingSamples = 0;
+    double rttMs = 0;
+    double mbps = 0;           // mejor muestra no limitada por la aplicación
+    long long lastSeenMs = 0;
+};
+
+// Formato de exposición de Prometheus: agrupa las muestras por familia
+// para que HELP/TYPE aparezcan una sola vez aunque haya varias VMs
+class MetricsText {
+public:
+    static std::string label(const std::string& name, const std::string& value) {
+        std::string escaped;
+        for (char c : value) {
+            if (c == '\\' || c == '"') escaped += '\\';
+            if (c == '\n') escaped += "\\n";
+            else escaped += c;
+        }
+        return name + "=\"" + escaped + "\"";
+    }
+
+    // type: counter | gauge | untyped; labels ya formateadas con label()
+    void add(const std::string& name, const std::string& type, const std::string& help,
+             const std::vector<std::string>& labels, double value) {
+        if (std::isnan(value)) return;
+        auto inserted = families.emplace(name, Family());
+        Family& family = inserted.first->second;
+        if (inserted.second) {
+            order.push_back(name);
+            family.type = type;
+            family.help = help;
+        }
+        std::ostringstream sample;
+        sample << name;
+        for (size_t i = 0; i < labels.size(); i++) sample << (i == 0 ? "{" : ",") << labels[i];
+        if (!labels.empty()) sample << "}";
+        sample << " " << std::setprecision(15) << value;
+        family.samples.push_back(sample.str());
+    }
+
+    std::string str() const {
+        std::string out;
+        for (const auto& name : order) {
+            const Family& family = families.at(name);
+            out += "# HELP " + name + " " + family.help + "\n";
+            out += "# TYPE " + name + " " + family.type + "\n";
+            for (const auto& sample : family.samples) out += sample + "\n";
+        }
+        return out;
+    }
+
+private:
+    struct Family {
+        std::string type;
+        std::string help;
+        std::vector<std::string> samples;
+    };
+    std::vector<std::string> order;
+    std::map<std::string, Family> families;
+};
+
+// Reserva de páginas enormes del host (/sys/kernel/mm/hugepages y /proc/meminfo)
+struct HugepagePool {
+    // "2M" -> 2048, "1G" -> 1048576, otro valor -> 0
+    static long pageKB(const std::string& size) {
+        if (size == "2M") return 2048;
+        if (size == "1G") return 1024 * 1024;
+        return 0;
+    }
+
+    // Páginas libres de un tamaño; node < 0 consulta el total del host
+    static long freePages(long pageKB, int node) {
+        std::string dir = "hugepages-" + std::to_string(pageKB) + "kB";
+        std::string path = node < 0
+            ? "/sys/kernel/mm/hugepages/" + dir + "/free_hugepages"
+            : "/sys/devices/system/node/node" + std::to_string(node) + "/hugepages/" + dir + "/free_hugepages";
+        std::string value = readFirstLine(path);
+        if (!value.empty()) {
+            try { return std::stol(value); } catch (const std::exception&) {}
+        }
+
+        // Sin sysfs: /proc/meminfo sólo describe el tamaño por defecto
+        if (node >= 0) return freePages(pageKB, -1);
+        std::ifstream meminfo("/proc/meminfo");
+        std::string key;
+        long amount = 0, free = -1, defaultKB = 0;
+        std::string line;
+        while (std::getline(meminfo, line)) {
+            std::istringstream ls(line);
+            ls >> key >> amount;
+            if (key == "HugePages_Free:") free = amount;
+            if (key == "Hugepagesize:") defaultKB = amount;
+        }
+        return defaultKB == pageKB ? free : -1;
+    }
+
+    // Punto de montaje hugetlbfs con ese tamaño de página (vacío si no hay)
+    static std::string mountPoint(long pageKB) {
+        if (pageKB <= 0) return "";
+        std::ifstream mounts("/proc/mounts");
+        std::string device, path, type, options;
+        std::string line;
+        while (std::getline(mounts, line)) {
+            std::istringstream ls(line);
+            ls >> device >> path >> type >> options;
+            if (type != "hugetlbfs") continue;
+            long mountKB = 2048;
+            size_t pos = options.find("pagesize=");
+            if (pos != std::string::npos) {
+                std::string size = options.substr(pos + 9, options.find(',', pos) - pos - 9);
+                mountKB = (size == "1G" || size == "1024M") ? 1024 * 1024 : 2048;
+            }
+            if (mountKB == pageKB) return path;
+        }
+        return "";
+    }
+};
+
+// Presión de memoria del host para el globo (PSI y /proc/meminfo)
+struct HostMemory {
+    // "some avg10" de /proc/pressure/memory: % del tiempo con tareas
+    // esperando memoria en los últimos 10 s; NaN sin PSI
+    static double pressure() {
+        std::string line = readFirstLine("/proc/pressure/memory");
+        size_t pos = line.find("avg10=");
+        if (pos == std::string::npos) return std::numeric_limits<double>::quiet_NaN();
+        return atof(line.c_str() + pos + 6);
+    }
+
+    static long availableMB() {
+        std::ifstream meminfo("/proc/meminfo");
+        std::string key;
+        long amount = 0;
+        std::string line;
+        while (std::getline(meminfo, line)) {
+            std::istringstream ls(line);
+            ls >> key >> amount;
+            if (key == "MemAvailable:") return amount / 1024;
+        }
+        return -1;
+    }
+};
+
+// Dispositivos PCI del host (/sys/bus/pci/devices) para VFIO
+struct PCIHost {
+    static std::string devicePath(const std::string& address) { return "/sys/bus/pci/devices/" + address; }
+
+    // "01:00.0" -> "0000:01:00.0"
+    static std::string normalize(const std::string& address) {
+        return std::count(address.begin(), address.end(), ':') == 1 ? "0000:" + address : address;
+    }
+
+    static bool exists(const std::string& address) { return fs::exists(devicePath(address)); }
+
+    static std::string driver(const std::string& address) {
+        std::error_code ec;
+        fs::path link = fs::read_symlink(devicePath(address) + "/driver", ec);
+        return ec ? "" : link.filename().string();
+    }
+
+    static std::string description(const std::string& address) {
+        auto hex = [&address](const std::string& file) {
+            std::string value = readFirstLine(devicePath(address) + "/" + file);
+            return value.rfind("0x", 0) == 0 ? value.substr(2) : value;
+        };
+        return hex("vendor") + ":" + hex("device") + " class " + hex("class");
+    }
+
+    // Los puentes PCI del grupo no se asignan: basta con que no tengan driver ajeno
+    static bool isBridge(const std::string& address) {
+        return readFirstLine(devicePath(address) + "/class").rfind("0x0604", 0) == 0;
+    }
+
+    static std::vector<std::string> iommuGroup(const std::string& address) {
+        std::vector<std::string> members;
+        try {
+            for (const auto& entry : fs::directory_iterator(devicePath(address) + "/iommu_group/devices")) {
+                members.push_back(entry.path().filename().string());
+            }
+        } catch (const fs::filesystem_error&) {}
+        std::sort(members.begin(), members.end());
+        return members;
+    }
+
+    static bool write(const std::string& path, const std::string& value) {
+        std::ofstream file(path);
+        file << value;
+        file.close();
+        return !file.fail();
+    }
+
+    // driver_override + drivers_probe: el dispositivo sólo casa con vfio-pci
+    static bool bindVFIO(const std::string& address) {
+        if (driver(address) == "vfio-pci") return true;
+        if (!fs::exists("/sys/bus/pci/drivers/vfio-pci")) runProgram({"modprobe", "vfio-pci"});
+        if (!driver(address).empty() && !write(devicePath(address) + "/driver/unbind", address)) return false;
+        return write(devicePath(address) + "/driver_override", "vfio-pci") &&
+               write("/sys/bus/pci/drivers_probe", address) && driver(address) == "vfio-pci";
+    }
+
+    // Devuelve el dispositivo a su driver original (vacío: sin driver)
+    static bool restore(const std::string& address, const std::string& original) {
+        if (!driver(address).empty()) write(devicePath(address) + "/driver/unbind", address);
+        write(devicePath(address) + "/driver_override", "\n");
+        if (original.empty()) return true;
+        write("/sys/bus/pci/drivers_probe", address);
+        return driver(address) == original;
+    }
+
+    // VFs de un PF en orden (virtfn0, virtfn1...)
+    static std::vector<std::string> virtualFunctions(const std::string& pf) {
+        std::vector<std::string> vfs;
+        for (int i = 0;; i++) {
+            std::error_code ec;
+            fs::path link = fs::read_symlink(devicePath(pf) + "/virtfn" + std::to_string(i), ec);
+            if (ec) break;
+            vfs.push_back(link.filename().string());
+        }
+        return vfs;
+    }
+};
+
+// Kernel Samepage Merging para --dedup: el escaneo se ajusta al número de
+// invitados en marcha y los valores originales se restauran al salir
+struct KSMTuning {
+    std::map<std::string, std::string> saved;
+
+    static std::string path(const std::string& name) { return "/sys/kernel/mm/ksm/" + name; }
+    static bool available() { return fs::exists(path("run")); }
+
+    static double stat(const std::string& name) {
+        std::string value = readFirstLine(path(name));
+        return value.empty() ? std::numeric_limits<double>::quiet_NaN() : atof(value.c_str());
+    }
+
+    bool set(const std::string& name, const std::string& value) {
+        std::string current = readFirstLine(path(name));
+        if (current.empty()) return false;
+        if (!saved.count(name)) saved[name] = current;
+        if (current == value) return true;
+        std::ofstream file(path(name));
+        file << value;
+        file.close();
+        return !file.fail();
+    }
+
+    // 200 páginas por pasada y por invitado (hasta 4000) cada 20 ms; las
+    // páginas a cero se fusionan con la página cero sin árbol estable
+    bool apply(int instances) {
+        if (!available()) {
+            std::cerr << "! KSM is not available in this kernel (CONFIG_KSM)" << std::endl;
+            return false;
+        }
+        int pages = std::min(4000, std::max(100, 200 * instances));
+        bool ok = set("pages_to_scan", std::to_string(pages)) && set("sleep_millisecs", "20");
+        set("use_zero_pages", "1");
+        ok = set("run", "1") && ok;
+        if (!ok) {
+            std::cerr << "! Cannot tune /sys/kernel/mm/ksm (needs root); merging at the current rate" << std::endl;
+        }
+        return ok;
+    }
+
+    void restore() {
+        for (const auto& [name, value] : saved) {
+            std::ofstream file(path(name));
+            file << value;
+        }
+        saved.clear();
+    }
+};
+
+// Dispositivo USB leído de /sys/bus/usb/devices/<bus>-<puerto>
+struct USBDevice {
+    std::string sysName;        // "1-2.3": bus 1, puerto 2.3
+    int bus = 0;
+    std::string port;           // "2.3"
+    std::string vendor;         // idVendor en hex, "046d"
+    std::string product;
+    std::string name;
+    std::set<int> classes;      // bDeviceClass y bInterfaceClass
+
+    // Clases de interfaz USB: 0x0e vídeo, 0x01 audio, 0x08 almacenamiento, 0x03 HID
+    bool is(const std::string& kind) const {
+        static const std::map<std::string, int> codes = {{"video", 0x0e}, {"audio", 0x01}, {"storage", 0x08}, {"hid", 0x03}};
+        auto code = codes.find(kind);
+        return code != codes.end() && classes.count(code->second);
+    }
+
+    // VENDOR:PRODUCT, BUS-PUERTO o class:video|audio|storage|hid
+    bool matches(const std::string& spec) const {
+        if (spec.rfind("class:", 0) == 0) return is(spec.substr(6));
+        if (spec.size() == 9 && spec[4] == ':') return spec == vendor + ":" + product;
+        return spec == sysName;
+    }
+};
+
+struct USBHost {
+    static bool read(const std::string& sysName, USBDevice& device) {
+        std::string base = "/sys/bus/usb/devices/" + sysName;
+        device.vendor = readFirstLine(base + "/idVendor");
+        device.product = readFirstLine(base + "/idProduct");
+        size_t dash = sysName.find('-');
+        if (device.vendor.empty() || dash == std::string::npos) return false;
+        device.sysName = sysName;
+        device.bus = atoi(readFirstLine(base + "/busnum").c_str());
+        device.port = sysName.substr(dash + 1);
+        std::string manufacturer = readFirstLine(base + "/manufacturer");
+        std::string product = readFirstLine(base + "/product");
+        device.name = manufacturer.empty() ? product : product.empty() ? manufacturer : manufacturer + " " + product;
+        device.classes.clear();
+        device.classes.insert((int)strtol(readFirstLine(base + "/bDeviceClass").c_str(), nullptr, 16));
+        // Las interfaces son "1-2.3:1.0", "1-2.3:1.1"...
+        try {
+            for (const auto& entry : fs::directory_iterator(base)) {
+                std::string child = entry.path().filename().string();
+                if (child.rfind(sysName + ":", 0) != 0) continue;
+                device.classes.insert((int)strtol(readFirstLine(entry.path().string() + "/bInterfaceClass").c_str(), nullptr, 16));
+            }
+        } catch (const fs::filesystem_error&) {}
+        return true;
+    }
+
+    // Dispositivos conectados, sin concentradores raíz (usbN) ni interfaces
+    static std::vector<USBDevice> enumerate() {
+        std::vector<USBDevice> devices;
+        try {
+            for (const auto& entry : fs::directory_iterator("/sys/bus/usb/devices")) {
+                std::string name = entry.path().filename().string();
+                if (name.rfind("usb", 0) == 0 || name.find(':') != std::string::npos) continue;
+                USBDevice device;
+                if (read(name, device) && !device.classes.count(0x09)) devices.push_back(device);
+            }
+        } catch (const fs::filesystem_error&) {}
+        std::sort(devices.begin(), devices.end(), [](const USBDevice& a, const USBDevice& b) { return a.sysName < b.sysName; });
+        return devices;
+    }
+};
+
+// Directorio del host compartido por virtiofs: PATH[,tag=NOMBRE][,ro][,dax=GB]
+struct SharedFolder {
+    std::string path;
+    std::string tag;           // lo que el invitado pasa a mount -t virtiofs
+    bool readOnly = false;
+    int daxGB = 2;             // ventana DAX, si QEMU la soporta; 0 = sin DAX
+    pid_t daemon = -1;         // virtiofsd
+
+    static bool parse(const std::string& spec, SharedFolder& share, std::string& failure) {
+        std::stringstream ss(spec);
+        std::string item;
+        std::getline(ss, share.path, ',');
+        while (std::getline(ss, item, ',')) {
+            if (item.rfind("tag=", 0) == 0) {
+                share.tag = item.substr(4);
+            } else if (item == "ro") {
+                share.readOnly = true;
+            } else if (item.rfind("dax=", 0) == 0 && item.find_first_not_of("0123456789", 4) == std::string::npos && item.size() > 4) {
+                share.daxGB = atoi(item.c_str() + 4);
+            } else {
+                failure = "unknown share option '" + item + "'";
+                return false;
+            }
+        }
+        if (share.path.empty()) {
+            failure = "missing directory";
+            return false;
+        }
+        share.path = fs::absolute(share.path).lexically_normal().string();
+        if (!share.path.empty() && share.path.back() == '/' && share.path.size() > 1) share.path.pop_back();
+        if (share.tag.empty()) share.tag = fs::path(share.path).filename().string();
+        // La etiqueta de virtio-fs tiene 36 bytes como máximo
+        for (char& c : share.tag) {
+            if (!isalnum((unsigned char)c) && c != '-' && c != '_') c = '_';
+        }
+        if (share.tag.empty() || share.tag.size() > 36) {
+            failure = "tag must be 1-36 characters";
+            return false;
+        }
+        return true;
+    }
+
+    std::string spec() const {
+        return path + ",tag=" + tag + (readOnly ? ",ro" : "") + ",dax=" + std::to_string(daxGB);
+    }
+};
+
+// Cámara USB detectada para passthrough
+struct CameraInfo {
+    bool probed = false;
+    bool found = false;
+    std::string vendor;
+    std::string product;
+    std::string name;
+};
+
+// Ajustes de caché/AIO elegidos para un disco
+struct DiskPolicy {
+    std::string format;        // qcow2, raw, vdi, vmdk...
+    long long virtualSize = 0;
+    long long clusterSize = 0; // qcow2
+    bool extendedL2 = false;   // qcow2 con subclústeres (entradas L2 de 16 bytes)
+    long long l2CacheBytes = 0;
+    std::string filesystem;    // ext4, xfs, tmpfs, nfs...
+    std::string cache;         // none | writeback
+    std::string aio;           // io_uring | native | threads
+    std::string discard;       // unmap | ignore
+    std::string detectZeroes;  // off | on | unmap
+    std::string source;        // auto | sidecar
+};
+
+// Imagen en el índice de medios (run/media.index)
+struct MediaEntry {
+    std::string kind;              // disk | iso
+    long long size = 0;
+    long long mtimeNs = 0;
+    std::string format;            // probado con qemu-img en los discos
+    long long virtualSize = 0;
+    long long clusterSize = 0;
+    bool extendedL2 = false;
+};
+
+// Nodo NUMA del invitado: vCPUs, tamaño y nodo del host al que se liga
+struct GuestMemoryNode {
+    int hostNode;  // -1 = sin afinidad
+    std::vector<int> vcpus;
+    long sizeMB;
+};
+
+// CPUs del host ya reservadas por las instancias de este proceso, para que
+// cada VM obtenga cores (y por tanto cachés L3/nodos NUMA) propios
+struct HostReservations {
+    std::set<int> cpus;
+    std::set<std::string> pciDevices;     // VFs ya asignadas a otra instancia
+    std::map<std::string, int> vfUsers;   // PF -> VMs que usan sus VFs
+};
+
+// Topología del host leída de /sys/devices/system/{cpu,node}
+struct HostCPU {
+    int id;
+    int core;      // core_id dentro del socket
+    int socket;    // physical_package_id
+    int node;      // nodo NUMA
+    int l3;        // id de la caché L3 compartida (-1 si no se conoce)
+    bool primary;  // primer hilo SMT de su core físico
+};
+
+struct HostTopology {
+    std::vector<HostCPU> cpus;
+    std::set<int> nodes;
+
+    bool load() {
+        cpus.clear();
+        nodes.clear();
+
+        std::map<int, int> nodeOf;
+        const std::string nodeRoot = "/sys/devices/system/node";
+        for (int node : parseCPUList(readFirstLine(nodeRoot + "/online"))) {
+            nodes.insert(node);
+            std::string list = readFirstLine(nodeRoot + "/node" + std::to_string(node) + "/cpulist");
+            for (int cpu : parseCPUList(list)) nodeOf[cpu] = node;
+        }
+
+        const std::string cpuRoot = "/sys/devices/system/cpu";
+        for (int id : parseCPUList(readFirstLine(cpuRoot + "/online"))) {
+            std::string base = cpuRoot + "/cpu" + std::to_string(id);
+            HostCPU cpu;
+            cpu.id = id;
+            cpu.core = readInt(base + "/topology/core_id", id);
+            cpu.socket = readInt(base + "/topology/physical_package_id", 0);
+            cpu.node = nodeOf.count(id) ? nodeOf[id] : 0;
+            cpu.l3 = -1;
+            cpu.primary = true;
+
+            // Buscar el nivel de caché 3 (el índice varía según la CPU)
+            for (int idx = 0; idx < 8; idx++) {
+                std::string cache = base + "/cache/index" + std::to_string(idx);
+                if (!fs::exists(cache)) break;
+                if (readInt(cache + "/level", 0) == 3) {
+                    std::vector<int> shared = parseCPUList(readFirstLine(cache + "/shared_cpu_list"));
+                    cpu.l3 = readInt(cache + "/id", shared.empty() ? -1 : shared.front());
+                    break;
+                }
+            }
+
+            std::vector<int> siblings = parseCPUList(readFirstLine(base + "/topology/thread_siblings_list"));
+            if (!siblings.empty()) {
+                cpu.primary = (*std::min_element(siblings.begin(), siblings.end()) == id);
+            }
+            cpus.push_back(cpu);
+        }
+
+        if (nodes.empty()) nodes.insert(0);
+        return !cpus.empty();
+    }
+
+    // Elige 'count' CPUs del host, una por core físico si es posible,
+    // prefiriendo que todas compartan la misma L3. Devuelve vacío si no caben.
+    // Las CPUs de 'excluded' ya pertenecen a otras instancias.
+    std::vector<HostCPU> pick(int count, const std::set<int>& excluded = {}) const {
+        std::map<std::pair<int, int>, std::vector<HostCPU>> groups;
+        for (const auto& cpu : cpus) {
+            if (!excluded.count(cpu.id)) groups[{cpu.socket, cpu.l3}].push_back(cpu);
+        }
+
+        // CPU 0 atiende la mayoría de interrupciones del host: dejarla al final
+        auto order = [](std::vector<HostCPU> list) {
+            std::stable_sort(list.begin(), list.end(), [](const HostCPU& a, const HostCPU& b) {
+                if ((a.id == 0) != (b.id == 0)) return b.id == 0;
+                if (a.primary != b.primary) return a.primary;
+                return a.id < b.id;
+            });
+            return list;
+        };
+        auto primaries = [](const std::vector<HostCPU>& list) {
+            int n = 0;
+            for (const auto& cpu : list) if (cpu.primary) n++;
+            return n;
+        };
+
+        std::vector<HostCPU> chosen;
+
+        // 1) Un solo grupo L3 con suficientes cores físicos (el más ajustado)
+        const std::vector<HostCPU>* best = nullptr;
+        for (const auto& [key, list] : groups) {
+            if (primaries(list) >= count && (!best || primaries(list) < primaries(*best))) {
+                best = &list;
+            }
+        }
+        // 2) Un solo grupo L3 usando también hermanos SMT
+        if (!best) {
+            for (const auto& [key, list] : groups) {
+                if ((int)list.size() >= count && (!best || list.size() < best->size())) {
+                    best = &list;
+                }
+            }
+        }
+        if (best) {
+            for (const auto& cpu : order(*best)) {
+                if ((int)chosen.size() == count) break;
+                chosen.push_back(cpu);
+            }
+        } else {
+            // 3) Repartir entre grupos: primero cores físicos, luego hermanos
+            for (int pass = 0; pass < 2 && (int)chosen.size() < count; pass++) {
+                for (const auto& [key, list] : groups) {
+                    for (const auto& cpu : order(list)) {
+                        if ((int)chosen.size() == count) break;
+                        if (cpu.primary == (pass == 0)) chosen.push_back(cpu);
+                    }
+                }
+            }
+        }
+
+        if ((int)chosen.size() < count) return {};
+
+        // Orden de los vCPU de QEMU: socket, core, hilo
+        std::sort(chosen.begin(), chosen.end(), [](const HostCPU& a, const HostCPU& b) {
+            if (a.node != b.node) return a.node < b.node;
+            if (a.socket != b.socket) return a.socket < b.socket;
+            if (a.core != b.core) return a.core < b.core;
+            return a.id < b.id;
+        });
+        return chosen;
+    }
+
+private:
+    static int readInt(const std::string& path, int fallback) {
+        try {
+            std::string value = readFirstLine(path);
+            return value.empty() ? fallback : std::stoi(value);
+        } catch (const std::exception&) {
+            return fallback;
+        }
+    }
+};
+
+class ColdVM {
+private:
+    std::string diskDir;
+    std::string romPath;
+    std::string firmwarePath;
+    std::string varsPath;
+    std::string noVNCPath;
+    std::string displayMode;   // websocket | websockify | spice | gtk
+    std::string vncLink;       // auto | lan | wan
+    int vncQuality;            // -1 = según el enlace
+    int vncCompression;        // -1 = según el enlace
+    int vncFPS;                // tope de fotogramas, 0 = el del enlace
+    std::string vncEncoding;   // auto | raw | tight | zrle
+    int tuningPort;            // HTTP del supervisor (0 = sin gobernador)
+    std::map<std::string, DisplayClient> displayClients;
+    bool useBridge;
+    std::string bridgeInterface;
+    std::string runDir;
+
+    // Identidad de la instancia (vacía en el modo de una sola VM)
+    int instanceIndex;
+    std::string instanceName;
+    std::string logPrefix;
+    int vncDisplay;
+    int webPort;
+    std::string macAddress;
+    HostReservations* reservations;
+    HostReservations localReservations;  // sin flota: VFs de esta VM
+
+    // Aprovisionamiento desde una imagen dorada (--from-base)
+    std::string baseImage;
+    std::string cloneMode;     // overlay | reflink
+    pid_t qemuPid;
+    pid_t webPid;
+
+    // Red: backend elegido ("tap", "bridge", "passt", "user")
+    std::string netBackend;
+    std::string natMode;       // auto | passt | user
+    std::string tapInterface;
+    bool vhostNetAvailable;
+    pid_t passtPid;
+    std::vector<std::string> diskFiles;
+    std::vector<std::string> isoFiles;
+    
+    // Configuración mejorada
+    int cpuCores;
+    int maxRAMGB;              // tamaño de arranque (-m)
+    int minRAMGB;              // el globo no baja de aquí
+    long long balloonTargetMB;
+    std::string cpuModel;
+    bool enableCamera;
+    bool enableAudio;
+    bool enableMicrophone;
+
+    // Topología y fijación de vCPUs
+    bool enablePinning;
+    bool dedup;                // --dedup: RAM fusionable por KSM
+    // Imágenes nuevas y cold disk optimize: preasignación y geometría qcow2
+    std::string diskPrealloc;  // off | metadata | falloc | full
+    std::string diskCluster;   // 64K...
+    bool diskExtendedL2;
+    bool latencyMode;          // --latency: CPUs aisladas y vCPUs SCHED_FIFO
+    int housekeepingCPU;       // --latency: hilo principal e IOThreads
+    std::string cgroupPath;    // cgroup v2 propio de QEMU (límites, --latency)
+    std::map<std::string, std::string> resourceSettings;  // limits.* y throttle.* del perfil
+    HostTopology topology;
+    std::vector<HostCPU> vcpuPlacement;  // vCPU i -> CPU del host
+    std::vector<int> ioThreadCPUs;       // CPUs compartidas por los IOThreads
+    bool placementPlanned;
+
+    // Política de caché/AIO de cada disco (paralelo a diskFiles)
+    std::vector<DiskPolicy> diskPolicies;
+    // Índice de diskDir y romPath; el supervisor lo mantiene con inotify
+    std::map<std::string, MediaEntry> mediaIndex;
+
+    // Resultados del preflight
+    std::map<std::string, std::string> toolPaths;
+    std::map<std::string, std::string> preflightCache;
+    std::mutex preflightMutex;
+    CameraInfo camera;
+
+    QMPClient qmp;
+    QMPClient agent;           // qemu-guest-agent por virtio-serial
+    long long qemuLaunchedMs;
+    // Sondeo del agente desde el supervisor: un guest-ping en vuelo a la vez
+    std::string agentPingId;
+    long long agentPingSentUs;
+    int agentUnanswered;       // pings seguidos sin respuesta
+    long long agentReplyMs;    // última respuesta (0 = ninguna en este arranque)
+    long long agentRTTUs;
+    long long guestReadyMs;    // lanzamiento -> primera respuesta, -1 = aún no
+    bool agentLost;
+    long long frozenSinceMs;   // guest-fsfreeze-freeze en curso (0 = no)
+    std::string freezeRequestId;  // guest-fsfreeze-* en vuelo
+    bool freezeRequested;      // la petición en vuelo es un freeze (no thaw)
+    long long freezeSentMs;
+    bool freezeDone;           // resultado listo para takeFreezeResult()
+    int freezeResult;
+    bool incomingMigration;    // cold receive: QEMU espera el estado por la red
+    std::string profileHash;   // perfil cargado (vacío sin perfil)
+    bool fixedMedia;           // el perfil fija los discos: no se escanean
+    std::vector<std::string> compiledArgv;
+    // Passthrough VFIO: pedidos, asignados y drivers originales a restaurar
+    std::vector<std::string> pciDevices;
+    std::string sriovPF;
+    int sriovVFs;
+    std::string assignedVF;
+    std::vector<std::string> passthroughDevices;
+    std::vector<std::pair<std::string, std::string>> boundDevices;
+    // Passthrough USB: especificaciones (USBDevice::matches) y, con
+    // --usb-hotplug, los conectados por device_add (sysName -> id qdev)
+    std::vector<std::string> usbDevices;
+    bool usbHotplug;
+    std::map<std::string, std::string> attachedUSB;
+    // Carpetas virtiofs (./devices/share por defecto); su virtiofsd vive
+    // y muere con QEMU
+    std::vector<SharedFolder> shares;
+    std::string virtiofsdPath;
+
+    // Páginas enormes: "" (desactivado), "2M" o "1G"
+    std::string hugepageSize;
+    long activeHugepageKB;
+
+public:
+    ColdVM() {
+        diskDir = "./devices/disk";
+        romPath = "./devices/rom";
+        firmwarePath = "./boot/firmware/OVMF_CODE.fd";
+        varsPath = "./boot/firmware/OVMF_VARS.fd";
+        noVNCPath = "./libraries/noVNC";
+        displayMode = "websocket";
+        vncLink = "auto";
+        vncQuality = -1;
+        vncCompression = -1;
+        vncFPS = 0;
+        vncEncoding = "auto";
+        tuningPort = 0;
+        useBridge = true;
+        bridgeInterface = "virbr0";
+        runDir = "./run";
+        instanceIndex = -1;
+        vncDisplay = 1;
+        webPort = 8080;
+        macAddress = "52:54:00:12:34:56";
+        reservations = nullptr;
+        cloneMode = "overlay";
+        qemuPid = -1;
+        webPid = -1;
+        natMode = "auto";
+        tapInterface = "cold-tap0";
+        vhostNetAvailable = false;
+        passtPid = -1;
+        
+        // Configuración por defecto
+        cpuCores = 4;
+        maxRAMGB = 4;
+        minRAMGB = 4;
+        dedup = false;
+        diskPrealloc = "metadata";
+        diskCluster = "64K";
+        diskExtendedL2 = false;
+        latencyMode = false;
+        housekeepingCPU = -1;
+        balloonTargetMB = 0;
+        cpuModel = "host";
+        enableCamera = true;
+        enableAudio = true;
+        enableMicrophone = true;
+        enablePinning = true;
+        placementPlanned = false;
+        activeHugepageKB = 0;
+        qemuLaunchedMs = 0;
+        resetAgentState();
+        incomingMigration = false;
+        fixedMedia = false;
+        sriovVFs = 1;
+        usbHotplug = false;
+    }
+
+    // Sistema de logs mejorado
+    void log(const std::string& message) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cout << "- " << logPrefix << message << std::endl;
+    }
+
+    void warning(const std::string& message) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cout << "! " << logPrefix << message << std::endl;
+    }
+
+    void debug(const std::string& message) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cout << "+ " << logPrefix << message << std::endl;
+    }
+
+    void error(const std::string& message) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cerr << "✗ " << logPrefix << message << std::endl;
+    }
+
+    void success(const std::string& message) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cout << "✓ " << logPrefix << message << std::endl;
+    }
+
+    bool checkFile(const std::string& path, const std::string& name) {
+        if (fs::exists(path)) {
+            success(name + " found!");
+            return true;
+        } else {
+            warning(name + " not found at: " + path);
+            return false;
+        }
+    }
+
+    bool checkCommand(const std::string& cmd, const std::string& name) {
+        TraceSpan span = traceSpan("checkCommand " + cmd, "preflight");
+        if (!toolPaths.count(cmd)) toolPaths[cmd] = findInPath(cmd);
+        if (!toolPaths[cmd].empty()) {
+            success(name + " is available!");
+            return true;
+        } else {
+            warning(name + " is not installed!");
+            return false;
+        }
+    }
+
+    bool checkBridgeInterface() {
+        if (if_nametoindex(bridgeInterface.c_str()) != 0) {
+            success("Bridge interface '" + bridgeInterface + "' is available!");
+            vhostNetAvailable = access("/dev/vhost-net", R_OK | W_OK) == 0;
+            if (vhostNetAvailable) {
+                success("vhost-net acceleration is available!");
+            } else {
+                warning("vhost-net not available (load vhost_net or check /dev/vhost-net permissions)");
+            }
+            return true;
+        } else {
+            warning("Bridge interface '" + bridgeInterface + "' not found!");
+            warning("Falling back to user networking (NAT)");
+            useBridge = false;
+            return false;
+        }
+    }
+
+    std::vector<std::string> findAllDisks() {
+        TraceSpan span = traceSpan("findAllDisks", "preflight");
+        refreshMediaIndex();
+        return indexedMedia("disk");
+    }
+
+    std::vector<std::string> findAllISOs() {
+        TraceSpan span = traceSpan("findAllISOs", "preflight");
+        refreshMediaIndex();
+        return indexedMedia("iso");
+    }
+
+    std::vector<std::string> indexedMedia(const std::string& kind) const {
+        std::vector<std::string> paths;
+        for (const auto& [path, entry] : mediaIndex) {
+            if (entry.kind == kind) paths.push_back(path);
+        }
+        return paths;
+    }
+
+    // Índice de medios: sin cambios en los directorios (su mtime), el
+    // arranque lee un fichero en lugar de recorrer miles de ISOs por NFS
+    std::string mediaIndexPath() const { return runDir + "/media.index"; }
+
+    static long long mtimeNs(const struct stat& st) {
+        return (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    }
+
+    static std::string directoryStamp(const std::string& dir) {
+        struct stat st;
+        return stat(dir.c_str(), &st) == 0 ? std::to_string(mtimeNs(st)) : "missing";
+    }
+
+    // Discos en diskDir, ISOs en romPath; "" si el fichero no es un medio
+    std::string mediaKind(const std::string& path) const {
+        std::string dir = fs::path(path).parent_path().string();
+        std::string ext = fs::path(path).extension().string();
+        if (dir == diskDir && (ext == ".qcow2" || ext == ".img" || ext == ".raw" || ext == ".vdi" || ext == ".vmdk")) return "disk";
+        if (dir == romPath && ext == ".iso") return "iso";
+        return "";
+    }
+
+    // Carga el índice y vuelve a recorrer sólo los directorios cuyo mtime
+    // cambió desde que se guardó (o todos si no hay índice)
+    void refreshMediaIndex() {
+        auto values = loadKeyValueFile(mediaIndexPath());
+        mediaIndex.clear();
+        for (const auto& [key, value] : values) {
+            if (key.rfind("media.", 0) != 0) continue;
+            // tipo:tamaño:mtime:formato:tamaño virtual:clúster:extended_l2:ruta
+            std::stringstream fields(value);
+            std::string item[7], path;
+            for (auto& field : item) std::getline(fields, field, ':');
+            std::getline(fields, path);
+            if (path.empty()) continue;
+            MediaEntry& entry = mediaIndex[path];
+            entry.kind = item[0];
+            entry.size = atoll(item[1].c_str());
+            entry.mtimeNs = atoll(item[2].c_str());
+            entry.format = item[3];
+            entry.virtualSize = atoll(item[4].c_str());
+            entry.clusterSize = atoll(item[5].c_str());
+            entry.extendedL2 = item[6] == "1";
+        }
+        bool stale = false;
+        for (const auto& [dir, key] : {std::make_pair(diskDir, "dir.disk"), std::make_pair(romPath, "dir.rom")}) {
+            if (values[key] == dir + ":" + directoryStamp(dir)) continue;
+            scanMediaDirectory(dir);
+            stale = true;
+        }
+        if (stale) saveMediaIndex();
+        else debug("Media index is current (" + std::to_string(mediaIndex.size()) + " entries)");
+    }
+
+    void saveMediaIndex() {
+        std::map<std::string, std::string> values;
+        values["dir.disk"] = diskDir + ":" + directoryStamp(diskDir);
+        values["dir.rom"] = romPath + ":" + directoryStamp(romPath);
+        size_t index = 0;
+        for (const auto& [path, entry] : mediaIndex) {
+            values["media." + std::to_string(index++)] =
+                entry.kind + ":" + std::to_string(entry.size) + ":" + std::to_string(entry.mtimeNs) + ":" + entry.format +
+                ":" + std::to_string(entry.virtualSize) + ":" + std::to_string(entry.clusterSize) + ":" +
+                (entry.extendedL2 ? "1" : "0") + ":" + path;
+        }
+        saveKeyValueFile(mediaIndexPath(), values);
+    }
+
+    // Alta o actualización de un fichero; sólo los discos pasan por qemu-img
+    void indexMedia(const std::string& path) {
+        std::string kind = mediaKind(path);
+        struct stat st;
+        if (kind.empty() || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            mediaIndex.erase(path);
+            return;
+        }
+        auto it = mediaIndex.find(path);
+        if (it != mediaIndex.end() && it->second.size == (long long)st.st_size && it->second.mtimeNs == mtimeNs(st)) return;
+        MediaEntry entry;
+        entry.kind = kind;
+        entry.size = (long long)st.st_size;
+        entry.mtimeNs = mtimeNs(st);
+        if (kind == "disk") {
+            DiskPolicy image = probeImage(path);
+            entry.format = image.format;
+            entry.virtualSize = image.virtualSize;
+            entry.clusterSize = image.clusterSize;
+            entry.extendedL2 = image.extendedL2;
+        } else {
+            entry.format = "raw";
+            entry.virtualSize = entry.size;
+        }
+        mediaIndex[path] = entry;
+        debug("Found " + std::string(kind == "disk" ? "disk" : "ISO") + ": " + fs::path(path).filename().string());
+    }
+
+    // Recorrido de un directorio: cambió con el supervisor parado, no había
+    // índice o la cola de inotify se desbordó. Lo que no cambió (tamaño y
+    // mtime) conserva su sondeo
+    void scanMediaDirectory(const std::string& dir) {
+        TraceSpan span = traceSpan("scanMediaDirectory", "preflight");
+        debug("Scanning " + dir + "...");
+        std::set<std::string> present;
+        try {
+            if (fs::is_directory(dir)) {
+                for (const auto& entry : fs::directory_iterator(dir)) {
+                    std::string path = entry.path().string();
+                    if (mediaKind(path).empty()) continue;
+                    indexMedia(path);
+                    present.insert(path);
+                }
+            }
+        } catch (const fs::filesystem_error& e) {
+            error("Failed to scan " + dir + ": " + std::string(e.what()));
+        }
+        for (auto it = mediaIndex.begin(); it != mediaIndex.end();) {
+            if (fs::path(it->first).parent_path().string() == dir && !present.count(it->first)) it = mediaIndex.erase(it);
+            else ++it;
+        }
+    }
+
+    void rebuildMediaIndex() {
+        scanMediaDirectory(diskDir);
+        scanMediaDirectory(romPath);
+        saveMediaIndex();
+    }
+
+    // inotify del supervisor: directorios a vigilar y cambios recibidos
+    std::vector<std::string> mediaDirectories() const {
+        if (fixedMedia) return {};
+        return {diskDir, romPath};
+    }
+
+    void mediaChanged(const std::string& path, bool removed) {
+        if (mediaKind(path).empty()) return;
+        if (removed) mediaIndex.erase(path);
+        else indexMedia(path);
+        debug("Media index: " + std::string(removed ? "- " : "+ ") + fs::path(path).filename().string());
+    }
+
+    // Elige el backend de red: tap multiqueue en el bridge, o NAT con passt
+    // (mucho más rápido que slirp) si está instalado
+    void selectNetworkBackend() {
+        if (useBridge) {
+            netBackend = "tap";
+        } else if (natMode == "user") {
+            netBackend = "user";
+        } else if (checkCommand("passt", "passt")) {
+            netBackend = "passt";
+        } else {
+            if (natMode == "passt") warning("passt requested but not installed");
+            warning("Using slirp NAT (limited throughput)");
+            netBackend = "user";
+        }
+    }
+
+    // Crea (o reutiliza) un tap persistente multiqueue y lo añade al bridge
+    bool createTapDevice() {
+        int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            warning("Cannot open /dev/net/tun: " + std::string(strerror(errno)));
+            return false;
+        }
+
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR | IFF_MULTI_QUEUE;
+        strncpy(ifr.ifr_name, tapInterface.c_str(), IFNAMSIZ - 1);
+        if (ioctl(fd, TUNSETIFF, &ifr) < 0 ||
+            ioctl(fd, TUNSETOWNER, getuid()) < 0 ||
+            ioctl(fd, TUNSETPERSIST, 1) < 0) {
+            warning("Cannot create tap '" + tapInterface + "': " + std::string(strerror(errno)));
+            close(fd);
+            return false;
+        }
+        close(fd);
+
+        int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (sock < 0) return false;
+
+        bool ok = true;
+        struct ifreq br;
+        memset(&br, 0, sizeof(br));
+        strncpy(br.ifr_name, bridgeInterface.c_str(), IFNAMSIZ - 1);
+        br.ifr_ifindex = (int)if_nametoindex(tapInterface.c_str());
+        if (ioctl(sock, SIOCBRADDIF, &br) < 0 && errno != EBUSY) {
+            warning("Cannot attach '" + tapInterface + "' to '" + bridgeInterface + "': " + std::string(strerror(errno)));
+            ok = false;
+        }
+
+        struct ifreq up;
+        memset(&up, 0, sizeof(up));
+        strncpy(up.ifr_name, tapInterface.c_str(), IFNAMSIZ - 1);
+        if (ok && ioctl(sock, SIOCGIFFLAGS, &up) == 0) {
+            up.ifr_flags |= IFF_UP;
+            ok = ioctl(sock, SIOCSIFFLAGS, &up) == 0;
+        }
+        close(sock);
+
+        if (!ok) destroyTapDevice();
+        return ok;
+    }
+
+    void destroyTapDevice() {
+        int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+        if (fd < 0) return;
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR | IFF_MULTI_QUEUE;
+        strncpy(ifr.ifr_name, tapInterface.c_str(), IFNAMSIZ - 1);
+        if (ioctl(fd, TUNSETIFF, &ifr) == 0) ioctl(fd, TUNSETPERSIST, 0);
+        close(fd);
+    }
+
+    // Arranca passt en primer plano y espera a que cree su socket
+    bool startPasst() {
+        std::string socketPath = runDir + "/passt.sock";
+        fs::remove(socketPath);
+
+        std::string failure;
+        pid_t pid = spawnProcess({"passt", "--foreground", "--quiet", "--socket", socketPath}, failure);
+        if (pid < 0) {
+            error("Failed to start passt: " + failure);
+            return false;
+        }
+        passtPid = pid;
+
+        for (int attempt = 0; attempt < 50; attempt++) {
+            if (fs::exists(socketPath)) return true;
+            if (waitpid(passtPid, nullptr, WNOHANG) == passtPid) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        warning("passt did not come up");
+        kill(passtPid, SIGTERM);
+        waitpid(passtPid, nullptr, 0);
+        passtPid = -1;
+        return false;
+    }
+
+    std::string shareSocket(const SharedFolder& share) const { return runDir + "/virtiofs-" + share.tag + ".sock"; }
+
+    // ./devices/share se comparte sola, como ./devices/disk y ./devices/rom
+    std::string defaultShareDir() const { return fs::path(diskDir).parent_path().string() + "/share"; }
+
+    // Comprueba las carpetas y localiza virtiofsd; sin él, la VM arranca
+    // sin carpetas compartidas
+    void prepareShares() {
+        if (shares.empty() && fs::is_directory(defaultShareDir())) {
+            SharedFolder share;
+            std::string failure;
+            if (SharedFolder::parse(defaultShareDir() + ",tag=share", share, failure)) shares.push_back(share);
+        }
+        if (shares.empty()) return;
+
+        std::set<std::string> tags;
+        for (auto it = shares.begin(); it != shares.end();) {
+            if (!fs::is_directory(it->path)) {
+                warning("Shared folder not found: " + it->path);
+                it = shares.erase(it);
+            } else if (!tags.insert(it->tag).second) {
+                warning("Duplicate share tag '" + it->tag + "', skipping " + it->path);
+                it = shares.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        virtiofsdPath = findInPath("virtiofsd");
+        for (const char* candidate : {"/usr/libexec/virtiofsd", "/usr/lib/qemu/virtiofsd", "/usr/lib/virtiofsd"}) {
+            if (virtiofsdPath.empty() && access(candidate, X_OK) == 0) virtiofsdPath = candidate;
+        }
+        if (virtiofsdPath.empty() && !shares.empty()) {
+            warning("virtiofsd not found, shared folders disabled");
+            shares.clear();
+        }
+        if (shares.empty()) return;
+
+        // La ventana DAX (cache-size) no está en todas las compilaciones de QEMU
+        if (!preflightCache.count("virtiofs.dax")) {
+            std::string help = captureProgram({"qemu-system-x86_64", "-device", "vhost-user-fs-pci,help"});
+            preflightCache["virtiofs.dax"] = help.find("cache-size") != std::string::npos ? "1" : "0";
+            savePreflightCache();
+        }
+        if (preflightCache["virtiofs.dax"] != "1") debug("QEMU has no virtio-fs DAX window, using the guest page cache");
+    }
+
+    // (Re)arranca los virtiofsd: cada uno sirve una sola conexión de QEMU
+    // y termina cuando éste se desconecta
+    bool startShares() {
+        TraceSpan span = traceSpan("startShares", "virtiofs");
+        stopShares();
+        for (auto& share : shares) {
+            std::string socketPath = shareSocket(share);
+            fs::remove(socketPath);
+            std::vector<std::string> argv = {virtiofsdPath, "--socket-path=" + socketPath, "--shared-dir=" + share.path,
+                                             "--thread-pool-size=" + std::to_string(std::max(cpuCores, 2)),
+                                             "--cache=" + std::string(preflightCache["virtiofs.dax"] == "1" && share.daxGB > 0 ? "always" : "auto"),
+                                             "--announce-submounts"};
+            if (share.readOnly) argv.push_back("--readonly");
+            std::string failure;
+            share.daemon = spawnProcess(argv, failure, runDir + "/virtiofsd-" + share.tag + ".log");
+            if (share.daemon < 0) {
+                error("Failed to start virtiofsd for " + share.path + ": " + failure);
+                stopShares();
+                return false;
+            }
+        }
+        for (auto& share : shares) {
+            bool ready = false;
+            for (int attempt = 0; attempt < 50 && !ready; attempt++) {
+                ready = fs::exists(shareSocket(share));
+                if (!ready && waitpid(share.daemon, nullptr, WNOHANG) == share.daemon) {
+                    share.daemon = -1;
+                    break;
+                }
+                if (!ready) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+            if (!ready) {
+                error("virtiofsd did not come up for " + share.path + " (see " + runDir + "/virtiofsd-" + share.tag + ".log)");
+                stopShares();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void stopShares() {
+        for (auto& share : shares) {
+            if (share.daemon <= 0) continue;
+            kill(share.daemon, SIGTERM);
+            waitpid(share.daemon, nullptr, 0);
+            share.daemon = -1;
+        }
+    }
+
+    // Prepara el lado del host del backend elegido; si falla, degrada
+    // tap -> bridge helper y passt -> slirp en lugar de abortar
+    void prepareNetwork() {
+        TraceSpan span = traceSpan("prepareNetwork", "network");
+        if (netBackend.empty()) selectNetworkBackend();
+        if (netBackend == "tap" && !createTapDevice()) {
+            warning("Falling back to qemu-bridge-helper (single queue, no vhost-net)");
+            netBackend = "bridge";
+        } else if (netBackend == "passt" && passtPid == -1 && !startPasst()) {
+            warning("Falling back to slirp NAT");
+            netBackend = "user";
+        }
+    }
+
+    // VENDOR:PRODUCT sigue al dispositivo en cualquier puerto (y lo espera si
+    // no está); BUS-PUERTO fija el puerto; class:X toma los presentes
+    std::vector<std::string> usbHostArguments() {
+        std::vector<std::string> arguments;
+        auto present = USBHost::enumerate();
+        for (const auto& spec : usbDevices) {
+            if (spec.size() == 9 && spec[4] == ':') {
+                arguments.push_back("usb-host,vendorid=0x" + spec.substr(0, 4) + ",productid=0x" + spec.substr(5));
+                continue;
+            }
+            bool found = false;
+            for (const auto& device : present) {
+                if (!device.matches(spec)) continue;
+                arguments.push_back("usb-host,hostbus=" + std::to_string(device.bus) + ",hostport=" + device.port);
+                log("USB passthrough: " + device.vendor + ":" + device.product + " " + device.name + " (" + device.sysName + ")");
+                found = true;
+            }
+            if (!found && spec.rfind("class:", 0) != 0) {
+                // Puerto vacío: QEMU conectará lo que se enchufe en él
+                size_t dash = spec.find('-');
+                arguments.push_back("usb-host,hostbus=" + spec.substr(0, dash) + ",hostport=" + spec.substr(dash + 1));
+            } else if (!found) {
+                warning("No USB device matches " + spec);
+            }
+        }
+        return arguments;
+    }
+
+    // --usb-hotplug: device_add de un dispositivo recién enlazado si alguna
+    // especificación lo pide; devuelve true si esta VM se lo queda
+    bool attachUSB(const std::string& sysName) {
+        if (!usbHotplug || qemuPid <= 0 || attachedUSB.count(sysName)) return false;
+        USBDevice device;
+        if (!USBHost::read(sysName, device)) return false;
+        if (std::none_of(usbDevices.begin(), usbDevices.end(), [&device](const std::string& spec) { return device.matches(spec); })) {
+            return false;
+        }
+        std::string id = "usb-" + sysName;
+        std::string reply = qmp.execute("device_add", "{\"driver\": \"usb-host\", \"id\": \"" + id +
+                                        "\", \"hostbus\": " + std::to_string(device.bus) +
+                                        ", \"hostport\": \"" + device.port + "\"}", 2000);
+        if (reply.find("\"return\"") == std::string::npos) {
+            warning("Cannot attach USB " + sysName + ": " + jsonStringField(reply, "desc"));
+            return false;
+        }
+        attachedUSB[sysName] = id;
+        success("USB attached: " + device.vendor + ":" + device.product + " " + device.name + " (" + sysName + ")");
+        return true;
+    }
+
+    void detachUSB(const std::string& sysName) {
+        auto it = attachedUSB.find(sysName);
+        if (it == attachedUSB.end()) return;
+        qmp.execute("device_del", "{\"id\": \"" + it->second + "\"}", 2000);
+        log("USB detached: " + sysName);
+        attachedUSB.erase(it);
+    }
+
+    // Tras (re)arrancar QEMU: lo que ya estaba enchufado
+    void attachPresentUSB() {
+        attachedUSB.clear();
+        for (const auto& device : USBHost::enumerate()) attachUSB(device.sysName);
+    }
+
+    bool usbHotplugEnabled() const { return usbHotplug && !usbDevices.empty(); }
+
+    // Primera cámara USB (interfaz de clase vídeo) en sysfs
+    CameraInfo detectCamera() {
+        TraceSpan span = traceSpan("detectCamera (sysfs)", "preflight");
+        CameraInfo info;
+        info.probed = true;
+        info.found = false;
+        for (const auto& device : USBHost::enumerate()) {
+            if (!device.is("video")) continue;
+            info.vendor = device.vendor;
+            info.product = device.product;
+            info.name = device.name.empty() ? "USB camera " + device.sysName : device.name;
+            info.found = true;
+            break;
+        }
+        return info;
+    }
+
+    // Clave de caché para una imagen: cambia si se modifica o cambia de tamaño
+    std::string imageCacheKey(const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) return "";
+        return "format:" + path + ":" + std::to_string((long long)st.st_mtime) + ":" + std::to_string((long long)st.st_size);
+    }
+
+    // Huella de lo que invalida la caché: rutas y mtimes de las herramientas
+    // y la lista de dispositivos USB conectados
+    std::string preflightFingerprint() {
+        std::string material;
+        for (const std::string tool : {"qemu-system-x86_64", "qemu-img", "websockify", "passt"}) {
+            std::string path = findInPath(tool);
+            toolPaths[tool] = path;
+            struct stat st;
+            long long mtime = (!path.empty() && stat(path.c_str(), &st) == 0) ? (long long)st.st_mtime : 0;
+            material += tool + "=" + path + "@" + std::to_string(mtime) + ";";
+        }
+        try {
+            std::vector<std::string> devices;
+            for (const auto& entry : fs::directory_iterator("/sys/bus/usb/devices")) {
+                std::string base = entry.path().string();
+                devices.push_back(entry.path().filename().string() + ":" + readFirstLine(base + "/idVendor") +
+                                  ":" + readFirstLine(base + "/idProduct"));
+            }
+            std::sort(devices.begin(), devices.end());
+            for (const auto& device : devices) material += device + ";";
+        } catch (const fs::filesystem_error&) {
+            material += "no-usb-sysfs;";
+        }
+        return hashString(material);
+    }
+
+    // Comprobaciones previas al arranque: las herramientas se buscan en $PATH,
+    // y la detección de cámara corre en paralelo con el índice de medios.
+    // Con la huella sin cambios, la cámara se toma de ./run/preflight.cache.
+    void runPreflight() {
+        TraceSpan span = traceSpan("runPreflight", "preflight");
+        preflightCache = loadKeyValueFile(runDir + "/preflight.cache");
+        std::string fingerprint = preflightFingerprint();
+        bool warm = preflightCache["fingerprint"] == fingerprint;
+        if (!warm) {
+            preflightCache.clear();
+            preflightCache["fingerprint"] = fingerprint;
+        }
+
+        std::future<CameraInfo> cameraTask;
+        if (enableCamera && warm && preflightCache.count("camera")) {
+            const std::string& value = preflightCache["camera"];
+            camera = CameraInfo();
+            camera.probed = true;
+            camera.found = value != "none" && value.size() >= 10;
+            if (camera.found) {
+                camera.vendor = value.substr(0, 4);
+                camera.product = value.substr(5, 4);
+                camera.name = value.substr(10);
+            }
+        } else if (enableCamera) {
+            debug("Detecting USB camera devices...");
+            cameraTask = std::async(std::launch::async, [this] { return detectCamera(); });
+        }
+
+        if (!fixedMedia) {
+            refreshMediaIndex();
+            diskFiles = indexedMedia("disk");
+            isoFiles = indexedMedia("iso");
+        }
+
+        if (cameraTask.valid()) {
+            camera = cameraTask.get();
+            preflightCache["camera"] = camera.found
+                ? camera.vendor + ":" + camera.product + ":" + camera.name
+                : "none";
+        }
+
+        if (warm) success("Preflight cache is warm, skipped device probing");
+        savePreflightCache();
+    }
+
+    void savePreflightCache() {
+        std::lock_guard<std::mutex> lock(preflightMutex);
+        if (!preflightCache.empty()) saveKeyValueFile(runDir + "/preflight.cache", preflightCache);
+    }
+
+    void createDirectories() {
+        TraceSpan span = traceSpan("createDirectories", "boot");
+        debug("Creating required directories...");
+        try {
+            fs::create_directories(diskDir);
+            fs::create_directories(romPath);
+            fs::create_directories("./boot/firmware");
+            fs::create_directories(fs::path(varsPath).parent_path());
+            fs::create_directories("./libraries");
+            fs::create_directories(runDir);
+            success("Directory structure created!");
+        } catch (const fs::filesystem_error& e) {
+            error("Failed to create directories: " + std::string(e.what()));
+        }
+    }
+
+    // Metadatos preasignados: los clústeres quedan contiguos y una escritura
+    // nueva no asigna L2 en caliente. extended_l2 divide cada clúster en 32
+    // subclústeres, así que clústeres grandes no encarecen el copy-on-write
+    std::string qcow2Options(bool preallocate) const {
+        std::string options = "cluster_size=" + diskCluster + ",extended_l2=" + (diskExtendedL2 ? "on" : "off");
+        if (preallocate && diskPrealloc != "off") options += ",preallocation=" + diskPrealloc;
+        return options;
+    }
+
+    bool createDefaultDisk() {
+        TraceSpan span = traceSpan("createDefaultDisk", "storage");
+        if (!baseImage.empty()) return provisionFromBase();
+        
+        std::string defaultDiskPath = diskDir + "/disk.qcow2";
+        if (!fs::exists(defaultDiskPath)) {
+            log("Creating default 30GB disk image...");
+            int result = runProgram({"qemu-img", "create", "-q", "-f", "qcow2", "-o", qcow2Options(true), defaultDiskPath, "30G"});
+            if (result == 0) {
+                success("Default disk created successfully!");
+                return true;
+            } else {
+                error("Failed to create default disk!");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Tamaño de VARS que corresponde a la variante de OVMF_CODE: CODE y VARS
+    // llenan juntos una flash de 2 MiB o 4 MiB (o la potencia de dos siguiente)
+    long long expectedVarsSize() {
+        std::error_code ec;
+        long long code = (long long)fs::file_size(firmwarePath, ec);
+        if (ec || code <= 0) return 0;
+        long long flash = 2LL * 1024 * 1024;
+        while (flash < code + 128 * 1024) flash *= 2;
+        return flash - code;
+    }
+
+    // Copia con reflink si se puede y si no con copy_file_range (sin pasar
+    // los datos por espacio de usuario)
+    bool copyFirmwareFile(const std::string& source, const std::string& target) {
+        if (reflinkClone(source, target)) return true;
+
+        int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) return false;
+        int out = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (out < 0) {
+            close(in);
+            return false;
+        }
+        struct stat st;
+        bool ok = fstat(in, &st) == 0;
+        off_t remaining = ok ? st.st_size : 0;
+        while (ok && remaining > 0) {
+            ssize_t n = copy_file_range(in, nullptr, out, nullptr, (size_t)remaining, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                ok = false;
+                break;
+            }
+            remaining -= n;
+        }
+        close(out);
+        close(in);
+        if (!ok) {
+            // copy_file_range no disponible (kernel antiguo o FS distintos)
+            fs::remove(target);
+            std::error_code ec;
+            ok = fs::copy_file(source, target, ec);
+        }
+        return ok;
+    }
+
+    // VARS por VM: se crea una vez del tamaño correcto y después se reutiliza
+    // tal cual, sin E/S en los arranques siguientes
+    bool createVarsFile() {
+        TraceSpan span = traceSpan("createVarsFile", "firmware");
+        long long expected = expectedVarsSize();
+        
+        if (fs::exists(varsPath)) {
+            std::error_code ec;
+            long long current = (long long)fs::file_size(varsPath, ec);
+            if (expected == 0 || current == expected) return true;
+            
+            // Un VARS de otra variante hace fallar al pflash: apartarlo
+            warning("OVMF VARS size (" + std::to_string(current) + ") does not match OVMF CODE, recreating it");
+            fs::rename(varsPath, varsPath + ".bak", ec);
+            if (ec) return false;
+        }
+        
+        log("Creating OVMF VARS file...");
+        
+        // Plantillas: la incluida en el repositorio y las del sistema
+        std::vector<std::string> varsSources = {
+            "./repositories/ice/firmware/OVMF_VARS.fd",
+            "/usr/share/OVMF/OVMF_VARS_4M.fd",
+            "/usr/share/OVMF/OVMF_VARS.fd",
+            "/usr/share/edk2-ovmf/x64/OVMF_VARS.fd",
+            "/usr/share/edk2/ovmf/OVMF_VARS.fd",
+            "/usr/share/qemu/OVMF_VARS.fd"
+        };
+        
+        for (const auto& source : varsSources) {
+            std::error_code ec;
+            if (source == varsPath || !fs::exists(source) || fs::equivalent(source, varsPath, ec)) continue;
+            long long size = (long long)fs::file_size(source, ec);
+            if (ec || (expected > 0 && size != expected)) {
+                debug("Skipping " + source + " (size does not match OVMF CODE)");
+                continue;
+            }
+            if (copyFirmwareFile(source, varsPath)) {
+                success("OVMF VARS file created from template " + source);
+                return true;
+            }
+            debug("Failed to copy from " + source);
+        }
+        
+        // Sin plantilla: fichero disperso del tamaño de la flash; OVMF formatea
+        // el almacén de variables en el primer arranque
+        warning("Creating empty OVMF VARS file (not recommended)");
+        int fd = open(varsPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        bool ok = ftruncate(fd, expected > 0 ? expected : 128 * 1024) == 0;
+        close(fd);
+        return ok;
+    }
+
+    // Reserva una CPU del host por vCPU según la topología de sysfs
+    void planCPUPlacement() {
+        TraceSpan span = traceSpan("planCPUPlacement", "boot");
+        if (reservations) {
+            for (const auto& cpu : vcpuPlacement) reservations->cpus.erase(cpu.id);
+            reservations->cpus.erase(housekeepingCPU);
+        }
+        vcpuPlacement.clear();
+        housekeepingCPU = -1;
+        placementPlanned = true;
+        if (!enablePinning && !latencyMode) return;
+
+        if (!topology.load()) {
+            warning("Could not read host CPU topology, vCPU pinning disabled");
+            return;
+        }
+        vcpuPlacement = topology.pick(cpuCores, reservations ? reservations->cpus : std::set<int>());
+        if (vcpuPlacement.empty()) {
+            warning("Host has fewer than " + std::to_string(cpuCores) + " free CPUs, vCPU pinning disabled");
+        } else if (reservations) {
+            for (const auto& cpu : vcpuPlacement) reservations->cpus.insert(cpu.id);
+        }
+        if (latencyMode && !vcpuPlacement.empty()) planHousekeepingCPU();
+    }
+
+    // --latency: una CPU libre del mismo nodo para el hilo principal y los
+    // IOThreads, de modo que las CPUs de los vCPUs sólo ejecuten vCPUs
+    void planHousekeepingCPU() {
+        std::set<int> taken;
+        if (reservations) taken = reservations->cpus;
+        for (const auto& cpu : vcpuPlacement) taken.insert(cpu.id);
+        int node = vcpuPlacement.front().node;
+        for (int pass = 0; pass < 2 && housekeepingCPU < 0; pass++) {
+            for (const auto& cpu : topology.cpus) {
+                if (taken.count(cpu.id) || (pass == 0 && cpu.node != node)) continue;
+                housekeepingCPU = cpu.id;
+                break;
+            }
+        }
+        if (housekeepingCPU < 0) {
+            warning("No free CPU left for housekeeping, emulator threads share the vCPU cores");
+        } else if (reservations) {
+            reservations->cpus.insert(housekeepingCPU);
+        }
+    }
+
+    // sockets/cores/threads del invitado calcados de las CPUs reservadas
+    std::string buildSMPArgument() {
+        std::string smp = std::to_string(cpuCores);
+        if (vcpuPlacement.empty()) return smp;
+
+        std::map<std::pair<int, int>, int> perCore;
+        std::map<int, int> perSocket;
+        for (const auto& cpu : vcpuPlacement) {
+            perCore[{cpu.socket, cpu.core}]++;
+            perSocket[cpu.socket]++;
+        }
+
+        int threads = perCore.begin()->second;
+        for (const auto& [key, n] : perCore) {
+            if (n != threads) { threads = 1; break; }
+        }
+        int sockets = (int)perSocket.size();
+        for (const auto& [key, n] : perSocket) {
+            if (n != perSocket.begin()->second) { sockets = 1; break; }
+        }
+        int cores = cpuCores / (sockets * threads);
+        if (sockets * cores * threads != cpuCores) {
+            sockets = 1;
+            threads = 1;
+            cores = cpuCores;
+        }
+
+        return smp + ",sockets=" + std::to_string(sockets) + ",cores=" + std::to_string(cores) +
+               ",threads=" + std::to_string(threads);
+    }
+
+    // Reparte la RAM entre un nodo NUMA del invitado por cada nodo del host
+    // que aloje vCPUs. Sin fijación hay un único nodo sin afinidad.
+    std::vector<GuestMemoryNode> planMemoryNodes(long alignMB) {
+        std::vector<GuestMemoryNode> nodes;
+        long totalMB = (long)maxRAMGB * 1024;
+
+        if (vcpuPlacement.empty()) {
+            std::vector<int> vcpus;
+            for (int i = 0; i < cpuCores; i++) vcpus.push_back(i);
+            nodes.push_back({-1, vcpus, totalMB});
+            return nodes;
+        }
+
+        std::map<int, std::vector<int>> vcpusByNode;
+        for (size_t i = 0; i < vcpuPlacement.size(); i++) {
+            vcpusByNode[vcpuPlacement[i].node].push_back((int)i);
+        }
+
+        long assignedMB = 0;
+        for (const auto& [hostNode, vcpus] : vcpusByNode) {
+            long sizeMB = totalMB * (long)vcpus.size() / cpuCores;
+            sizeMB -= sizeMB % alignMB;
+            if (nodes.size() == vcpusByNode.size() - 1) sizeMB = totalMB - assignedMB;
+            assignedMB += sizeMB;
+            nodes.push_back({hostNode, vcpus, sizeMB});
+        }
+        return nodes;
+    }
+
+    // Comprueba que cada nodo del host tenga páginas enormes libres suficientes
+    bool hugepagesAvailable(const std::vector<GuestMemoryNode>& nodes, long pageKB) {
+        std::map<int, long> neededPages;
+        for (const auto& node : nodes) {
+            neededPages[node.hostNode] += node.sizeMB * 1024 / pageKB;
+        }
+        bool ok = true;
+        for (const auto& [hostNode, needed] : neededPages) {
+            long available = HugepagePool::freePages(pageKB, hostNode);
+            if (available < needed) {
+                std::string where = hostNode < 0 ? "host" : "NUMA node " + std::to_string(hostNode);
+                warning("Hugepage pool too small on " + where + ": need " + std::to_string(needed) +
+                        " x " + hugepageSize + " pages, " + std::to_string(std::max(available, 0L)) + " free");
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    // Backend de memoria: páginas enormes preasignadas si se pidieron y hay
+    // suficientes; si no, RAM normal ligada al nodo NUMA cuando hay fijación
+    void appendMemoryArguments(std::vector<std::string>& cmd) {
+        activeHugepageKB = 0;
+        long pageKB = HugepagePool::pageKB(hugepageSize);
+
+        if (pageKB > 0) {
+            if (hugepagesAvailable(planMemoryNodes(pageKB / 1024), pageKB)) {
+                activeHugepageKB = pageKB;
+            } else {
+                warning("Falling back to regular 4K pages for guest RAM");
+            }
+        }
+
+        // vhost-user (virtiofsd) mapea la RAM del invitado: debe ser compartida
+        bool shared = !shares.empty();
+        bool multiNode = !vcpuPlacement.empty() && topology.nodes.size() > 1;
+        if (activeHugepageKB == 0 && !multiNode && !shared) return;
+
+        std::string mountPoint = HugepagePool::mountPoint(activeHugepageKB);
+        auto nodes = planMemoryNodes(activeHugepageKB > 0 ? activeHugepageKB / 1024 : 1);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            const auto& node = nodes[i];
+            std::string memId = "ram-node" + std::to_string(i);
+            std::string backend;
+            if (activeHugepageKB == 0) {
+                backend = (shared ? "memory-backend-memfd,id=" : "memory-backend-ram,id=") + memId;
+            } else if (!mountPoint.empty()) {
+                backend = "memory-backend-file,id=" + memId + ",mem-path=" + mountPoint +
+                          ",prealloc=on,prealloc-threads=" + std::to_string(cpuCores);
+            } else {
+                backend = "memory-backend-memfd,id=" + memId + ",hugetlb=on,hugetlbsize=" + hugepageSize +
+                          ",prealloc=on,prealloc-threads=" + std::to_string(cpuCores);
+            }
+            backend += ",size=" + std::to_string(node.sizeMB) + "M";
+            if (shared) backend += ",share=on";
+            if (dedup && activeHugepageKB == 0) backend += ",merge=on";
+            if (node.hostNode >= 0) {
+                backend += ",host-nodes=" + std::to_string(node.hostNode) + ",policy=bind";
+            }
+
+            cmd.push_back("-object");
+            cmd.push_back(backend);
+            cmd.push_back("-numa");
+            cmd.push_back("node,nodeid=" + std::to_string(i) + ",cpus=" + formatCPUList(node.vcpus) +
+                          ",memdev=" + memId);
+        }
+
+        if (activeHugepageKB > 0) {
+            success("Guest RAM backed by " + hugepageSize + " hugepages (preallocated)");
+        }
+    }
+
+    // Fija cada hilo "CPU n/KVM" de QEMU a su CPU reservada del host y los
+    // hilos "IO iothreadN" a las CPUs libres de los mismos nodos NUMA
+    bool pinQEMUThreads() {
+        TraceSpan span = traceSpan("pinQEMUThreads", "qemu");
+        if (vcpuPlacement.empty() || qemuPid <= 0) return false;
+
+        std::string taskDir = "/proc/" + std::to_string(qemuPid) + "/task";
+        std::map<int, pid_t> vcpuThreads;
+        std::vector<pid_t> ioThreads;
+        std::vector<pid_t> emulatorThreads;
+
+        // Los hilos de vCPU aparecen poco después de arrancar QEMU
+        for (int attempt = 0; attempt < 50; attempt++) {
+            vcpuThreads.clear();
+            ioThreads.clear();
+            emulatorThreads.clear();
+            try {
+                for (const auto& entry : fs::directory_iterator(taskDir)) {
+                    std::string comm = readFirstLine(entry.path().string() + "/comm");
+                    pid_t tid = (pid_t)std::stoi(entry.path().filename().string());
+                    int index = -1;
+                    if (sscanf(comm.c_str(), "CPU %d/KVM", &index) == 1) {
+                        vcpuThreads[index] = tid;
+                    } else if (comm.rfind("IO iothread", 0) == 0) {
+                        ioThreads.push_back(tid);
+                    } else {
+                        emulatorThreads.push_back(tid);
+                    }
+                }
+            } catch (const std::exception&) {
+                // QEMU terminó o el hilo desapareció durante la lectura
+            }
+            if ((int)vcpuThreads.size() >= cpuCores) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+
+        if (vcpuThreads.empty()) {
+            warning("No vCPU threads found, pinning skipped");
+            return false;
+        }
+
+        int pinned = 0;
+        for (const auto& [index, tid] : vcpuThreads) {
+            if (index < 0 || index >= (int)vcpuPlacement.size()) continue;
+            if (setThreadAffinity(tid, {vcpuPlacement[index].id})) {
+                pinned++;
+                debug("vCPU " + std::to_string(index) + " → host CPU " + std::to_string(vcpuPlacement[index].id));
+            } else {
+                warning("Failed to pin vCPU " + std::to_string(index));
+            }
+        }
+        success("Pinned " + std::to_string(pinned) + "/" + std::to_string(cpuCores) + " vCPU threads");
+
+        if (!ioThreads.empty() && !ioThreadCPUs.empty()) {
+            int ioPinned = 0;
+            for (pid_t tid : ioThreads) {
+                if (setThreadAffinity(tid, ioThreadCPUs)) ioPinned++;
+            }
+            success("Pinned " + std::to_string(ioPinned) + " IOThread(s) to host CPUs " + formatCPUList(ioThreadCPUs));
+        }
+        if (latencyMode) applyLatencyScheduling(vcpuThreads, emulatorThreads);
+        return pinned == cpuCores;
+    }
+
+    // --latency: vCPUs en SCHED_FIFO 1 (por encima de todo SCHED_OTHER pero
+    // por debajo de los hilos de IRQ del kernel, en 50) y el resto de hilos
+    // de QEMU en la CPU de mantenimiento
+    void applyLatencyScheduling(const std::map<int, pid_t>& vcpuThreads, const std::vector<pid_t>& emulatorThreads) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = 1;
+        int realtime = 0;
+        int refusal = 0;           // errno del primer rechazo (EPERM sin CAP_SYS_NICE o presupuesto RT)
+        for (const auto& entry : vcpuThreads) {
+            if (sched_setscheduler(entry.second, SCHED_FIFO, &param) == 0) realtime++;
+            else if (refusal == 0) refusal = errno;
+        }
+        if (realtime < (int)vcpuThreads.size()) {
+            warning("SCHED_FIFO refused for " + std::to_string(vcpuThreads.size() - realtime) + " vCPU thread(s): " + strerror(refusal));
+        } else {
+            success("vCPU threads running SCHED_FIFO priority " + std::to_string(param.sched_priority));
+        }
+        // Sin límite de tiempo RT un vCPU que gira puede dejar sin CPU a los kworkers
+        if (readFirstLine("/proc/sys/kernel/sched_rt_runtime_us") == "-1") {
+            warning("RT throttling is disabled (sched_rt_runtime_us=-1); a spinning vCPU can starve its core");
+        }
+        if (housekeepingCPU < 0) return;
+        int moved = 0;
+        for (pid_t tid : emulatorThreads) {
+            if (setThreadAffinity(tid, {housekeepingCPU})) moved++;
+        }
+        success("Moved " + std::to_string(moved) + " emulator thread(s) to housekeeping CPU " + std::to_string(housekeepingCPU));
+    }
+
+    // QEMU bloquea toda su RAM con mem-lock=on: el límite se hereda al lanzarlo
+    void raiseMemlockLimit() {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur == RLIM_INFINITY) return;
+        limit.rlim_cur = limit.rlim_max = RLIM_INFINITY;
+        if (setrlimit(RLIMIT_MEMLOCK, &limit) != 0) {
+            warning("Cannot raise RLIMIT_MEMLOCK (" + std::string(strerror(errno)) + "), QEMU may fail to lock guest RAM");
+        }
+    }
+
+    // cgroup v2 propio de QEMU (/sys/fs/cgroup/cold-<vm>) cuando hay límites
+    // del perfil ([limits]) o --latency. Con --latency es además una
+    // partición cpuset "isolated" con las CPUs de los vCPUs y la de
+    // mantenimiento: el planificador deja de equilibrar carga hacia ellas y
+    // ninguna otra tarea del host puede usarlas mientras viva QEMU
+    bool joinCgroup() {
+        const std::string root = "/sys/fs/cgroup";
+        std::string available = readFirstLine(root + "/cgroup.controllers");
+        if (available.empty()) {
+            warning("cgroup v2 is not mounted on " + root + ", resource limits not applied");
+            return false;
+        }
+        auto write = [](const std::string& path, const std::string& value) {
+            std::ofstream file(path);
+            file << value;
+            file.close();
+            return !file.fail();
+        };
+        auto limit = [this](const std::string& key) {
+            auto it = resourceSettings.find("limits." + key);
+            return it == resourceSettings.end() ? std::string() : it->second;
+        };
+        bool isolate = latencyMode && !vcpuPlacement.empty();
+        std::vector<std::string> controllers;
+        if (isolate) controllers.push_back("cpuset");
+        if (!limit("cpu").empty()) controllers.push_back("cpu");
+        if (!limit("memory_high_gb").empty()) controllers.push_back("memory");
+        for (const std::string key : {"io_weight", "read_bps", "write_bps", "read_iops", "write_iops"}) {
+            if (!limit(key).empty()) {
+                controllers.push_back("io");
+                break;
+            }
+        }
+        for (const auto& controller : controllers) {
+            if (available.find(controller) == std::string::npos) {
+                warning("cgroup v2 " + controller + " controller not available");
+            } else if (!write(root + "/cgroup.subtree_control", "+" + controller)) {
+                warning("Cannot enable the " + controller + " controller: " + strerror(errno));
+            }
+        }
+
+        std::string path = root + "/cold-" + displayName();
+        std::error_code ec;
+        fs::create_directory(path, ec);
+        std::vector<int> cpus;
+        if (isolate) {
+            // cpuset.cpus/mems antes de mover a QEMU: un cpuset vacío lo rechaza
+            std::set<int> nodes;
+            for (const auto& cpu : vcpuPlacement) {
+                cpus.push_back(cpu.id);
+                nodes.insert(cpu.node);
+            }
+            if (housekeepingCPU >= 0) cpus.push_back(housekeepingCPU);
+            if (!write(path + "/cpuset.cpus", formatCPUList(cpus)) ||
+                !write(path + "/cpuset.mems", formatCPUList(std::vector<int>(nodes.begin(), nodes.end())))) {
+                warning("Cannot set the cpuset of " + path + ": " + strerror(errno));
+                isolate = false;
+            }
+        }
+        if (!write(path + "/cgroup.procs", std::to_string(qemuPid))) {
+            warning("Cannot move QEMU into " + path + ": " + strerror(errno));
+            fs::remove(path, ec);
+            return false;
+        }
+        cgroupPath = path;
+
+        // cpu.max: cuota por periodo de 100 ms; 2.5 = dos núcleos y medio
+        if (!limit("cpu").empty()) {
+            long quota = (long)(atof(limit("cpu").c_str()) * 100000);
+            if (!write(path + "/cpu.max", std::to_string(quota) + " 100000")) warning("Cannot set cpu.max");
+        }
+        // memory.high frena (no mata) a QEMU al superarlo: debe cubrir la RAM
+        // del invitado más lo que consume el propio QEMU
+        if (!limit("memory_high_gb").empty()) {
+            double gb = atof(limit("memory_high_gb").c_str());
+            if (gb < maxRAMGB + 0.5) {
+                warning("memory.high of " + limit("memory_high_gb") + " GB leaves no room for QEMU over " +
+                        std::to_string(maxRAMGB) + " GB of guest RAM; the guest will be throttled");
+            }
+            if (!write(path + "/memory.high", std::to_string((long long)(gb * 1024 * 1024 * 1024)))) {
+                warning("Cannot set memory.high");
+            }
+        }
+        // io.weight necesita BFQ o io.cost en el disco; io.max funciona siempre
+        if (!limit("io_weight").empty() && !write(path + "/io.weight", "default " + limit("io_weight"))) {
+            warning("Cannot set io.weight (needs the BFQ scheduler or io.cost on the disk)");
+        }
+        std::string ioMax;
+        for (const auto& [key, name] : std::vector<std::pair<std::string, std::string>>{
+                 {"read_bps", "rbps"}, {"write_bps", "wbps"}, {"read_iops", "riops"}, {"write_iops", "wiops"}}) {
+            if (!limit(key).empty()) ioMax += " " + name + "=" + limit(key);
+        }
+        if (!ioMax.empty()) {
+            for (const auto& device : diskBlockDevices()) {
+                if (!write(path + "/io.max", device + ioMax)) warning("Cannot set io.max for device " + device);
+            }
+        }
+
+        if (isolate) {
+            write(path + "/cpuset.cpus.partition", "isolated");
+            std::string state = readFirstLine(path + "/cpuset.cpus.partition");
+            if (state != "isolated") {
+                // Otra partición o un hermano con cpuset.cpus.exclusive ya usa esas CPUs
+                warning("cpuset partition is '" + state + "', QEMU is confined but the CPUs are not isolated");
+            } else {
+                success("QEMU isolated on host CPUs " + formatCPUList(cpus) + " (" + path + ")");
+            }
+        } else {
+            success("QEMU placed in " + path);
+        }
+        return true;
+    }
+
+    // Propiedades de throttle-group para el disco i: [throttle] vale para
+    // todos y [throttle.N] sobrescribe claves del disco N. Vacío = sin límite
+    std::string throttleGroup(size_t disk) {
+        std::map<std::string, std::string> merged;
+        std::string own = "throttle." + std::to_string(disk) + ".";
+        for (const auto& [key, value] : resourceSettings) {
+            if (key.rfind("throttle.", 0) == 0 && key != "throttle.shared" && !isdigit((unsigned char)key[9])) {
+                merged[key.substr(9)] = value;
+            }
+        }
+        if (!throttleShared()) {
+            for (const auto& [key, value] : resourceSettings) {
+                if (key.rfind(own, 0) == 0) merged[key.substr(own.size())] = value;
+            }
+        }
+        std::string properties;
+        for (const auto& entry : merged) {
+            std::string name = entry.first;
+            std::replace(name.begin(), name.end(), '_', '-');
+            properties += ",x-" + name + "=" + entry.second;
+        }
+        return properties;
+    }
+
+    // throttle.shared = true: un único grupo para todos los discos de la VM
+    bool throttleShared() const {
+        auto it = resourceSettings.find("throttle.shared");
+        return it != resourceSettings.end() && it->second == "1";
+    }
+
+    // Discos completos (MAJ:MIN) bajo las imágenes: io.max no acepta particiones
+    std::set<std::string> diskBlockDevices() {
+        std::set<std::string> devices;
+        for (const auto& disk : diskFiles) {
+            struct stat st;
+            if (stat(disk.c_str(), &st) != 0) continue;
+            std::string id = std::to_string(major(st.st_dev)) + ":" + std::to_string(minor(st.st_dev));
+            std::string sysfs = "/sys/dev/block/" + id;
+            if (!fs::exists(sysfs)) continue;   // tmpfs, overlayfs, NFS...
+            if (fs::exists(sysfs + "/partition")) {
+                std::string parent = readFirstLine(fs::canonical(sysfs).parent_path().string() + "/dev");
+                if (!parent.empty()) id = parent;
+            }
+            devices.insert(id);
+        }
+        return devices;
+    }
+
+    bool needsCgroup() const {
+        for (const auto& setting : resourceSettings) {
+            if (setting.first.rfind("limits.", 0) == 0) return true;
+        }
+        return latencyMode;
+    }
+
+    // rmdir sólo funciona con el cgroup vacío, es decir, con QEMU ya recogido
+    void leaveCgroup() {
+        if (cgroupPath.empty()) return;
+        if (rmdir(cgroupPath.c_str()) != 0 && errno != ENOENT) {
+            warning("Cannot remove " + cgroupPath + ": " + strerror(errno));
+        }
+        cgroupPath.clear();
+    }
+
+    // isolcpus= y nohz_full= de /proc/cmdline deben cubrir las CPUs de los
+    // vCPUs: sin ellos quedan el tick del planificador y kthreads por CPU
+    void checkLatencyHost() {
+        if (vcpuPlacement.empty()) {
+            warning("--latency needs pinned vCPUs; running without isolation");
+            return;
+        }
+        std::string cmdline = readFirstLine("/proc/cmdline");
+        auto listFor = [&cmdline](const std::string& key) {
+            std::set<int> cpus;
+            std::istringstream words(cmdline);
+            std::string word;
+            while (words >> word) {
+                if (word.rfind(key + "=", 0) != 0) continue;
+                std::string value = word.substr(key.size() + 1);
+                // isolcpus admite banderas delante: isolcpus=managed_irq,domain,2-5
+                size_t start = value.find_first_of("0123456789");
+                if (start == std::string::npos) continue;
+                for (int cpu : parseCPUList(value.substr(start))) cpus.insert(cpu);
+            }
+            return cpus;
+        };
+        for (const std::string key : {"isolcpus", "nohz_full"}) {
+            std::set<int> listed = listFor(key);
+            std::vector<int> missing;
+            for (const auto& cpu : vcpuPlacement) {
+                if (!listed.count(cpu.id)) missing.push_back(cpu.id);
+            }
+            if (!missing.empty()) {
+                warning("Host CPUs " + formatCPUList(missing) + " are not in " + key + "= on the kernel command line");
+            }
+        }
+    }
+
+    bool setThreadAffinity(pid_t tid, const std::vector<int>& hostCPUs) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : hostCPUs) CPU_SET(cpu, &set);
+        return sched_setaffinity(tid, sizeof(set), &set) == 0;
+    }
+
+    // CPUs para IOThreads: las no reservadas a vCPUs en los mismos nodos
+    // NUMA; si no quedan, cualquier CPU libre del host
+    void planIOThreadPlacement() {
+        ioThreadCPUs.clear();
+        if (vcpuPlacement.empty()) return;
+        if (housekeepingCPU >= 0) {
+            ioThreadCPUs.push_back(housekeepingCPU);
+            return;
+        }
+
+        std::set<int> vcpuNodes, reserved;
+        if (reservations) reserved = reservations->cpus;
+        for (const auto& cpu : vcpuPlacement) {
+            vcpuNodes.insert(cpu.node);
+            reserved.insert(cpu.id);
+        }
+        for (const auto& cpu : topology.cpus) {
+            if (!reserved.count(cpu.id) && vcpuNodes.count(cpu.node)) ioThreadCPUs.push_back(cpu.id);
+        }
+        if (ioThreadCPUs.empty()) {
+            for (const auto& cpu : topology.cpus) {
+                if (!reserved.count(cpu.id)) ioThreadCPUs.push_back(cpu.id);
+            }
+        }
+    }
+
+    // io_uring requiere Linux >= 5.1 y que no esté deshabilitado por sysctl
+    bool hostSupportsIoUring() {
+        struct utsname info;
+        if (uname(&info) != 0) return false;
+        int major = 0, minor = 0;
+        if (sscanf(info.release, "%d.%d", &major, &minor) != 2) return false;
+        if (major < 5 || (major == 5 && minor < 1)) return false;
+        std::string disabled = readFirstLine("/proc/sys/kernel/io_uring_disabled");
+        return disabled.empty() || disabled == "0";
+    }
+
+    // cache=none necesita O_DIRECT, que tmpfs y algunos FUSE no admiten
+    bool supportsDirectIO(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+        if (fd < 0) return false;
+        close(fd);
+        return true;
+    }
+
+    // Formato real y geometría de la imagen según qemu-img, cacheados como
+    // "formato:tamaño:clúster:extended_l2"; la extensión es el último recurso
+    DiskPolicy probeImage(const std::string& path) {
+        DiskPolicy image;
+        // El índice de medios ya sondeó esta versión del fichero
+        auto indexed = mediaIndex.find(path);
+        struct stat st;
+        if (indexed != mediaIndex.end() && indexed->second.kind == "disk" && !indexed->second.format.empty() &&
+            stat(path.c_str(), &st) == 0 && indexed->second.size == (long long)st.st_size &&
+            indexed->second.mtimeNs == mtimeNs(st)) {
+            image.format = indexed->second.format;
+            image.virtualSize = indexed->second.virtualSize;
+            image.clusterSize = indexed->second.clusterSize;
+            image.extendedL2 = indexed->second.extendedL2;
+            return image;
+        }
+        std::string key = imageCacheKey(path);
+        std::string cached;
+        {
+            std::lock_guard<std::mutex> lock(preflightMutex);
+            auto it = preflightCache.find(key);
+            if (!key.empty() && it != preflightCache.end()) cached = it->second;
+        }
+
+        if (std::count(cached.begin(), cached.end(), ':') != 3) {
+            std::string json = captureProgram({"qemu-img", "info", "-U", "--output=json", path});
+            std::string format = jsonStringField(json, "format");
+            cached.clear();
+            if (!format.empty()) {
+                cached = format + ":" + std::to_string((long long)jsonNumberField(json, "virtual-size", 0)) + ":" +
+                         std::to_string((long long)jsonNumberField(json, "cluster-size", 0)) + ":" +
+                         (jsonBoolField(json, "extended-l2") ? "1" : "0");
+                std::lock_guard<std::mutex> lock(preflightMutex);
+                if (!key.empty()) preflightCache[key] = cached;
+            }
+        }
+        if (!cached.empty()) {
+            std::stringstream fields(cached);
+            std::string size, cluster, extended;
+            std::getline(fields, image.format, ':');
+            std::getline(fields, size, ':');
+            std::getline(fields, cluster, ':');
+            std::getline(fields, extended, ':');
+            image.virtualSize = atoll(size.c_str());
+            image.clusterSize = atoll(cluster.c_str());
+            image.extendedL2 = extended == "1";
+            return image;
+        }
+
+        std::string ext = fs::path(path).extension().string();
+        image.format = ext == ".img" || ext == ".raw" ? "raw" : ext == ".vdi" ? "vdi" : ext == ".vmdk" ? "vmdk" : "qcow2";
+        return image;
+    }
+
+    std::string probeImageFormat(const std::string& path) { return probeImage(path).format; }
+
+    // Sistema de ficheros bajo la imagen (statfs f_type)
+    std::string filesystemType(const std::string& path) {
+        struct statfs info;
+        if (statfs(path.c_str(), &info) != 0) return "unknown";
+        switch ((unsigned long)info.f_type) {
+            case 0x01021994: return "tmpfs";
+            case 0x6969:     return "nfs";
+            case 0xEF53:     return "ext4";
+            case 0x58465342: return "xfs";
+            case 0x9123683E: return "btrfs";
+            case 0x2FC12FC1: return "zfs";
+            case 0x794C7630: return "overlay";
+            case 0x65735546: return "fuse";
+            case 0xFF534D42: return "cifs";
+            default:         return "unknown";
+        }
+    }
+
+    // Ajustes más rápidos que siguen siendo seguros para cada combinación
+    // de formato y sistema de ficheros
+    DiskPolicy resolveDiskPolicy(const std::string& path, bool ioUring) {
+        DiskPolicy policy = probeImage(path);
+        policy.filesystem = filesystemType(path);
+        policy.source = "auto";
+
+        bool direct = supportsDirectIO(path);
+        bool local = policy.filesystem == "ext4" || policy.filesystem == "xfs" || policy.filesystem == "btrfs";
+
+        if (policy.filesystem == "tmpfs" || !direct) {
+            // Sin O_DIRECT: la caché del host es inevitable
+            policy.cache = "writeback";
+            policy.aio = "threads";
+            policy.discard = "unmap";
+            policy.detectZeroes = policy.filesystem == "tmpfs" ? "unmap" : "off";
+        } else if (policy.filesystem == "nfs" || policy.filesystem == "cifs") {
+            // Red: evitar doble caché; el servidor no siempre admite hole punching
+            policy.cache = "none";
+            policy.aio = "native";
+            policy.discard = "ignore";
+            policy.detectZeroes = "off";
+        } else {
+            policy.cache = "none";
+            policy.aio = ioUring ? "io_uring" : "native";
+            policy.discard = local ? "unmap" : "ignore";
+            // En qcow2 los ceros se convierten en clústeres vacíos baratos; en
+            // raw sobre NVMe el coste de CPU de detectarlos no compensa
+            policy.detectZeroes = (policy.format == "qcow2" && local) ? "unmap" : "off";
+        }
+
+        applySidecarOverrides(path, policy);
+
+        // Caché L2 que cubre todo el disco virtual (QEMU se queda en 32 MiB,
+        // 256 GiB con clústeres de 64K): cada entrada mapea un clúster
+        if (policy.format == "qcow2" && policy.l2CacheBytes == 0 && policy.clusterSize > 0 && policy.virtualSize > 0) {
+            long long entries = (policy.virtualSize + policy.clusterSize - 1) / policy.clusterSize;
+            long long bytes = entries * (policy.extendedL2 ? 16 : 8);
+            bytes = (bytes + policy.clusterSize - 1) / policy.clusterSize * policy.clusterSize;
+            const long long cap = 256LL << 20;
+            if (bytes > cap) {
+                warning(fs::path(path).filename().string() + ": L2 cache capped at 256 MiB, covering " +
+                        std::to_string(policy.virtualSize * cap / bytes >> 30) + " GiB (larger clusters would cover it all)");
+                bytes = cap;
+            }
+            policy.l2CacheBytes = std::max(bytes, 2 * policy.clusterSize);
+        }
+        return policy;
+    }
+
+    // <imagen>.cold con líneas clave=valor (format, cache, aio, discard,
+    // detect-zeroes, l2-cache-size)
+    void applySidecarOverrides(const std::string& path, DiskPolicy& policy) {
+        std::string sidecar = path + ".cold";
+        std::ifstream file(sidecar);
+        if (!file) return;
+
+        std::string line;
+        while (std::getline(file, line)) {
+            line.erase(0, line.find_first_not_of(" \t"));
+            if (line.empty() || line[0] == '#') continue;
+            size_t eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            std::string key = line.substr(0, eq);
+            std::string value = line.substr(eq + 1);
+            key.erase(key.find_last_not_of(" \t") + 1);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t\r") + 1);
+
+            if (key == "format") policy.format = value;
+            else if (key == "cache" && (value == "none" || value == "writeback")) policy.cache = value;
+            else if (key == "aio" && (value == "threads" || value == "native" || value == "io_uring")) policy.aio = value;
+            else if (key == "discard" && (value == "unmap" || value == "ignore")) policy.discard = value;
+            else if (key == "detect-zeroes" && (value == "off" || value == "on" || value == "unmap")) policy.detectZeroes = value;
+            else if (key == "l2-cache-size" && parseByteSize(value) > 0) policy.l2CacheBytes = parseByteSize(value);
+            else {
+                warning("Ignoring unknown setting '" + line + "' in " + sidecar);
+                continue;
+            }
+            policy.source = "sidecar";
+        }
+
+        // aio=native sólo funciona con O_DIRECT
+        if (policy.aio == "native" && policy.cache != "none") {
+            warning(fs::path(path).filename().string() + ": aio=native requires cache=none, using threads");
+            policy.aio = "threads";
+        }
+    }
+
+    // Resuelve las políticas en paralelo (cada una lanza qemu-img)
+    void resolveDiskPolicies() {
+        TraceSpan span = traceSpan("resolveDiskPolicies", "storage");
+        diskPolicies.clear();
+        bool ioUring = hostSupportsIoUring();
+        std::vector<std::future<DiskPolicy>> tasks;
+        for (const auto& disk : diskFiles) {
+            tasks.push_back(std::async(std::launch::async, [this, disk, ioUring] {
+                return resolveDiskPolicy(disk, ioUring);
+            }));
+        }
+        for (auto& task : tasks) diskPolicies.push_back(task.get());
+        savePreflightCache();
+    }
+
+    // Clon instantáneo con FICLONE (XFS/btrfs): extents compartidos hasta
+    // que el invitado escribe. Falla si el destino está en otro sistema.
+    bool reflinkClone(const std::string& source, const std::string& target) {
+        int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) return false;
+        int out = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (out < 0) {
+            close(in);
+            return false;
+        }
+        bool ok = ioctl(out, FICLONE, in) == 0;
+        int err = errno;
+        close(out);
+        close(in);
+        if (!ok) {
+            fs::remove(target);
+            debug("Reflink not possible: " + std::string(strerror(err)));
+        }
+        return ok;
+    }
+
+    // Disco de la instancia a partir de una imagen dorada compartida: overlay
+    // qcow2 fino con backing_file (la caché de páginas de la base se comparte
+    // entre instancias) o, con --clone=reflink, una copia reflink independiente
+    bool provisionFromBase() {
+        std::string base = fs::absolute(baseImage).lexically_normal().string();
+        if (!fs::exists(base)) {
+            error("Base image not found: " + base);
+            return false;
+        }
+        
+        long long started = monotonicMs();
+        if (cloneMode == "reflink") {
+            std::string target = diskDir + "/" + fs::path(base).filename().string();
+            if (fs::exists(target)) return true;
+            if (reflinkClone(base, target)) {
+                success("Reflinked " + fs::path(base).filename().string() + " in " +
+                        std::to_string(monotonicMs() - started) + " ms");
+                return true;
+            }
+            warning("Reflink clone unavailable here, using a qcow2 overlay instead");
+        }
+        
+        std::string overlay = diskDir + "/disk.qcow2";
+        if (fs::exists(overlay)) return true;
+        
+        log("Creating overlay on " + fs::path(base).filename().string() + "...");
+        std::string format = probeImageFormat(base);
+        int result = runProgram({"qemu-img", "create", "-q", "-f", "qcow2", "-o", qcow2Options(false), "-F", format, "-b", base, overlay});
+        if (result != 0) {
+            error("Failed to create overlay disk!");
+            return false;
+        }
+        success("Overlay disk created in " + std::to_string(monotonicMs() - started) + " ms");
+        return true;
+    }
+
+    std::vector<std::string> buildQEMUCommand() {
+        TraceSpan span = traceSpan("buildQEMUCommand", "qemu");
+        std::vector<std::string> cmd;
+        
+        cmd.push_back("qemu-system-x86_64");
+        
+        // Nombres de hilo "CPU n/KVM" para poder fijarlos
+        cmd.push_back("-name");
+        cmd.push_back((instanceName.empty() ? "cold" : "cold-" + instanceName) + ",debug-threads=on");
+        
+        // Monitor QMP para readiness y control
+        cmd.push_back("-chardev");
+        cmd.push_back("socket,id=qmp0,path=" + runDir + "/qmp.sock,server=on,wait=off");
+        cmd.push_back("-mon");
+        cmd.push_back("chardev=qmp0,mode=control");
+        // Segundo monitor para las órdenes de la CLI (suspend, migrate...)
+        cmd.push_back("-chardev");
+        cmd.push_back("socket,id=qmp1,path=" + runDir + "/control.sock,server=on,wait=off");
+        cmd.push_back("-mon");
+        cmd.push_back("chardev=qmp1,mode=control");
+        // Canal de qemu-guest-agent (guest-exec, guest-ping)
+        cmd.push_back("-chardev");
+        cmd.push_back("socket,id=qga0,path=" + runDir + "/qga.sock,server=on,wait=off");
+        cmd.push_back("-device");
+        cmd.push_back("virtio-serial-pci,id=qga-serial");
+        cmd.push_back("-device");
+        cmd.push_back("virtserialport,bus=qga-serial.0,chardev=qga0,name=org.qemu.guest_agent.0");
+        
+        // Aceleración KVM
+        cmd.push_back("-enable-kvm");
+        
+        // CPU
+        if (!placementPlanned) planCPUPlacement();
+        cmd.push_back("-cpu");
+        cmd.push_back(cpuModel);
+        cmd.push_back("-smp");
+        cmd.push_back(buildSMPArgument());
+        
+        // RAM
+        cmd.push_back("-m");
+        cmd.push_back(std::to_string(maxRAMGB) + "G");
+        appendMemoryArguments(cmd);
+        // RAM bloqueada (sin swap ni fallos de página) y HLT/MWAIT dentro del
+        // invitado: un vCPU ocioso no sale a KVM ni cede su CPU
+        if (latencyMode) {
+            cmd.push_back("-overcommit");
+            cmd.push_back("mem-lock=on,cpu-pm=on");
+        }
+        // Free page reporting devuelve al host lo que el invitado libera;
+        // deflate-on-oom suelta el globo antes de que el OOM killer actúe
+        if (balloonEnabled()) {
+            cmd.push_back("-device");
+            cmd.push_back("virtio-balloon-pci,id=balloon0,free-page-reporting=on,deflate-on-oom=on");
+        }
+        
+        // Pantalla: el navegador habla directamente con el websocket de QEMU;
+        // SPICE local entrega el framebuffer GL por dmabuf sin copiarlo
+        if (displayMode == "spice") {
+            std::string renderNode = findRenderNode();
+            cmd.push_back("-device");
+            cmd.push_back(renderNode.empty() ? "virtio-vga" : "virtio-vga-gl");
+            cmd.push_back("-display");
+            cmd.push_back("none");
+            cmd.push_back("-spice");
+            if (!renderNode.empty()) {
+                cmd.push_back("unix=on,addr=" + spiceSocketPath() + ",disable-ticketing=on,gl=on,rendernode=" + renderNode);
+            } else {
+                cmd.push_back("port=" + std::to_string(5930 + vncDisplay) + ",disable-ticketing=on,"
+                              "image-compression=auto_glz,jpeg-wan-compression=auto,"
+                              "zlib-glz-wan-compression=auto,streaming-video=filter");
+            }
+            // Agente SPICE: portapapeles y redimensionado
+            cmd.push_back("-device");
+            cmd.push_back("virtio-serial-pci,id=spice-serial");
+            cmd.push_back("-chardev");
+            cmd.push_back("spicevmc,id=vdagent,name=vdagent");
+            cmd.push_back("-device");
+            cmd.push_back("virtserialport,bus=spice-serial.0,chardev=vdagent,name=com.redhat.spice.0");
+        } else {
+            cmd.push_back("-vga");
+            cmd.push_back("virtio");
+            cmd.push_back("-display");
+            if (displayMode == "gtk") {
+                cmd.push_back("gtk,gl=on");
+            } else if (displayMode == "none") {
+                cmd.push_back("none");
+            } else {
+                cmd.push_back("none");
+                cmd.push_back("-vnc");
+                cmd.push_back(vncArgument());
+            }
+        }
+        
+        // UEFI Firmware (OVMF)
+        if (fs::exists(firmwarePath)) {
+            cmd.push_back("-drive");
+            cmd.push_back("if=pflash,format=raw,readonly=on,file=" + firmwarePath);
+            
+            if (createVarsFile()) {
+                cmd.push_back("-drive");
+                cmd.push_back("if=pflash,format=raw,file=" + varsPath);
+            }
+        }
+        
+        // Discos: -blockdev + virtio-blk-pci, cada uno con su IOThread
+        if (!diskFiles.empty()) {
+            log("Attaching " + std::to_string(diskFiles.size()) + " disk(s):");
+            planIOThreadPlacement();
+            if (diskPolicies.size() != diskFiles.size()) resolveDiskPolicies();
+            for (size_t i = 0; i < diskFiles.size(); i++) {
+                std::string diskPath = diskFiles[i];
+                const DiskPolicy& policy = diskPolicies[i];
+                
+                std::string id = std::to_string(i);
+                cmd.push_back("-object");
+                cmd.push_back("iothread,id=iothread" + id);
+                std::string cache = policy.cache == "none" ? "cache.direct=on,cache.no-flush=off"
+                                                           : "cache.direct=off,cache.no-flush=off";
+                std::string tuning = "," + cache + ",discard=" + policy.discard +
+                                     ",detect-zeroes=" + policy.detectZeroes;
+                cmd.push_back("-blockdev");
+                cmd.push_back("driver=file,node-name=file" + id + ",filename=" + diskPath +
+                              ",aio=" + policy.aio + tuning);
+                cmd.push_back("-blockdev");
+                cmd.push_back("driver=" + policy.format + ",node-name=disk" + id + ",file=file" + id + tuning +
+                              (policy.l2CacheBytes > 0 ? ",l2-cache-size=" + std::to_string(policy.l2CacheBytes) : ""));
+                // Límites de IOPS/bps del perfil: un nodo throttle encima del formato
+                std::string root = "disk" + id;
+                std::string group = throttleGroup(i);
+                if (!group.empty()) {
+                    std::string groupId = throttleShared() ? "tg" : "tg" + id;
+                    if (i == 0 || !throttleShared()) {
+                        cmd.push_back("-object");
+                        cmd.push_back("throttle-group,id=" + groupId + group);
+                    }
+                    root = "throttle" + id;
+                    cmd.push_back("-blockdev");
+                    cmd.push_back("driver=throttle,node-name=" + root + ",throttle-group=" + groupId + ",file=disk" + id);
+                }
+                cmd.push_back("-device");
+                cmd.push_back("virtio-blk-pci,drive=" + root + ",iothread=iothread" + id +
+                              ",num-queues=" + std::to_string(cpuCores) +
+                              ",bootindex=" + std::to_string(i + (isoFiles.empty() ? 0 : 1)));
+                
+                std::string bootFlag = (i == 0) ? " [PRIMARY BOOT]" : "";
+                log("  → " + fs::path(diskPath).filename().string() + bootFlag + " (iothread" + id +
+                    (group.empty() ? "" : ", throttled") + ")");
+            }
+        }
+        
+        // ISOs
+        if (!isoFiles.empty()) {
+            log("Attaching " + std::to_string(isoFiles.size()) + " ISO(s):");
+            for (size_t i = 0; i < isoFiles.size(); i++) {
+                std::string isoPath = isoFiles[i];
+                
+                if (i == 0) {
+                    // Con bootindex en los discos, el CDROM también lo necesita
+                    cmd.push_back("-drive");
+                    cmd.push_back("file=" + isoPath + ",media=cdrom,readonly=on,if=none,id=cdrom0");
+                    cmd.push_back("-device");
+                    cmd.push_back("ide-cd,drive=cdrom0,bus=ide.0,bootindex=0");
+                    log("  → " + fs::path(isoPath).filename().string() + " [CDROM - BOOT PRIORITY]");
+                } else {
+                    cmd.push_back("-drive");
+                    cmd.push_back("file=" + isoPath + ",media=cdrom,readonly=on,if=ide,index=" + std::to_string(i));
+                    log("  → " + fs::path(isoPath).filename().string() + " [CDROM " + std::to_string(i) + "]");
+                }
+            }
+        }
+        
+        // Audio con ALSA
+        if (enableAudio) {
+            cmd.push_back("-audiodev");
+            cmd.push_back("alsa,id=audio0");
+            cmd.push_back("-device");
+            cmd.push_back("intel-hda");
+            
+            if (enableMicrophone) {
+                cmd.push_back("-device");
+                cmd.push_back("hda-duplex,audiodev=audio0");
+                success("Audio & Microphone enabled!");
+            } else {
+                cmd.push_back("-device");
+                cmd.push_back("hda-output,audiodev=audio0");
+                success("Audio enabled (no microphone)");
+                warning("Microphone is disabled!");
+            }
+        } else {
+            warning("Audio is disabled!");
+        }
+        
+        // Red: tap multiqueue con vhost-net, bridge helper, passt o slirp
+        if (netBackend.empty()) selectNetworkBackend();
+        if (netBackend == "tap") {
+            int queues = std::max(1, std::min(cpuCores, 16));
+            std::string device = "virtio-net-pci,netdev=net0,mac=" + macAddress;
+            if (queues > 1) {
+                device += ",mq=on,vectors=" + std::to_string(2 * queues + 2);
+            }
+            cmd.push_back("-netdev");
+            cmd.push_back("tap,id=net0,ifname=" + tapInterface + ",script=no,downscript=no,queues=" +
+                          std::to_string(queues) + ",vhost=" + (vhostNetAvailable ? "on" : "off"));
+            cmd.push_back("-device");
+            cmd.push_back(device);
+            success("Network: Bridge mode (" + bridgeInterface + ") via " + tapInterface + ", " +
+                    std::to_string(queues) + " queue(s)" + (vhostNetAvailable ? ", vhost-net" : "") + "!");
+        } else if (netBackend == "bridge") {
+            cmd.push_back("-netdev");
+            cmd.push_back("bridge,id=net0,br=" + bridgeInterface);
+            cmd.push_back("-device");
+            cmd.push_back("virtio-net-pci,netdev=net0,mac=" + macAddress);
+            success("Network: Bridge mode (" + bridgeInterface + ") with internet access!");
+        } else if (netBackend == "passt") {
+            cmd.push_back("-netdev");
+            cmd.push_back("stream,id=net0,server=off,addr.type=unix,addr.path=" + runDir + "/passt.sock");
+            cmd.push_back("-device");
+            cmd.push_back("virtio-net-pci,netdev=net0,mac=" + macAddress);
+            success("Network: NAT mode (passt) with internet access!");
+        } else {
+            cmd.push_back("-netdev");
+            cmd.push_back("user,id=net0");
+            cmd.push_back("-device");
+            cmd.push_back("virtio-net-pci,netdev=net0,mac=" + macAddress);
+            success("Network: NAT mode with internet access!");
+        }
+        
+        // Carpetas compartidas: un virtiofsd por carpeta, ya arrancado
+        bool dax = preflightCache["virtiofs.dax"] == "1";
+        for (size_t i = 0; i < shares.size(); i++) {
+            const auto& share = shares[i];
+            std::string id = "fs" + std::to_string(i);
+            cmd.push_back("-chardev");
+            cmd.push_back("socket,id=" + id + ",path=" + shareSocket(share));
+            cmd.push_back("-device");
+            cmd.push_back("vhost-user-fs-pci,chardev=" + id + ",tag=" + share.tag + ",queue-size=1024" +
+                          (dax && share.daxGB > 0 ? ",cache-size=" + std::to_string(share.daxGB) + "G" : ""));
+        }
+        
+        // Dispositivos PCI del host ya enlazados a vfio-pci
+        for (size_t i = 0; i < passthroughDevices.size(); i++) {
+            cmd.push_back("-device");
+            cmd.push_back("vfio-pci,host=" + passthroughDevices[i] + ",id=hostpci" + std::to_string(i));
+        }
+        
+        // USB Controller y dispositivos
+        cmd.push_back("-device");
+        cmd.push_back("qemu-xhci,id=xhci");
+        
+        // Tablet para mejor precisión del mouse
+        cmd.push_back("-device");
+        cmd.push_back("usb-tablet");
+        
+        // Cámara web (USB passthrough)
+        if (enableCamera) {
+            if (!camera.probed) camera = detectCamera();
+            if (camera.found) {
+                // Usar USB passthrough con los IDs detectados
+                cmd.push_back("-device");
+                cmd.push_back("usb-host,vendorid=0x" + camera.vendor + ",productid=0x" + camera.product);
+                success("Camera enabled: " + camera.name);
+                debug("Camera IDs: " + camera.vendor + ":" + camera.product);
+            } else {
+                warning("No camera device found! Camera disabled.");
+                warning("Make sure your camera is connected and working");
+            }
+        } else {
+            warning("Camera is disabled!");
+        }
+        
+        // Más dispositivos USB; con --usb-hotplug los conecta el supervisor
+        if (!usbHotplug) {
+            for (const auto& device : usbHostArguments()) {
+                cmd.push_back("-device");
+                cmd.push_back(device);
+            }
+        }
+        
+        // RTC
+        cmd.push_back("-rtc");
+        cmd.push_back("base=localtime,clock=host,driftfix=slew");
+        
+        // Boot order
+        if (!isoFiles.empty()) {
+            cmd.push_back("-boot");
+            cmd.push_back("order=dc,menu=on");
+        } else {
+            cmd.push_back("-boot");
+            cmd.push_back("order=c,menu=on");
+        }
+        
+        // Mejoras de rendimiento
+        cmd.push_back("-machine");
+        cmd.push_back(dedup ? "type=q35,accel=kvm,mem-merge=on" : "type=q35,accel=kvm");
+        
+        return cmd;
+    }
+
+    // VNC en :N; en modo websocket QEMU sirve también el websocket en 5700+N.
+    // JPEG (lossy) sólo cuando el enlace no es una LAN.
+    std::string vncArgument() {
+        std::string arg = ":" + std::to_string(vncDisplay);
+        if (displayMode == "websocket") arg += ",websocket=on";
+        arg += vncLink == "lan" ? ",lossy=off" : ",lossy=on";
+        return arg;
+    }
+
+    int websocketPort() { return 5700 + vncDisplay; }
+    std::string spiceSocketPath() { return fs::absolute(runDir + "/spice.sock").lexically_normal().string(); }
+
+    // Primer nodo de render DRM utilizable para virtio-gpu GL
+    std::string findRenderNode() {
+        for (int minor = 128; minor < 136; minor++) {
+            std::string node = "/dev/dri/renderD" + std::to_string(minor);
+            if (access(node.c_str(), R_OK | W_OK) == 0) return node;
+        }
+        return "";
+    }
+
+    // Ajustes del enlace con los valores fijados por CLI por encima
+    DisplayTuning applyDisplayOverrides(DisplayTuning tuning) {
+        if (vncQuality >= 0) tuning.quality = vncQuality;
+        if (vncCompression >= 0) tuning.compression = vncCompression;
+        if (vncEncoding != "auto") tuning.encoding = vncEncoding;
+        if (vncFPS > 0) tuning.fps = std::min(tuning.fps, vncFPS);
+        return tuning;
+    }
+
+    // Punto de partida antes de medir el enlace de un cliente
+    DisplayTuning baseDisplayTuning() {
+        return applyDisplayOverrides(DisplayTuning::forTier(vncLink == "auto" ? "fast" : vncLink));
+    }
+
+    bool adaptiveDisplay() const {
+        return (displayMode == "websocket" || displayMode == "websockify") && vncLink == "auto";
+    }
+
+    // Puerto al que se conecta el navegador (QEMU o websockify)
+    int displayClientPort() { return displayMode == "websocket" ? websocketPort() : webPort; }
+
+    std::string displayName() const { return instanceName.empty() ? "cold" : instanceName; }
+
+    // Tramo de la traza de arranque etiquetado con esta VM
+    TraceSpan traceSpan(const std::string& name, const std::string& category) const {
+        return TraceSpan(name, category, displayName());
+    }
+
+    // Gobernador: mide RTT y entrega de cada cliente y cambia de nivel tras
+    // dos muestras seguidas para no oscilar
+    void sampleDisplayClients() {
+        long long now = monotonicMs();
+        std::map<std::string, TCPClientSample> worst;
+        for (const auto& sample : sampleTCPClients(displayClientPort())) {
+            auto it = worst.find(sample.address);
+            if (it == worst.end() || sample.rttMs > it->second.rttMs) worst[sample.address] = sample;
+        }
+        for (const auto& [address, sample] : worst) {
+            auto inserted = displayClients.emplace(address, DisplayClient());
+            DisplayClient& client = inserted.first->second;
+            if (inserted.second) client.tuning = baseDisplayTuning();
+            client.lastSeenMs = now;
+            client.rttMs = sample.rttMs;
+            // Una muestra limitada por la aplicación sólo dice que el enlace da para más
+            if (!sample.appLimited || sample.deliveryMbps > client.mbps) client.mbps = sample.deliveryMbps;
+
+            std::string tier = DisplayTuning::classify(client.rttMs, client.mbps);
+            if (tier == client.tuning.tier) {
+                client.pendingSamples = 0;
+                continue;
+            }
+            client.pendingSamples = tier == client.pendingTier ? client.pendingSamples + 1 : 1;
+            client.pendingTier = tier;
+            if (client.pendingSamples < 2) continue;
+
+            client.tuning = applyDisplayOverrides(DisplayTuning::forTier(tier));
+            client.pendingSamples = 0;
+            std::ostringstream line;
+            line << "Display client " << address << ": " << tier << " link (rtt " << std::fixed
+                 << std::setprecision(1) << client.rttMs << " ms, " << client.mbps << " Mbps) -> "
+                 << client.tuning.encoding << ", quality " << client.tuning.quality << ", compression "
+                 << client.tuning.compression << ", " << client.tuning.fps << " fps";
+            log(line.str());
+        }
+        for (auto it = displayClients.begin(); it != displayClients.end(); ) {
+            if (now - it->second.lastSeenMs > 60000) it = displayClients.erase(it);
+            else ++it;
+        }
+    }
+
+    // Respuesta a GET /display/<vm> que la página consulta cada 2 s
+    std::string displayTuningJSON(const std::string& address) {
+        auto it = displayClients.find(address);
+        return it == displayClients.end() ? baseDisplayTuning().toJSON() : it->second.tuning.toJSON();
+    }
+
+    // Ajustes iniciales y puerto del gobernador viajan en la URL de cold.html
+    std::string noVNCURL() {
+        DisplayTuning tuning = baseDisplayTuning();
+        std::ostringstream url;
+        url << "http://localhost:" << webPort << "/cold.html?resize=remote&port=" << displayClientPort()
+            << "&path=" << (displayMode == "websockify" ? "websockify" : "") << "&encoding=" << tuning.encoding
+            << "&quality=" << tuning.quality << "&compression=" << tuning.compression << "&fps=" << tuning.fps;
+        if (adaptiveDisplay() && tuningPort > 0) url << "&tuning=" << tuningPort << "&vm=" << displayName();
+        return url.str();
+    }
+
+    // Cliente noVNC de Cold: ordena las codificaciones (QEMU usa la primera
+    // que conoce), espacia las peticiones incrementales según el tope de
+    // fotogramas y aplica los ajustes que publica el supervisor
+    static const char* coldViewerPage() {
+        return R"HTML(<!DOCTYPE html>
+<html>
+<head>
+<meta charset="utf-8">
+<title>Cold VM</title>
+<style>html, body { margin: 0; height: 100%; background: #111; } #screen { width: 100%; height: 100%; }</style>
+</head>
+<body>
+<div id="screen"></div>
+<script type="module">
+import RFB from './core/rfb.js';
+
+const params = new URLSearchParams(location.search);
+const number = (key, fallback) => params.has(key) ? Number(params.get(key)) : fallback;
+const ENCODINGS = { raw: 0, tight: 7, zrle: 16 };
+let tuning = {
+    encoding: params.get('encoding') || 'tight',
+    quality: number('quality', 6),
+    compression: number('compression', 2),
+    fps: number('fps', 30),
+};
+
+const sendEncodings = RFB.messages.clientEncodings;
+RFB.messages.clientEncodings = (sock, encodings) => {
+    const first = ENCODINGS[tuning.encoding];
+    sendEncodings(sock, first === undefined ? encodings : [first, ...encodings.filter(e => e !== first)]);
+};
+
+const sendUpdateRequest = RFB.messages.fbUpdateRequest;
+let lastRequest = 0;
+let pending = null;
+RFB.messages.fbUpdateRequest = (sock, incremental, x, y, w, h) => {
+    const send = () => { lastRequest = performance.now(); sendUpdateRequest(sock, incremental, x, y, w, h); };
+    const wait = incremental ? lastRequest + 1000 / tuning.fps - performance.now() : 0;
+    clearTimeout(pending);
+    if (wait <= 0) send(); else pending = setTimeout(send, wait);
+};
+
+const scheme = location.protocol === 'https:' ? 'wss' : 'ws';
+const rfb = new RFB(document.getElementById('screen'),
+    `${scheme}://${location.hostname}:${params.get('port') || location.port}/${params.get('path') || ''}`);
+rfb.scaleViewport = true;
+rfb.resizeSession = params.get('resize') === 'remote';
+
+function apply(next) {
+    const encodingChanged = next.encoding !== tuning.encoding;
+    tuning = Object.assign({}, tuning, next);
+    rfb.qualityLevel = tuning.quality;
+    rfb.compressionLevel = tuning.compression;
+    if (encodingChanged) {
+        // Fuerza un SetEncodings nuevo con el orden actualizado
+        rfb.compressionLevel = (tuning.compression + 1) % 10;
+        rfb.compressionLevel = tuning.compression;
+    }
+}
+apply(tuning);
+
+if (params.has('tuning')) {
+    const url = `${location.protocol}//${location.hostname}:${params.get('tuning')}/display/${params.get('vm')}`;
+    setInterval(() => fetch(url, { cache: 'no-store' }).then(r => r.json()).then(apply).catch(() => {}), 2000);
+}
+</script>
+</body>
+</html>
+)HTML";
+    }
+
+    // Raíz web propia de la instancia: enlaces a noVNC más cold.html
+    bool prepareWebRoot() {
+        std::string webRoot = runDir + "/web";
+        std::error_code ec;
+        fs::create_directories(webRoot, ec);
+        for (const auto& entry : fs::directory_iterator(noVNCPath, ec)) {
+            fs::path link = fs::path(webRoot) / entry.path().filename();
+            if (fs::is_symlink(link) || fs::exists(link)) continue;
+            fs::create_symlink(fs::absolute(entry.path()), link, ec);
+        }
+        std::ofstream page(webRoot + "/cold.html", std::ios::trunc);
+        page << coldViewerPage();
+        return (bool)page;
+    }
+
+    std::string webServerName() const { return displayMode == "websockify" ? "Websockify" : "noVNC web server"; }
+
+    // Páginas de noVNC. En modo websocket sólo entrega los ficheros estáticos
+    // y los fotogramas van de QEMU al navegador; websockify reenvía cada uno.
+    bool startWebServer() {
+        TraceSpan span = traceSpan("startWebServer", "display");
+        if (displayMode != "websocket" && displayMode != "websockify") return true;
+        
+        log("Starting " + webServerName() + "...");
+        
+        if (!fs::exists(noVNCPath)) {
+            error("noVNC directory not found at: " + noVNCPath);
+            return false;
+        }
+        if (!prepareWebRoot()) {
+            error("Cannot write the noVNC web root in " + runDir);
+            return false;
+        }
+        
+        long long started = monotonicMs();
+        std::string failure;
+        std::string webRoot = runDir + "/web";
+        std::vector<std::string> argv;
+        if (displayMode == "websockify") {
+            argv = {"websockify", "--web=" + webRoot, std::to_string(webPort),
+                    "localhost:" + std::to_string(5900 + vncDisplay)};
+        } else {
+            argv = {"python3", "-m", "http.server", std::to_string(webPort), "--directory", webRoot};
+        }
+        pid_t pid = spawnProcess(argv, failure, runDir + "/web.log");
+        if (pid < 0) {
+            error("Failed to launch " + webServerName() + ": " + failure);
+            return false;
+        }
+        webPid = pid;
+        
+        // Listo cuando acepta conexiones en su puerto
+        if (!waitForTCPPort(webPid, webPort, 10000)) {
+            error(webServerName() + " did not start listening on port " + std::to_string(webPort));
+            kill(webPid, SIGTERM);
+            waitpid(webPid, nullptr, 0);
+            webPid = -1;
+            return false;
+        }
+        debug(webServerName() + " ready in " + std::to_string(monotonicMs() - started) + " ms");
+        StartupTrace::instance().instant(webServerName() + " ready", displayName());
+        return true;
+    }
+
+    // Espera a que un puerto local acepte conexiones mientras el proceso viva
+    bool waitForTCPPort(pid_t pid, int port, int timeoutMs) {
+        long long deadline = monotonicMs() + timeoutMs;
+        while (monotonicMs() < deadline) {
+            if (waitpid(pid, nullptr, WNOHANG) == pid) return false;
+
+            int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (sock < 0) return false;
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons((uint16_t)port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bool ok = connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+            close(sock);
+            if (ok) return true;
+            poll(nullptr, 0, 20);
+        }
+        return false;
+    }
+
+    // Espera a que QMP responda a qmp_capabilities; falla enseguida si QEMU muere
+    bool waitForQMP(int timeoutMs) {
+        TraceSpan span = traceSpan("waitForQMP", "qemu");
+        std::string socketPath = runDir + "/qmp.sock";
+        long long deadline = monotonicMs() + timeoutMs;
+        while (monotonicMs() < deadline) {
+            int status = 0;
+            if (waitpid(qemuPid, &status, WNOHANG) == qemuPid) {
+                if (WIFEXITED(status)) {
+                    error("QEMU exited during startup with status " + std::to_string(WEXITSTATUS(status)));
+                } else if (WIFSIGNALED(status)) {
+                    error("QEMU was killed during startup by signal " + std::to_string(WTERMSIG(status)));
+                }
+                qemuPid = -1;
+                return false;
+            }
+            if (fs::exists(socketPath) &&
+                qmp.connectTo(socketPath, (int)std::max(1LL, deadline - monotonicMs()))) {
+                return true;
+            }
+            poll(nullptr, 0, 20);
+        }
+        error("Timed out waiting for QEMU monitor");
+        return false;
+    }
+
+    bool startQEMU() {
+        TraceSpan span = traceSpan("startQEMU", "qemu");
+        log("Starting QEMU virtual machine...");
+        
+        prepareNetwork();
+        if (!startShares()) return false;
+        auto cmd = compiledArgv.empty() ? buildQEMUCommand() : compiledArgv;
+        if (compiledArgv.empty() && !profileHash.empty() && hugepageSize.empty() && !incomingMigration) {
+            saveCompiledCommand(cmd);
+            compiledArgv = cmd;
+        }
+        
+        // Huella del hardware virtual: un estado guardado sólo vale para el mismo
+        std::string layout = layoutHash(cmd);
+        saveKeyValueFile(runDir + "/layout.hash", {{"layout", layout}});
+        fs::remove(runDir + "/migrated");
+        bool resuming = !incomingMigration && savedStateMatches(layout);
+        if (resuming || incomingMigration) {
+            cmd.push_back("-incoming");
+            cmd.push_back("defer");
+        }
+        
+        // Mostrar comando completo en debug
+        debug("QEMU Command:");
+        std::string fullCmd = "";
+        for (const auto& arg : cmd) {
+            fullCmd += arg + " ";
+        }
+        debug(fullCmd);
+        
+        fs::remove(runDir + "/qmp.sock");
+        long long started = monotonicMs();
+        std::string failure;
+        pid_t pid;
+        qemuLaunchedMs = started;
+        resetAgentState();
+        if (latencyMode) raiseMemlockLimit();
+        {
+            TraceSpan spawn = traceSpan("fork/execvp qemu", "qemu");
+            pid = spawnProcess(cmd, failure);
+        }
+        if (pid < 0) {
+            error("Failed to launch QEMU: " + failure);
+            stopShares();
+            return false;
+        }
+        qemuPid = pid;
+        
+        if (!waitForQMP(30000)) {
+            if (qemuPid != -1) {
+                kill(qemuPid, SIGKILL);
+                waitpid(qemuPid, nullptr, 0);
+                qemuPid = -1;
+            }
+            stopShares();
+            return false;
+        }
+        success("QEMU ready in " + std::to_string(monotonicMs() - started) + " ms");
+        StartupTrace::instance().instant("QEMU ready", displayName());
+        // Entrar en el cpuset reinicia la afinidad: el cgroup va antes de fijar hilos
+        if (needsCgroup()) joinCgroup();
+        pinQEMUThreads();
+        if (usbHotplugEnabled() && !incomingMigration) attachPresentUSB();
+        if (balloonEnabled()) {
+            // Estadísticas del invitado (guest-stats) cada 5 s para /metrics
+            balloonTargetMB = (long long)maxRAMGB * 1024;
+            qmp.execute("qom-set", "{\"path\": \"/machine/peripheral/balloon0\", "
+                        "\"property\": \"guest-stats-polling-interval\", \"value\": 5}", 1000);
+        }
+        
+        if (resuming && !restoreSavedState()) {
+            // Estado ilegible: descartarlo y arrancar en frío
+            warning("Discarding saved state and cold booting");
+            discardSavedState();
+            qmp.disconnect();
+            kill(qemuPid, SIGKILL);
+            waitpid(qemuPid, nullptr, 0);
+            qemuPid = -1;
+            return startQEMU();
+        }
+        return true;
+    }
+
+    // Estado guardado junto a los discos (cold-state.zst o cold-state.ram)
+    std::string stateMetaPath() { return diskDir + "/cold-state.meta"; }
+    std::string stateDataPath(const std::string& format) {
+        return diskDir + (format == "zstd" ? "/cold-state.zst" : "/cold-state.ram");
+    }
+    bool hasSavedState() { return fs::exists(stateMetaPath()); }
+
+    std::string layoutHash(const std::vector<std::string>& cmd) {
+        std::string joined;
+        for (const auto& arg : cmd) joined += arg + '\0';
+        return hashString(joined);
+    }
+
+    void discardSavedState() {
+        auto meta = loadKeyValueFile(stateMetaPath());
+        fs::remove(stateDataPath(meta["format"]));
+        fs::remove(stateMetaPath());
+    }
+
+    // Un estado sólo se restaura si el layout de dispositivos no ha cambiado
+    bool savedStateMatches(const std::string& layout) {
+        if (!hasSavedState()) return false;
+        auto meta = loadKeyValueFile(stateMetaPath());
+        if (!fs::exists(stateDataPath(meta["format"]))) {
+            discardSavedState();
+            return false;
+        }
+        if (meta["layout"] != layout) {
+            warning("Saved state invalidated: the device layout changed since suspend");
+            discardSavedState();
+            return false;
+        }
+        return true;
+    }
+
+    // Capacidades de migración según el formato del fichero de estado
+    bool configureStateMigration(QMPClient& monitor, const std::string& format) {
+        std::string caps = format == "zstd"
+            ? "{\"capabilities\": []}"
+            : "{\"capabilities\": [{\"capability\": \"mapped-ram\", \"state\": true}, "
+              "{\"capability\": \"multifd\", \"state\": true}]}";
+        if (monitor.execute("migrate-set-capabilities", caps).find("\"return\"") == std::string::npos) {
+            return false;
+        }
+        std::string params = "{\"max-bandwidth\": 107374182400";
+        if (format != "zstd") params += ", \"multifd-channels\": " + std::to_string(std::max(2, cpuCores));
+        params += "}";
+        return monitor.execute("migrate-set-parameters", params).find("\"return\"") != std::string::npos;
+    }
+
+    std::string stateMigrationURI(const std::string& format, bool incoming) {
+        std::string path = fs::absolute(stateDataPath(format)).lexically_normal().string();
+        if (format == "zstd") {
+            return incoming ? "exec:zstd -q -dc '" + path + "'"
+                            : "exec:zstd -q -f -3 -T" + std::to_string(std::max(2, cpuCores)) + " -o '" + path + "'";
+        }
+        return "file:" + path;
+    }
+
+    // Sondea query-migrate hasta que termina; devuelve la última respuesta
+    std::string waitForMigration(QMPClient& monitor, bool verbose) {
+        long long lastReport = 0;
+        while (true) {
+            std::string reply = monitor.execute("query-migrate");
+            std::string status = jsonStringField(reply, "status");
+            if (reply.empty() || status == "completed" || status == "failed" || status == "cancelled") {
+                return reply;
+            }
+            if (verbose && monotonicMs() - lastReport >= 1000) {
+                lastReport = monotonicMs();
+                double transferred = jsonNumberField(reply, "transferred", 0) / (1024.0 * 1024.0);
+                std::ostringstream line;
+                line << "Migration " << status << ": " << std::fixed << std::setprecision(0) << transferred << " MiB";
+                log(line.str());
+            }
+            poll(nullptr, 0, 200);
+        }
+    }
+
+    // Restaura RAM y dispositivos desde el fichero; el invitado continúa solo
+    bool restoreSavedState() {
+        TraceSpan span = traceSpan("restoreSavedState", "qemu");
+        auto meta = loadKeyValueFile(stateMetaPath());
+        std::string format = meta["format"];
+        log("Resuming from saved state...");
+        long long started = monotonicMs();
+        
+        if (!configureStateMigration(qmp, format)) {
+            error("QEMU rejected the saved-state migration settings");
+            return false;
+        }
+        std::string uri = stateMigrationURI(format, true);
+        std::string reply = qmp.execute("migrate-incoming", "{\"uri\": \"" + uri + "\"}");
+        if (reply.find("\"return\"") == std::string::npos) {
+            error("migrate-incoming failed: " + jsonStringField(reply, "desc"));
+            return false;
+        }
+        reply = waitForMigration(qmp, false);
+        if (jsonStringField(reply, "status") != "completed") {
+            error("Restoring saved state failed: " + jsonStringField(reply, "error-desc"));
+            return false;
+        }
+        
+        // El estado ya no coincide con los discos en cuanto el invitado escribe
+        discardSavedState();
+        qmp.execute("cont");
+        success("Guest resumed in " + std::to_string(monotonicMs() - started) + " ms");
+        return true;
+    }
+
+    // cold suspend: vuelca RAM y dispositivos junto a los discos y cierra QEMU
+    bool suspendToDisk() {
+        QMPClient control;
+        std::string socketPath = runDir + "/control.sock";
+        if (!control.connectTo(socketPath, 5000)) {
+            error("No running VM found at " + socketPath);
+            return false;
+        }
+        
+        auto layout = loadKeyValueFile(runDir + "/layout.hash");
+        std::string format = findInPath("zstd").empty() ? "mapped-ram" : "zstd";
+        fs::remove(stateDataPath(format));
+        log("Suspending guest to " + stateDataPath(format) + " (" + format + ")...");
+        long long started = monotonicMs();
+        
+        if (!configureStateMigration(control, format)) {
+            error("QEMU rejected the migration settings (mapped-ram needs QEMU 9.0+)");
+            return false;
+        }
+        std::string uri = stateMigrationURI(format, false);
+        std::string reply = control.execute("migrate", "{\"uri\": \"" + uri + "\"}");
+        if (reply.find("\"return\"") == std::string::npos) {
+            error("migrate failed: " + jsonStringField(reply, "desc"));
+            return false;
+        }
+        reply = waitForMigration(control, true);
+        if (jsonStringField(reply, "status") != "completed") {
+            error("Suspend failed: " + jsonStringField(reply, "error-desc"));
+            control.execute("cont");
+            fs::remove(stateDataPath(format));
+            return false;
+        }
+        
+        std::error_code ec;
+        long long bytes = (long long)fs::file_size(stateDataPath(format), ec);
+        saveKeyValueFile(stateMetaPath(), {{"layout", layout["layout"]}, {"format", format},
+                                           {"created", std::to_string((long long)time(nullptr))}});
+        control.execute("quit");
+        success("Guest suspended in " + std::to_string(monotonicMs() - started) + " ms (" +
+                std::to_string(bytes / (1024 * 1024)) + " MiB)");
+        return true;
+    }
+
+    // Ajustes con los que el destino reconstruye la misma línea de comandos
+    std::map<std::string, std::string> exportConfiguration() {
+        std::map<std::string, std::string> config;
+        config["cpu.cores"] = std::to_string(cpuCores);
+        config["cpu.model"] = cpuModel;
+        config["cpu.pinning"] = enablePinning ? "1" : "0";
+        config["cpu.latency"] = latencyMode ? "1" : "0";
+        config["ram.gb"] = std::to_string(maxRAMGB);
+        config["ram.min.gb"] = std::to_string(minRAMGB);
+        config["ram.hugepages"] = hugepageSize;
+        config["ram.dedup"] = dedup ? "1" : "0";
+        config["storage.prealloc"] = diskPrealloc;
+        config["storage.cluster"] = diskCluster;
+        config["storage.extended_l2"] = diskExtendedL2 ? "1" : "0";
+        config["display.mode"] = displayMode;
+        config["display.link"] = vncLink;
+        config["display.quality"] = std::to_string(vncQuality);
+        config["display.compression"] = std::to_string(vncCompression);
+        config["display.fps"] = std::to_string(vncFPS);
+        config["display.encoding"] = vncEncoding;
+        config["net.bridge"] = useBridge ? "1" : "0";
+        config["net.nat"] = natMode;
+        config["usb.camera"] = enableCamera ? "1" : "0";
+        config["audio"] = enableAudio ? "1" : "0";
+        config["audio.microphone"] = enableMicrophone ? "1" : "0";
+        for (size_t i = 0; i < pciDevices.size(); i++) config["pci." + std::to_string(i)] = pciDevices[i];
+        for (size_t i = 0; i < usbDevices.size(); i++) config["usb.device." + std::to_string(i)] = usbDevices[i];
+        config["usb.hotplug"] = usbHotplug ? "1" : "0";
+        for (size_t i = 0; i < shares.size(); i++) config["share." + std::to_string(i)] = shares[i].spec();
+        config["sriov.pf"] = sriovPF;
+        config["sriov.vfs"] = std::to_string(sriovVFs);
+        // Rutas absolutas: la migración en vivo necesita almacenamiento compartido
+        for (size_t i = 0; i < diskFiles.size(); i++) {
+            config["disk." + std::to_string(i)] = fs::absolute(diskFiles[i]).lexically_normal().string();
+        }
+        for (size_t i = 0; i < isoFiles.size(); i++) {
+            config["iso." + std::to_string(i)] = fs::absolute(isoFiles[i]).lexically_normal().string();
+        }
+        // Los nodos throttle forman parte del hardware virtual: viajan con la VM
+        for (const auto& setting : resourceSettings) config[setting.first] = setting.second;
+        return config;
+    }
+
+    void importConfiguration(const std::map<std::string, std::string>& config) {
+        auto get = [&config](const std::string& key, const std::string& fallback) {
+            auto it = config.find(key);
+            return it == config.end() ? fallback : it->second;
+        };
+        cpuCores = std::max(1, atoi(get("cpu.cores", std::to_string(cpuCores)).c_str()));
+        cpuModel = get("cpu.model", cpuModel);
+        enablePinning = get("cpu.pinning", enablePinning ? "1" : "0") == "1";
+        latencyMode = get("cpu.latency", latencyMode ? "1" : "0") == "1";
+        maxRAMGB = std::max(1, atoi(get("ram.gb", std::to_string(maxRAMGB)).c_str()));
+        minRAMGB = std::min(maxRAMGB, std::max(1, atoi(get("ram.min.gb", std::to_string(maxRAMGB)).c_str())));
+        hugepageSize = get("ram.hugepages", hugepageSize);
+        dedup = get("ram.dedup", dedup ? "1" : "0") == "1";
+        diskPrealloc = get("storage.prealloc", diskPrealloc);
+        diskCluster = get("storage.cluster", diskCluster);
+        diskExtendedL2 = get("storage.extended_l2", diskExtendedL2 ? "1" : "0") == "1";
+        displayMode = get("display.mode", displayMode);
+        vncLink = get("display.link", vncLink);
+        vncQuality = atoi(get("display.quality", std::to_string(vncQuality)).c_str());
+        vncCompression = atoi(get("display.compression", std::to_string(vncCompression)).c_str());
+        vncFPS = atoi(get("display.fps", std::to_string(vncFPS)).c_str());
+        vncEncoding = get("display.encoding", vncEncoding);
+        useBridge = get("net.bridge", useBridge ? "1" : "0") == "1";
+        natMode = get("net.nat", natMode);
+        enableCamera = get("usb.camera", enableCamera ? "1" : "0") == "1";
+        enableAudio = get("audio", enableAudio ? "1" : "0") == "1";
+        enableMicrophone = get("audio.microphone", enableMicrophone ? "1" : "0") == "1";
+        pciDevices.clear();
+        for (int i = 0; config.count("pci." + std::to_string(i)); i++) {
+            pciDevices.push_back(PCIHost::normalize(config.at("pci." + std::to_string(i))));
+        }
+        usbDevices.clear();
+        for (int i = 0; config.count("usb.device." + std::to_string(i)); i++) {
+            usbDevices.push_back(config.at("usb.device." + std::to_string(i)));
+        }
+        usbHotplug = get("usb.hotplug", usbHotplug ? "1" : "0") == "1";
+        if (config.count("share.0")) shares.clear();
+        for (int i = 0; config.count("share." + std::to_string(i)); i++) {
+            SharedFolder share;
+            std::string failure;
+            if (SharedFolder::parse(config.at("share." + std::to_string(i)), share, failure)) shares.push_back(share);
+        }
+        sriovPF = PCIHost::normalize(get("sriov.pf", sriovPF));
+        sriovVFs = std::max(1, atoi(get("sriov.vfs", std::to_string(sriovVFs)).c_str()));
+        diskFiles.clear();
+        for (int i = 0; config.count("disk." + std::to_string(i)); i++) {
+            diskFiles.push_back(config.at("disk." + std::to_string(i)));
+        }
+        isoFiles.clear();
+        for (int i = 0; config.count("iso." + std::to_string(i)); i++) {
+            isoFiles.push_back(config.at("iso." + std::to_string(i)));
+        }
+        resourceSettings.clear();
+        for (const auto& [key, value] : config) {
+            if (key.rfind("limits.", 0) == 0 || key.rfind("throttle.", 0) == 0) resourceSettings[key] = value;
+        }
+    }
+
+    // Un canal multifd por núcleo del host que no ocupan los vCPUs (2..16)
+    int migrationChannels() {
+        int online = (int)std::thread::hardware_concurrency();
+        return std::max(2, std::min(16, online - cpuCores));
+    }
+
+    // Mismas capacidades en origen y destino; auto-converge sólo actúa en el origen.
+    // QEMU < 10.1 rechaza multifd junto a postcopy-ram: con postcopy va por un solo canal.
+    bool configureLiveMigration(QMPClient& monitor, int channels, bool postcopy) {
+        std::string caps = "{\"capabilities\": [{\"capability\": \"multifd\", \"state\": " +
+                           std::string(postcopy ? "false" : "true") + "}, "
+                           "{\"capability\": \"auto-converge\", \"state\": true}, "
+                           "{\"capability\": \"postcopy-ram\", \"state\": " +
+                           std::string(postcopy ? "true" : "false") + "}]}";
+        if (monitor.execute("migrate-set-capabilities", caps).find("\"return\"") == std::string::npos) {
+            return false;
+        }
+        std::string params = "{" + (postcopy ? std::string() : "\"multifd-channels\": " + std::to_string(channels) + ", ") +
+                             "\"max-bandwidth\": 107374182400, \"downtime-limit\": 300}";
+        return monitor.execute("migrate-set-parameters", params).find("\"return\"") != std::string::npos;
+    }
+
+    // Sondea la migración en vivo e informa cada segundo. Con postcopy, pasa
+    // a ejecutar en el destino al terminar la primera pasada completa de RAM.
+    std::string monitorLiveMigration(QMPClient& monitor, bool postcopy) {
+        bool switched = false;
+        long long lastReport = 0;
+        while (true) {
+            std::string reply = monitor.execute("query-migrate");
+            std::string status = jsonStringField(reply, "status");
+            if (reply.empty() || status == "completed" || status == "failed" || status == "cancelled") {
+                return reply;
+            }
+            if (monotonicMs() - lastReport >= 1000) {
+                lastReport = monotonicMs();
+                double throttle = jsonNumberField(reply, "cpu-throttle-percentage", 0);
+                std::ostringstream line;
+                line << "Migration " << status << ": " << std::fixed << std::setprecision(0)
+                     << jsonNumberField(reply, "transferred", 0) / (1024.0 * 1024.0) << " MiB sent, "
+                     << jsonNumberField(reply, "remaining", 0) / (1024.0 * 1024.0) << " MiB left, "
+                     << jsonNumberField(reply, "mbps", 0) << " Mbps, dirty "
+                     << jsonNumberField(reply, "dirty-pages-rate", 0) << " pages/s, expected downtime "
+                     << jsonNumberField(reply, "expected-downtime", 0) << " ms";
+                if (throttle > 0) line << ", vCPU throttle " << throttle << "%";
+                log(line.str());
+            }
+            if (postcopy && !switched && status == "active" &&
+                jsonNumberField(reply, "dirty-sync-count", 0) >= 2) {
+                switched = monitor.execute("migrate-start-postcopy").find("\"return\"") != std::string::npos;
+                if (switched) log("Switching to postcopy: the guest now runs on the destination");
+            }
+            poll(nullptr, 0, 200);
+        }
+    }
+
+    // cold migrate --to HOST:PORT: envía la configuración a un "cold receive"
+    // y migra la VM en marcha por multifd; al terminar cierra QEMU aquí
+    bool migrateTo(const std::string& host, int port, bool postcopy) {
+        auto config = loadKeyValueFile(runDir + "/config.export");
+        QMPClient control;
+        std::string socketPath = runDir + "/control.sock";
+        if (config.empty() || !control.connectTo(socketPath, 5000)) {
+            error("No running VM found at " + socketPath);
+            return false;
+        }
+        importConfiguration(config);
+        if (hasPassthrough()) {
+            error("VMs with VFIO passthrough devices cannot be live-migrated");
+            return false;
+        }
+        if (!shares.empty()) {
+            error("VMs with virtiofs shared folders cannot be live-migrated");
+            return false;
+        }
+        int channels = migrationChannels();
+        config["migration.channels"] = std::to_string(channels);
+        config["migration.postcopy"] = postcopy ? "1" : "0";
+
+        ControlChannel peer;
+        log("Connecting to " + host + ":" + std::to_string(port) + "...");
+        if (!peer.connectTo(host, port)) {
+            error("Cannot reach cold receive at " + host + ":" + std::to_string(port) + ": " + strerror(errno));
+            return false;
+        }
+        peer.sendLine("COLD-MIGRATE 1");
+        for (const auto& [key, value] : config) peer.sendLine(key + "=" + value);
+        peer.sendLine("END");
+
+        // El destino tiene que arrancar QEMU (y quizá reservar páginas enormes)
+        std::string reply;
+        if (!peer.readLine(reply, 180000) || reply.rfind("READY ", 0) != 0) {
+            error("Destination refused the migration: " + (reply.empty() ? "no answer" : reply));
+            return false;
+        }
+        if (!configureLiveMigration(control, channels, postcopy)) {
+            error("QEMU rejected the live migration settings");
+            peer.sendLine("FAILED");
+            return false;
+        }
+        std::string uri = "tcp:" + (host.find(':') != std::string::npos ? "[" + host + "]" : host) + ":" +
+                          reply.substr(6);
+        log("Migrating to " + uri + (postcopy ? " over a single channel (postcopy enabled)"
+                                              : " over " + std::to_string(channels) + " multifd channels"));
+        long long started = monotonicMs();
+        reply = control.execute("migrate", "{\"uri\": \"" + uri + "\"}");
+        if (reply.find("\"return\"") == std::string::npos) {
+            error("migrate failed: " + jsonStringField(reply, "desc"));
+            peer.sendLine("FAILED");
+            return false;
+        }
+
+        reply = monitorLiveMigration(control, postcopy);
+        if (jsonStringField(reply, "status") != "completed") {
+            error("Migration failed: " + jsonStringField(reply, "error-desc"));
+            if (jsonStringField(reply, "status") == "postcopy-paused") {
+                warning("Guest is paused in postcopy; its state is split between both hosts");
+            }
+            peer.sendLine("FAILED");
+            return false;
+        }
+
+        saveKeyValueFile(runDir + "/migrated", {{"destination", host + ":" + std::to_string(port)}});
+        peer.sendLine("DONE");
+        std::ostringstream summary;
+        summary << "Migration completed in " << (monotonicMs() - started) << " ms: downtime "
+                << (long long)jsonNumberField(reply, "downtime", 0) << " ms, " << std::fixed << std::setprecision(0)
+                << jsonNumberField(reply, "transferred", 0) / (1024.0 * 1024.0) << " MiB at "
+                << jsonNumberField(reply, "mbps", 0) << " Mbps";
+        success(summary.str());
+        control.execute("quit");
+        return true;
+    }
+
+    // cold disk optimize: reescribe cada imagen de diskDir con qemu-img
+    // convert (en paralelo, una por disco) para compactarla y aplicarle
+    // preasignación, clúster y extended_l2. Sólo con la VM apagada
+    bool optimizeDisks() {
+        QMPClient control;
+        if (control.connectTo(runDir + "/control.sock", 200)) {
+            error("The VM is running; shut it down before optimizing its disks");
+            return false;
+        }
+        if (hasSavedState()) {
+            error("A suspended state is stored next to the disks; resume and shut down the guest first");
+            return false;
+        }
+        auto disks = fixedMedia ? diskFiles : findAllDisks();
+        if (disks.empty()) {
+            warning("No disk images in " + diskDir);
+            return true;
+        }
+        long long started = monotonicMs();
+        std::vector<std::future<bool>> tasks;
+        for (const auto& disk : disks) {
+            tasks.push_back(std::async(std::launch::async, [this, disk] { return optimizeImage(disk); }));
+        }
+        int failures = 0;
+        for (auto& task : tasks) failures += task.get() ? 0 : 1;
+        if (failures == 0) success("Optimized " + std::to_string(disks.size()) + " image(s) in " +
+                                   std::to_string((monotonicMs() - started) / 1000) + " s");
+        return failures == 0;
+    }
+
+    // Copia nueva junto a la original y rename atómico. -m 16 (el máximo de
+    // qemu-img) con -W escribe fuera de orden; con metadatos preasignados los
+    // clústeres ya tienen su sitio y el resultado no se fragmenta
+    bool optimizeImage(const std::string& path) {
+        std::string name = fs::path(path).filename().string();
+        std::string json = captureProgram({"qemu-img", "info", "--output=json", path});
+        std::string format = jsonStringField(json, "format");
+        if (format.empty()) {
+            error(name + ": qemu-img info failed (is the image in use?)");
+            return false;
+        }
+        if (format != "qcow2" && format != "raw") {
+            warning(name + ": " + format + " images are left as they are");
+            return true;
+        }
+        std::error_code ec;
+        long long before = (long long)jsonNumberField(json, "actual-size", 0);
+        auto space = fs::space(fs::path(path).parent_path(), ec);
+        if (!ec && (long long)space.available < before + before / 10) {
+            error(name + ": not enough free space for a rewritten copy (" + std::to_string(before >> 20) + " MiB)");
+            return false;
+        }
+
+        std::string temp = path + ".optimize";
+        fs::remove(temp, ec);
+        std::vector<std::string> argv = {"qemu-img", "convert", "-m", "16", "-W", "-f", format, "-O", format};
+        if (format == "qcow2") {
+            // Bitmaps de cold backup y la imagen base (overlays de --from-base)
+            argv.push_back("--bitmaps");
+            std::string backing = jsonStringField(json, "full-backing-filename");
+            argv.push_back("-o");
+            argv.push_back(qcow2Options(backing.empty()));
+            if (!backing.empty()) {
+                argv.insert(argv.end(), {"-B", backing, "-F", jsonStringField(json, "backing-filename-format")});
+            }
+        } else if (diskPrealloc == "falloc" || diskPrealloc == "full") {
+            argv.insert(argv.end(), {"-o", "preallocation=" + diskPrealloc});
+        }
+        argv.insert(argv.end(), {path, temp});
+
+        log(name + ": rewriting (" + (format == "qcow2" ? qcow2Options(true) : "sparse raw") + ")...");
+        if (runProgram(argv) != 0) {
+            error(name + ": qemu-img convert failed");
+            fs::remove(temp, ec);
+            return false;
+        }
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            if (chown(temp.c_str(), st.st_uid, st.st_gid) != 0) debug(name + ": cannot keep the owner");
+            chmod(temp.c_str(), st.st_mode & 07777);
+        }
+        fs::rename(temp, path, ec);
+        if (ec) {
+            error(name + ": cannot replace the image: " + ec.message());
+            fs::remove(temp, ec);
+            return false;
+        }
+        long long after = stat(path.c_str(), &st) == 0 ? (long long)st.st_blocks * 512 : 0;
+        success(name + ": " + std::to_string(before >> 20) + " MiB -> " + std::to_string(after >> 20) + " MiB allocated");
+        return true;
+    }
+
+    // Copias por defecto junto a los discos: ./devices/backup, ./devices/vmN/backup
+    std::string defaultBackupDir() const { return fs::path(diskDir).parent_path().string() + "/backup"; }
+
+    // cold backup: una transacción QMP para todos los discos (mismo instante)
+    // con blockdev-backup. El bitmap sucio cold-backup de cada nodo diskN
+    // (persistente en qcow2) marca lo cambiado desde la copia anterior.
+    // DIR: cadena qcow2 (completa + incrementales apoyadas en la anterior);
+    // nbd://HOST:PORT: réplica remota (export diskN, vmN-diskN con
+    // --instances) actualizada en su sitio
+    bool backupTo(const std::string& target, bool full, long long speed) {
+        auto config = loadKeyValueFile(runDir + "/config.export");
+        QMPClient control;
+        std::string socketPath = runDir + "/control.sock";
+        if (config.empty() || !control.connectTo(socketPath, 5000)) {
+            error("No running VM found at " + socketPath);
+            return false;
+        }
+        bool remote = target.rfind("nbd://", 0) == 0;
+        std::string host, port;
+        if (remote) {
+            std::string address = target.substr(6);
+            size_t colon = address.rfind(':');
+            host = address.substr(0, colon);
+            port = colon == std::string::npos ? "10809" : address.substr(colon + 1);
+            if (host.size() > 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+        }
+        std::string dir = remote ? runDir : target;
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        std::string metaPath = dir + "/" + (remote ? "backup-nbd.meta" : "backup.meta");
+        auto meta = loadKeyValueFile(metaPath);
+        // La réplica remota sólo vale como base si es el mismo servidor
+        if (remote && meta["target"] != target) meta.clear();
+
+        // Estado de cada nodo diskN: formato, tamaño y si ya tiene el bitmap
+        std::map<std::string, std::string> nodes;
+        for (const auto& node : jsonArrayObjects(control.execute("query-named-block-nodes"), "return")) {
+            nodes[jsonStringField(node, "node-name")] = node;
+        }
+        char stamp[32];
+        time_t now = time(nullptr);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+
+        std::vector<std::string> disks, fullDisks, images;
+        std::string actions;
+        bool ok = true;
+        for (int i = 0; config.count("disk." + std::to_string(i)) && ok; i++) {
+            std::string disk = "disk" + std::to_string(i);
+            const std::string& node = nodes[disk];
+            if (node.empty()) {
+                warning(disk + " is not attached, skipping");
+                continue;
+            }
+            bool hasBitmap = node.find("\"cold-backup\"") != std::string::npos;
+            bool persistent = jsonStringField(node, "drv") == "qcow2";
+            std::string previous = meta[disk + ".last"];
+            bool incremental = !full && hasBitmap && (remote ? meta.count(disk + ".synced") > 0 : fs::exists(previous));
+            std::string image, file;
+            if (remote) {
+                file = "{\"driver\": \"nbd\", \"server\": {\"type\": \"inet\", \"host\": \"" + jsonEscape(host) +
+                       "\", \"port\": \"" + jsonEscape(port) + "\"}, \"export\": \"" +
+                       (instanceName.empty() ? disk : instanceName + "-" + disk) + "\"}";
+            } else {
+                std::string base = fs::absolute(dir + "/" + disk + "-" + stamp + (incremental ? "-inc" : "-full")).lexically_normal().string();
+                image = base + ".qcow2";
+                for (int n = 2; fs::exists(image); n++) image = base + "-" + std::to_string(n) + ".qcow2";
+                std::string size = std::to_string((long long)jsonNumberField(node, "virtual-size", 0));
+                std::vector<std::string> create = {"qemu-img", "create", "-q", "-f", "qcow2"};
+                if (incremental) create.insert(create.end(), {"-b", previous, "-F", "qcow2"});
+                create.insert(create.end(), {image, size});
+                if (runProgram(create) != 0) {
+                    error("Cannot create backup image " + image);
+                    ok = false;
+                    break;
+                }
+                images.push_back(image);
+                file = "{\"driver\": \"file\", \"filename\": \"" + jsonEscape(image) + "\"}";
+            }
+            std::string reply = control.execute("blockdev-add", "{\"driver\": \"" + std::string(remote ? "raw" : "qcow2") +
+                                                "\", \"node-name\": \"backup" + std::to_string(i) + "\", \"file\": " + file + "}");
+            if (reply.find("\"return\"") == std::string::npos) {
+                error("Cannot open backup target for " + disk + ": " + jsonStringField(reply, "desc"));
+                ok = false;
+                break;
+            }
+            disks.push_back(disk);
+            if (!incremental) fullDisks.push_back(disk);
+
+            if (!hasBitmap) {
+                actions += std::string(actions.empty() ? "" : ", ") + "{\"type\": \"block-dirty-bitmap-add\", \"data\": "
+                           "{\"node\": \"" + disk + "\", \"name\": \"cold-backup\", \"persistent\": " +
+                           (persistent ? "true" : "false") + "}}";
+            }
+            // on-success: el bitmap sólo se reinicia si la copia termina; una
+            // completa fallida no deja un bitmap vacío sobre la cadena antigua
+            actions += std::string(actions.empty() ? "" : ", ") + "{\"type\": \"blockdev-backup\", \"data\": {\"device\": \"" +
+                       disk + "\", \"target\": \"backup" + std::to_string(i) + "\", \"job-id\": \"backup-" + disk +
+                       "\", \"sync\": \"" + (incremental ? "incremental" : "full") +
+                       "\", \"bitmap\": \"cold-backup\", \"bitmap-mode\": \"on-success\", \"auto-dismiss\": false" +
+                       (speed > 0 ? ", \"speed\": " + std::to_string(speed) : "") + "}}";
+            log(disk + ": " + (incremental ? "incremental" : "full") + " backup to " + (remote ? target + " (" + disk + ")" : image) +
+                (persistent ? "" : " (bitmap not persistent on " + jsonStringField(node, "drv") + ")"));
+        }
+
+        long long started = monotonicMs();
+        long long bytes = 0;
+        if (ok && !disks.empty()) {
+            // Con el invitado congelado la copia es coherente para sus
+            // sistemas de ficheros; blockdev-backup fija el punto al arrancar
+            // y se descongela en cuanto la transacción vuelve
+            bool frozen = requestGuestFreeze("freeze");
+            if (!frozen) warning("Guest filesystems not frozen (no guest agent?), backup is crash-consistent");
+            // grouped: si un disco falla se cancelan todos y los bitmaps quedan como estaban
+            std::string reply = control.execute("transaction", "{\"actions\": [" + actions +
+                                                "], \"properties\": {\"completion-mode\": \"grouped\"}}");
+            if (frozen && !requestGuestFreeze("thaw")) {
+                warning("Guest thaw failed, the supervisor thaws it after 60 s");
+            }
+            if (reply.find("\"return\"") == std::string::npos) {
+                error("Backup rejected: " + jsonStringField(reply, "desc"));
+                ok = false;
+            } else {
+                ok = waitForBackupJobs(control, disks, bytes);
+            }
+        }
+        for (size_t i = 0; i < disks.size(); i++) {
+            control.execute("job-dismiss", "{\"id\": \"backup-" + disks[i] + "\"}");
+        }
+        for (int i = 0; config.count("disk." + std::to_string(i)); i++) {
+            if (nodes.count("disk" + std::to_string(i))) {
+                control.execute("blockdev-del", "{\"node-name\": \"backup" + std::to_string(i) + "\"}");
+            }
+        }
+
+        if (!ok) {
+            for (const auto& image : images) fs::remove(image, ec);
+            // Tras una completa fallida la siguiente vuelve a ser completa
+            for (const auto& disk : fullDisks) {
+                meta.erase(disk + ".last");
+                meta.erase(disk + ".synced");
+            }
+            if (!fullDisks.empty()) saveKeyValueFile(metaPath, meta);
+            return false;
+        }
+        for (size_t i = 0; i < disks.size(); i++) {
+            if (remote) meta[disks[i] + ".synced"] = stamp;
+            else meta[disks[i] + ".last"] = images[i];
+        }
+        meta["last"] = stamp;
+        if (remote) meta["target"] = target;
+        saveKeyValueFile(metaPath, meta);
+        double seconds = std::max(1LL, monotonicMs() - started) / 1000.0;
+        std::ostringstream summary;
+        summary << "Backup of " << disks.size() << " disk(s) completed in " << std::fixed << std::setprecision(1) << seconds
+                << " s: " << std::setprecision(0) << bytes / (1024.0 * 1024.0) << " MiB copied ("
+                << bytes / (1024.0 * 1024.0) / seconds << " MiB/s)";
+        success(summary.str());
+        return true;
+    }
+
+    // Espera a que concluyan los trabajos backup-diskN; devuelve los bytes copiados
+    bool waitForBackupJobs(QMPClient& monitor, const std::vector<std::string>& disks, long long& bytes) {
+        long long lastReport = monotonicMs();
+        while (true) {
+            std::string reply = monitor.execute("query-jobs");
+            if (reply.empty()) {
+                error("Lost the QMP connection during the backup");
+                return false;
+            }
+            size_t concluded = 0;
+            double current = 0, total = 0;
+            std::string failure;
+            for (const auto& job : jsonArrayObjects(reply, "return")) {
+                std::string id = jsonStringField(job, "id");
+                if (id.rfind("backup-", 0) != 0 || std::find(disks.begin(), disks.end(), id.substr(7)) == disks.end()) continue;
+                current += jsonNumberField(job, "current-progress", 0);
+                total += jsonNumberField(job, "total-progress", 0);
+                if (jsonStringField(job, "status") != "concluded") continue;
+                concluded++;
+                if (failure.empty()) failure = jsonStringField(job, "error");
+            }
+            bytes = (long long)current;
+            if (concluded == disks.size()) {
+                if (!failure.empty()) error("Backup failed: " + failure);
+                return failure.empty();
+            }
+            if (monotonicMs() - lastReport >= 1000) {
+                lastReport = monotonicMs();
+                std::ostringstream line;
+                line << "Backup: " << std::fixed << std::setprecision(0) << current / (1024.0 * 1024.0) << " / "
+                     << total / (1024.0 * 1024.0) << " MiB";
+                log(line.str());
+            }
+            poll(nullptr, 0, 200);
+        }
+    }
+
+    // cold receive: espera a un "cold migrate", arranca QEMU con la misma
+    // configuración en -incoming defer y recibe el estado por multifd
+    bool receiveMigration(int listenFd, int migrationPort) {
+        if (instanceIndex <= 0) printHeader();
+        createDirectories();
+        if (!checkCommand("qemu-system-x86_64", "QEMU")) {
+            error("QEMU is required but not installed!");
+            return false;
+        }
+
+        log("Waiting for an incoming migration...");
+        ControlChannel peer;
+        std::string client, line;
+        if (!peer.acceptFrom(listenFd, client)) {
+            error("Failed to accept migration connection: " + std::string(strerror(errno)));
+            return false;
+        }
+        std::map<std::string, std::string> config;
+        bool complete = false;
+        if (peer.readLine(line, 10000) && line == "COLD-MIGRATE 1") {
+            while (peer.readLine(line, 10000)) {
+                if (line == "END") {
+                    complete = true;
+                    break;
+                }
+                size_t eq = line.find('=');
+                if (eq != std::string::npos) config[line.substr(0, eq)] = line.substr(eq + 1);
+            }
+        }
+        if (!complete) {
+            error("Invalid migration handshake from " + client);
+            return false;
+        }
+        log("Incoming migration from " + client);
+
+        importConfiguration(config);
+        for (const auto& disk : diskFiles) {
+            if (!fs::exists(disk)) {
+                error("Disk " + disk + " is not visible on this host (live migration needs shared storage)");
+                peer.sendLine("ERROR missing disk " + disk);
+                return false;
+            }
+        }
+        if (enableCamera) camera = detectCamera();
+        if (useBridge) checkBridgeInterface();
+        selectNetworkBackend();
+        planCPUPlacement();
+        resolveDiskPolicies();
+        printConfiguration();
+
+        incomingMigration = true;
+        bool started = startQEMU();
+        // Un reinicio posterior del supervisor ya arranca en frío
+        incomingMigration = false;
+        if (!started) {
+            peer.sendLine("ERROR QEMU failed to start");
+            return false;
+        }
+
+        bool postcopy = config["migration.postcopy"] == "1";
+        int channels = std::max(2, atoi(config["migration.channels"].c_str()));
+        std::string uri = "tcp:[::]:" + std::to_string(migrationPort);
+        if (!configureLiveMigration(qmp, channels, postcopy) ||
+            qmp.execute("migrate-incoming", "{\"uri\": \"" + uri + "\"}").find("\"return\"") == std::string::npos) {
+            error("QEMU rejected the incoming migration on port " + std::to_string(migrationPort));
+            peer.sendLine("ERROR incoming migration rejected");
+            cleanup();
+            return false;
+        }
+        peer.sendLine("READY " + std::to_string(migrationPort));
+
+        // El origen avisa al terminar; si el canal se corta, la migración fracasó
+        std::string outcome;
+        peer.readLine(outcome, -1);
+        std::string reply = outcome == "DONE" ? waitForMigration(qmp, false) : "";
+        if (jsonStringField(reply, "status") != "completed") {
+            error("Incoming migration failed" + (outcome.empty() ? std::string(": source disconnected") : ""));
+            cleanup();
+            return false;
+        }
+        success("Guest is now running on this host");
+        saveKeyValueFile(runDir + "/config.export", exportConfiguration());
+        return startDisplay();
+    }
+
+    bool migratedAway() { return fs::exists(runDir + "/migrated"); }
+
+    // Perfil por VM junto a sus discos: ./devices/profile.toml o ./devices/vmN/profile.toml
+    std::string defaultProfilePath() const { return fs::path(diskDir).parent_path().string() + "/profile.toml"; }
+
+    // Carga un perfil TOML sobre la configuración actual; las opciones de
+    // la línea de órdenes se aplican después y tienen prioridad
+    bool loadProfile(const std::string& path) {
+        std::ifstream file(path);
+        if (!file) {
+            error("Cannot read profile " + path);
+            return false;
+        }
+        std::stringstream text;
+        text << file.rdbuf();
+        std::map<std::string, std::string> values;
+        std::string failure;
+        if (!parseProfile(text.str(), values, failure)) {
+            error(path + ": " + failure);
+            return false;
+        }
+
+        // Nombres del perfil -> claves de exportConfiguration()
+        static const std::map<std::string, std::string> aliases = {
+            {"memory.max_gb", "ram.gb"}, {"memory.min_gb", "ram.min.gb"},
+            {"memory.hugepages", "ram.hugepages"}, {"memory.dedup", "ram.dedup"},
+            {"network.bridge", "net.bridge"}, {"network.nat", "net.nat"},
+            {"devices.camera", "usb.camera"}, {"devices.audio", "audio"}, {"devices.microphone", "audio.microphone"},
+            {"passthrough.sriov", "sriov.pf"}, {"passthrough.vfs", "sriov.vfs"},
+        };
+        static const std::map<std::string, std::set<std::string>> choices = {
+            {"ram.hugepages", {"", "2M", "1G"}},
+            {"display.mode", {"websocket", "websockify", "spice", "gtk", "none"}},
+            {"display.link", {"auto", "lan", "wan"}},
+            {"display.encoding", {"auto", "tight", "zrle", "raw"}},
+            {"net.nat", {"auto", "passt", "user"}},
+            {"storage.prealloc", {"off", "metadata", "falloc", "full"}},
+            {"storage.cluster", {"16K", "32K", "64K", "128K", "256K", "512K", "1M", "2M"}},
+        };
+        auto config = exportConfiguration();
+        std::map<int, std::string> disks, isos;
+        for (const auto& [key, value] : values) {
+            auto alias = aliases.find(key);
+            std::string name = alias != aliases.end() ? alias->second : key;
+            if (name.rfind("disks.", 0) == 0 || name.rfind("isos.", 0) == 0) {
+                if (!fs::exists(value)) {
+                    error(path + ": " + key + " not found: " + value);
+                    return false;
+                }
+                (name[0] == 'd' ? disks : isos)[atoi(name.c_str() + name.find('.') + 1)] =
+                    fs::absolute(value).lexically_normal().string();
+            } else if (name.rfind("usb.devices.", 0) == 0) {
+                if (!validUSBSpec(value)) {
+                    error(path + ": invalid USB device '" + value + "' (use VENDOR:PRODUCT, BUS-PORT or class:KIND)");
+                    return false;
+                }
+                config["usb.device." + name.substr(12)] = value;
+            } else if (name.rfind("shares.", 0) == 0) {
+                SharedFolder share;
+                std::string failure;
+                if (!SharedFolder::parse(value, share, failure)) {
+                    error(path + ": invalid share '" + value + "': " + failure);
+                    return false;
+                }
+                config["share." + name.substr(7)] = share.spec();
+            } else if (name.rfind("passthrough.pci.", 0) == 0) {
+                config["pci." + name.substr(16)] = value;
+            } else if (name == "display.vnc" || name == "display.web_port" || name == "network.mac" || name == "network.tap") {
+                if (!validHostSetting(name, value)) {
+                    error(path + ": invalid " + key + " '" + value + "'");
+                    return false;
+                }
+                if (name == "display.vnc") vncDisplay = atoi(value.c_str());
+                else if (name == "display.web_port") webPort = atoi(value.c_str());
+                else if (name == "network.mac") macAddress = value;
+                else tapInterface = value;
+            } else if (name.rfind("limits.", 0) == 0 || name.rfind("throttle.", 0) == 0) {
+                if (!validResourceSetting(name, value)) {
+                    error(path + ": invalid " + key + " '" + value + "'");
+                    return false;
+                }
+                config[name] = value;
+            } else if (config.count(name) && name.rfind("disk.", 0) != 0 && name.rfind("iso.", 0) != 0) {
+                auto allowed = choices.find(name);
+                if (allowed != choices.end() && !allowed->second.count(value)) {
+                    error(path + ": invalid " + key + " '" + value + "'");
+                    return false;
+                }
+                config[name] = value;
+            } else {
+                error(path + ": unknown setting " + key);
+                return false;
+            }
+        }
+        int index = 0;
+        for (const auto& disk : disks) config["disk." + std::to_string(index++)] = disk.second;
+        index = 0;
+        for (const auto& iso : isos) config["iso." + std::to_string(index++)] = iso.second;
+        importConfiguration(config);
+        fixedMedia = !disks.empty() || !isos.empty();
+        profileHash = hashString(text.str());
+        debug("Loaded profile " + path);
+        return true;
+    }
+
+    static bool validUSBSpec(const std::string& spec) {
+        if (spec.rfind("class:", 0) == 0) return std::set<std::string>{"video", "audio", "storage", "hid"}.count(spec.substr(6)) > 0;
+        if (spec.size() == 9 && spec[4] == ':') return spec.find_first_not_of("0123456789abcdef:") == std::string::npos;
+        size_t dash = spec.find('-');
+        return dash != std::string::npos && dash > 0 && spec.find_first_not_of("0123456789-.") == std::string::npos;
+    }
+
+    // [limits] va al cgroup de QEMU; [throttle] y [throttle.N] a throttle-group
+    // Puertos, MAC y tap del perfil: van tal cual a la línea de QEMU
+    static bool validHostSetting(const std::string& key, const std::string& value) {
+        if (key == "network.mac") {
+            if (value.size() != 17) return false;
+            for (size_t i = 0; i < value.size(); i++) {
+                if (i % 3 == 2 ? value[i] != ':' : !isxdigit((unsigned char)value[i])) return false;
+            }
+            return true;
+        }
+        if (key == "network.tap") {
+            return !value.empty() && value.size() < IFNAMSIZ && value != "." && value != ".." &&
+                   value.find_first_of("/: \t") == std::string::npos;
+        }
+        if (value.empty() || value.size() > 5 || value.find_first_not_of("0123456789") != std::string::npos) return false;
+        int number = atoi(value.c_str());
+        // La pantalla N ocupa 5900+N (VNC), 5700+N (websocket) y 5930+N (SPICE)
+        if (key == "display.vnc") return number <= 65535 - 5930;
+        return number >= 1 && number <= 65535;
+    }
+
+    static bool validResourceSetting(const std::string& key, const std::string& value) {
+        static const std::set<std::string> limits = {
+            "cpu", "memory_high_gb", "io_weight", "read_bps", "write_bps", "read_iops", "write_iops"};
+        static const std::set<std::string> throttle = {
+            "iops_total", "iops_read", "iops_write", "bps_total", "bps_read", "bps_write",
+            "iops_total_max", "iops_read_max", "iops_write_max", "bps_total_max", "bps_read_max", "bps_write_max",
+            "iops_total_max_length", "iops_read_max_length", "iops_write_max_length",
+            "bps_total_max_length", "bps_read_max_length", "bps_write_max_length", "iops_size"};
+        if (key == "throttle.shared") return value == "0" || value == "1";
+        bool decimal = key == "limits.cpu" || key == "limits.memory_high_gb";
+        if (value.empty() || value.find_first_not_of(decimal ? "0123456789." : "0123456789") != std::string::npos ||
+            atof(value.c_str()) <= 0) {
+            return false;
+        }
+        if (key.rfind("limits.", 0) == 0) {
+            return limits.count(key.substr(7)) && (key != "limits.io_weight" || atoi(value.c_str()) <= 10000);
+        }
+        std::string name = key.substr(9);
+        size_t dot = name.find('.');
+        if (dot != std::string::npos && isdigit((unsigned char)name[0])) name = name.substr(dot + 1);
+        return throttle.count(name) > 0;
+    }
+
+    // argv compilado del perfil: se reutiliza mientras no cambien el perfil,
+    // la configuración efectiva, la huella del host ni los .cold de los discos
+    std::string compiledPath() const { return runDir + "/qemu.argv"; }
+
+    std::string compiledKey() {
+        std::string material = profileHash + ";" + preflightCache["fingerprint"] + ";" + instanceName + ";" +
+                               findRenderNode() + ";" + macAddress + ";" + tapInterface + ";" +
+                               std::to_string(vncDisplay) + ";" + std::to_string(webPort) + ";";
+        for (const auto& device : passthroughDevices) material += device + ";";
+        // La cámara y class:X se resuelven con lo que haya enchufado
+        for (const auto& device : USBHost::enumerate()) material += device.sysName + "=" + device.vendor + ":" + device.product + ";";
+        for (const auto& [key, value] : exportConfiguration()) material += key + "=" + value + ";";
+        for (const auto& disk : diskFiles) {
+            std::ifstream sidecar(disk + ".cold");
+            std::stringstream overrides;
+            overrides << sidecar.rdbuf();
+            material += overrides.str() + ";";
+        }
+        return hashString(material);
+    }
+
+    // Sin perfil, con páginas enormes (dependen de las libres en cada
+    // arranque) o si las CPUs guardadas ya no están libres, se recompila
+    bool loadCompiledCommand() {
+        compiledArgv.clear();
+        if (profileHash.empty() || !hugepageSize.empty()) return false;
+        auto cache = loadKeyValueFile(compiledPath());
+        if (cache.empty() || cache["key"] != compiledKey()) return false;
+
+        std::vector<HostCPU> placement;
+        std::istringstream cpus(cache["cpus"]);
+        std::string id;
+        if (!cache["cpus"].empty() && !topology.load()) return false;
+        while (std::getline(cpus, id, ',')) {
+            int cpu = atoi(id.c_str());
+            auto match = std::find_if(topology.cpus.begin(), topology.cpus.end(),
+                                      [cpu](const HostCPU& host) { return host.id == cpu; });
+            if (match == topology.cpus.end() || (reservations && reservations->cpus.count(cpu))) return false;
+            placement.push_back(*match);
+        }
+        int housekeeping = cache.count("housekeeping") ? atoi(cache["housekeeping"].c_str()) : -1;
+        if (housekeeping >= 0 && reservations && reservations->cpus.count(housekeeping)) return false;
+        std::vector<std::string> argv;
+        for (int i = 0; cache.count("argv." + std::to_string(i)); i++) argv.push_back(cache["argv." + std::to_string(i)]);
+        if (argv.empty()) return false;
+
+        TraceSpan span = traceSpan("loadCompiledCommand", "boot");
+        vcpuPlacement = placement;
+        housekeepingCPU = housekeeping;
+        if (reservations) {
+            for (const auto& cpu : vcpuPlacement) reservations->cpus.insert(cpu.id);
+            if (housekeepingCPU >= 0) reservations->cpus.insert(housekeepingCPU);
+        }
+        placementPlanned = true;
+        planIOThreadPlacement();
+        compiledArgv = argv;
+        success("Profile unchanged, reusing compiled QEMU command");
+        return true;
+    }
+
+    void saveCompiledCommand(const std::vector<std::string>& argv) {
+        std::map<std::string, std::string> cache;
+        cache["key"] = compiledKey();
+        std::string cpus;
+        for (const auto& cpu : vcpuPlacement) cpus += (cpus.empty() ? "" : ",") + std::to_string(cpu.id);
+        cache["cpus"] = cpus;
+        cache["housekeeping"] = std::to_string(housekeepingCPU);
+        for (size_t i = 0; i < argv.size(); i++) cache["argv." + std::to_string(i)] = argv[i];
+        saveKeyValueFile(compiledPath(), cache);
+    }
+
+    // Con páginas enormes el globo no devuelve nada: hugetlbfs no se trocea
+    // --latency tampoco: inflarlo provoca fallos de página en los vCPUs; y
+    // con VFIO toda la RAM queda fijada para DMA
+    bool balloonEnabled() const { return hugepageSize.empty() && !latencyMode && !hasPassthrough(); }
+    bool hasPassthrough() const { return !pciDevices.empty() || !sriovPF.empty(); }
+
+    // Enlaza a vfio-pci los dispositivos pedidos (y una VF del PF SR-IOV).
+    // Todo el grupo IOMMU va al invitado: otro endpoint con driver lo impide
+    bool preparePassthrough() {
+        passthroughDevices.clear();
+        if (!hasPassthrough()) return true;
+        TraceSpan span = traceSpan("preparePassthrough", "devices");
+        if (!fs::exists("/dev/vfio/vfio")) {
+            error("VFIO is not available; boot the host with intel_iommu=on or amd_iommu=on");
+            return false;
+        }
+        std::vector<std::string> wanted = pciDevices;
+        if (!sriovPF.empty()) {
+            if (!assignVirtualFunction()) return false;
+            wanted.push_back(assignedVF);
+        }
+        for (const auto& address : wanted) {
+            if (!PCIHost::exists(address)) {
+                error("PCI device " + address + " not found");
+                restorePassthrough();
+                return false;
+            }
+            auto group = PCIHost::iommuGroup(address);
+            if (group.empty()) {
+                error(address + " has no IOMMU group (IOMMU disabled?)");
+                restorePassthrough();
+                return false;
+            }
+            for (const auto& member : group) {
+                if (std::find(wanted.begin(), wanted.end(), member) != wanted.end() || PCIHost::isBridge(member)) continue;
+                std::string driver = PCIHost::driver(member);
+                if (!driver.empty() && driver != "vfio-pci") {
+                    error("IOMMU group of " + address + " also holds " + member + " (" + driver +
+                          "); pass it through as well or move the card to another slot");
+                    restorePassthrough();
+                    return false;
+                }
+            }
+        }
+        for (const auto& address : wanted) {
+            std::string original = PCIHost::driver(address);
+            if (original == "vfio-pci") continue;
+            if (!PCIHost::bindVFIO(address)) {
+                error("Cannot bind " + address + " to vfio-pci: " + strerror(errno));
+                restorePassthrough();
+                return false;
+            }
+            boundDevices.push_back({address, original});
+            debug(address + ": " + (original.empty() ? "no driver" : original) + " -> vfio-pci");
+        }
+        passthroughDevices = wanted;
+        return true;
+    }
+
+    // Crea las VFs del PF si no hay ninguna y reserva la primera libre; la
+    // flota comparte el PF y la última VM en salir vuelve a sriov_numvfs=0
+    bool assignVirtualFunction() {
+        HostReservations& shared = reservations ? *reservations : localReservations;
+        std::string numvfs = PCIHost::devicePath(sriovPF) + "/sriov_numvfs";
+        if (!fs::exists(numvfs)) {
+            error(sriovPF + " is not an SR-IOV physical function");
+            return false;
+        }
+        if (atoi(readFirstLine(numvfs).c_str()) == 0) {
+            int total = atoi(readFirstLine(PCIHost::devicePath(sriovPF) + "/sriov_totalvfs").c_str());
+            int count = std::min(sriovVFs, total);
+            if (count < 1 || !PCIHost::write(numvfs, std::to_string(count))) {
+                error("Cannot create " + std::to_string(sriovVFs) + " VF(s) on " + sriovPF);
+                return false;
+            }
+            shared.vfUsers[sriovPF] = 0;
+            success("Created " + std::to_string(count) + " VF(s) on " + sriovPF);
+        }
+        for (const auto& vf : PCIHost::virtualFunctions(sriovPF)) {
+            if (shared.pciDevices.count(vf)) continue;
+            shared.pciDevices.insert(vf);
+            if (shared.vfUsers.count(sriovPF)) shared.vfUsers[sriovPF]++;
+            assignedVF = vf;
+            return true;
+        }
+        error("No free VF left on " + sriovPF);
+        return false;
+    }
+
+    void restorePassthrough() {
+        for (auto it = boundDevices.rbegin(); it != boundDevices.rend(); ++it) {
+            if (PCIHost::restore(it->first, it->second)) {
+                debug(it->first + " returned to " + (it->second.empty() ? "no driver" : it->second));
+            } else {
+                warning("Could not rebind " + it->first + " to " + it->second);
+            }
+        }
+        boundDevices.clear();
+        if (!assignedVF.empty()) {
+            HostReservations& shared = reservations ? *reservations : localReservations;
+            shared.pciDevices.erase(assignedVF);
+            assignedVF.clear();
+            // vfUsers sólo cuenta los PF cuyas VFs creó Cold
+            auto users = shared.vfUsers.find(sriovPF);
+            if (users != shared.vfUsers.end() && --users->second <= 0) {
+                PCIHost::write(PCIHost::devicePath(sriovPF) + "/sriov_numvfs", "0");
+                shared.vfUsers.erase(users);
+                log("Removed the VFs of " + sriovPF);
+            }
+        }
+        passthroughDevices.clear();
+    }
+    bool balloonAdjustable() const { return balloonEnabled() && minRAMGB < maxRAMGB && qemuPid > 0; }
+    long long balloonTarget() const { return balloonTargetMB; }
+    long long minRAMMB() const { return (long long)minRAMGB * 1024; }
+    long long maxRAMMB() const { return (long long)maxRAMGB * 1024; }
 
-public:
-    ColdVM() {
-        diskDir = "./devices/disk";
-        romPath = "./devices/rom";
-        firmwarePath = "./boot/firmware/OVMF_CODE.fd";
-        varsPath = "./boot/firmware/OVMF_VARS.fd";
-        noVNCPath = "./libraries/noVNC";
-        useVNC = true;
-        useBridge = true;
-        bridgeInterface = "virbr0";
+    // Pide al invitado que deje 'targetMB' de RAM; el globo se infla o
+    // desinfla por su cuenta y query-balloon informa del valor real
+    bool setBalloonTarget(long long targetMB, const std::string& reason) {
+        targetMB = std::max(minRAMMB(), std::min(maxRAMMB(), targetMB));
+        if (targetMB == balloonTargetMB) return false;
+        std::string reply = qmp.execute("balloon", "{\"value\": " + std::to_string(targetMB * 1024 * 1024) + "}", 1000);
+        if (reply.find("\"return\"") == std::string::npos) {
+            warning("Balloon request failed: " + jsonStringField(reply, "desc"));
+            return false;
+        }
+        log("Balloon: " + std::to_string(balloonTargetMB) + " MB -> " + std::to_string(targetMB) + " MB (" + reason + ")");
+        balloonTargetMB = targetMB;
+        return true;
+    }
+
+    // Espera a que qemu-guest-agent conteste; devuelve ms desde el lanzamiento de QEMU o -1
+    long long waitForAgent(int timeoutMs) {
+        std::string socketPath = runDir + "/qga.sock";
+        long long deadline = monotonicMs() + timeoutMs;
+        while (monotonicMs() < deadline && qemuPid > 0 && !interruptPending()) {
+            if (waitpid(qemuPid, nullptr, WNOHANG) == qemuPid) {
+                error("QEMU exited before the guest agent answered");
+                qemuPid = -1;
+                return -1;
+            }
+            if (agent.connectAgent(socketPath, 1000)) return monotonicMs() - qemuLaunchedMs;
+            poll(nullptr, 0, 200);
+        }
+        return -1;
+    }
+
+    void resetAgentState() {
+        agentPingId.clear();
+        agentPingSentUs = 0;
+        agentUnanswered = 0;
+        agentReplyMs = 0;
+        agentRTTUs = 0;
+        guestReadyMs = -1;
+        agentLost = false;
+        frozenSinceMs = 0;
+        freezeRequestId.clear();
+        freezeRequested = false;
+        freezeSentMs = 0;
+        freezeDone = false;
+        freezeResult = -1;
+    }
+
+    // Rápido hasta que el invitado contesta por primera vez, luego en reposo
+    long long agentPingInterval() const { return guestReadyMs < 0 ? 1000 : 10000; }
+
+    // Un guest-ping sin esperar la respuesta (llega por handleAgentReplies).
+    // El chardev no lee mientras el agente no abre el puerto: con demasiados
+    // pings sin respuesta se reconecta para vaciar la cola en lugar de llenarla.
+    void pingAgent() {
+        if (qemuPid <= 0) return;
+        if (!agentPingId.empty()) {
+            agentPingId.clear();
+            agentUnanswered++;
+            if (guestReadyMs >= 0 && !agentLost && agentUnanswered >= 3) {
+                agentLost = true;
+                warning("Guest agent stopped answering (last reply " +
+                        std::to_string((monotonicMs() - agentReplyMs) / 1000) + " s ago)");
+            }
+        }
+        if (agentUnanswered > 0 && agentUnanswered % 8 == 0 && agent.connected()) {
+            agent.disconnect();
+            return;
+        }
+        if (!agent.connected() && !agent.attachAgent(runDir + "/qga.sock")) return;
+        agentPingSentUs = monotonicUs();
+        agentPingId = agent.submit("guest-ping");
+    }
+
+    // Lee las respuestas del agente en el bucle del supervisor; cualquiera
+    // cuenta como señal de vida. false si el canal se cerró.
+    bool handleAgentReplies() {
+        if (!agent.readAvailable()) {
+            agentPingId.clear();
+            abandonFreeze("guest agent channel closed");
+            return false;
+        }
+        for (const auto& reply : agent.takeReplies()) {
+            std::string id = QMPClient::replyId(reply);
+            if (id.empty()) continue;
+            if (id == freezeRequestId) finishFreeze(reply);
+            if (id == agentPingId) {
+                agentRTTUs = monotonicUs() - agentPingSentUs;
+                agentPingId.clear();
+            }
+            agentUnanswered = 0;
+            agentReplyMs = monotonicMs();
+            if (guestReadyMs < 0) {
+                guestReadyMs = agentReplyMs - qemuLaunchedMs;
+                success("Guest OS ready in " + std::to_string(guestReadyMs) + " ms (guest agent answered)");
+                StartupTrace::instance().instant("guest ready", displayName());
+            } else if (agentLost) {
+                agentLost = false;
+                success("Guest agent answering again");
+            }
+        }
+        return true;
+    }
+
+    void finishFreeze(const std::string& reply) {
+        freezeRequestId.clear();
+        freezeResult = (int)jsonNumberField(reply, "return", -1);
+        freezeDone = true;
+        if (freezeResult < 0) {
+            warning(std::string("Guest filesystem ") + (freezeRequested ? "freeze" : "thaw") + " failed: " +
+                    jsonStringField(reply, "desc"));
+            // Un freeze a medias deja algunos sistemas de ficheros bloqueados
+            if (freezeRequested) agent.submit("guest-fsfreeze-thaw");
+        } else if (freezeRequested) {
+            frozenSinceMs = monotonicMs();
+            log("Guest filesystems frozen (" + std::to_string(freezeResult) + ") in " +
+                std::to_string(frozenSinceMs - freezeSentMs) + " ms");
+        } else {
+            log("Guest filesystems thawed after " + std::to_string(monotonicMs() - frozenSinceMs) + " ms");
+            frozenSinceMs = 0;
+        }
+    }
+
+    QMPClient& guestAgent() { return agent; }
+    bool guestAgentUp() const { return guestReadyMs >= 0 && !agentLost; }
+
+    // guest-fsfreeze-freeze/thaw sin bloquear al supervisor: la respuesta
+    // la recoge handleAgentReplies() y el resultado takeFreezeResult().
+    // false si no hay agente o ya hay otra petición en vuelo.
+    bool submitFreeze(bool freeze) {
+        if (qemuPid <= 0 || !guestAgentUp() || !agent.connected() || !freezeRequestId.empty()) return false;
+        freezeRequestId = agent.submit(freeze ? "guest-fsfreeze-freeze" : "guest-fsfreeze-thaw");
+        if (freezeRequestId.empty()) return false;
+        freezeRequested = freeze;
+        freezeSentMs = monotonicMs();
+        return true;
+    }
+
+    bool guestFrozen() const { return frozenSinceMs > 0; }
+    bool freezePending() const { return !freezeRequestId.empty(); }
+    long long freezeReplyDeadline() const { return freezeRequestId.empty() ? 0 : freezeSentMs + 10000; }
+
+    // Sistemas de ficheros afectados o -1; true una sola vez por petición
+    bool takeFreezeResult(int& count) {
+        if (!freezeDone) return false;
+        freezeDone = false;
+        count = freezeResult;
+        return true;
+    }
+
+    // Sin respuesta en el plazo (o canal cerrado): un freeze que llegue tarde
+    // lo deshace el thaw, que qemu-ga atiende después en orden
+    void abandonFreeze(const std::string& reason) {
+        if (freezeRequestId.empty()) return;
+        warning(std::string("Guest filesystem ") + (freezeRequested ? "freeze" : "thaw") + " failed: " + reason);
+        freezeRequestId.clear();
+        if (freezeRequested && agent.connected()) agent.submit("guest-fsfreeze-thaw");
+        freezeResult = -1;
+        freezeDone = true;
+    }
+
+    // Un cold backup que muere entre freeze y thaw no deja el invitado bloqueado
+    long long thawDeadline() const {
+        return frozenSinceMs > 0 && freezeRequestId.empty() ? frozenSinceMs + 60000 : 0;
+    }
+
+    void expireFreeze() {
+        warning("Guest filesystems still frozen after 60 s, thawing");
+        // Sin agente no hay thaw posible: se reintenta en otros 60 s
+        if (!submitFreeze(false)) frozenSinceMs = monotonicMs();
+    }
+
+    // cold backup: el canal del agente es del supervisor, así que el freeze
+    // se pide por su HTTP local (POST /agent/<vm>/freeze|thaw)
+    bool requestGuestFreeze(const std::string& action) {
+        if (tuningPort <= 0) return false;
+        ControlChannel channel;
+        if (!channel.connectTo("127.0.0.1", tuningPort)) return false;
+        channel.sendLine("POST /agent/" + displayName() + "/" + action + " HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+                         "Content-Length: 0\r\n\r");
+        std::string status;
+        // El supervisor contesta como mucho a los 10 s de enviar el guest-fsfreeze-*
+        return channel.readLine(status, 15000) && status.find(" 200 ") != std::string::npos;
+    }
+
+    // Ejecuta un script con /bin/sh en el invitado (guest-exec) y recoge stdout
+    bool guestExec(const std::string& script, std::string& output, int timeoutMs) {
+        std::string reply = agent.execute("guest-exec", "{\"path\": \"/bin/sh\", \"arg\": [\"-c\", \"" +
+                                          jsonEscape(script) + "\"], \"capture-output\": true}");
+        long long pid = (long long)jsonNumberField(reply, "pid", -1);
+        if (pid < 0) {
+            error("guest-exec failed: " + jsonStringField(reply, "desc"));
+            return false;
+        }
+        long long deadline = monotonicMs() + timeoutMs;
+        while (monotonicMs() < deadline && !interruptPending()) {
+            reply = agent.execute("guest-exec-status", "{\"pid\": " + std::to_string(pid) + "}");
+            if (jsonBoolField(reply, "exited")) {
+                output = base64Decode(jsonStringField(reply, "out-data"));
+                return (int)jsonNumberField(reply, "exitcode", -1) == 0;
+            }
+            poll(nullptr, 0, 250);
+        }
+        return false;
+    }
+
+    // cold bench: invitado sin pantalla ni USB sobre un overlay desechable
+    // de 'image', con rutas propias en ./devices/bench y ./run/bench
+    void setBenchMode(const std::string& image) {
+        instanceName = "bench";
+        logPrefix = "[bench] ";
+        diskDir = "./devices/bench/disk";
+        romPath = "./devices/bench/rom";
+        varsPath = "./boot/firmware/bench/OVMF_VARS.fd";
+        runDir = "./run/bench";
+        tapInterface = "cold-tapb";
+        displayMode = "none";
+        enableCamera = false;
+        enableAudio = false;
+        enableMicrophone = false;
+        // iperf3 apunta a la pasarela, que passt y slirp llevan al host
+        useBridge = false;
+        baseImage = image;
+        cloneMode = "overlay";
+    }
+
+    // Cada ronda arranca de un overlay nuevo: mismo punto de partida
+    void resetBenchDisk() {
+        std::error_code ec;
+        fs::remove(diskDir + "/disk.qcow2", ec);
+    }
+
+    std::string runDirectory() const { return runDir; }
+
+    // Métricas para GET /metrics; se recogen sólo cuando alguien consulta
+    void collectMetrics(MetricsText& out) {
+        std::string vm = MetricsText::label("vm", displayName());
+        out.add("cold_vm_up", "gauge", "1 while the QEMU process is running", {vm}, qemuPid > 0 ? 1 : 0);
+        if (qemuPid <= 0) return;
+
+        collectThreadMetrics(out, vm);
+        collectAgentMetrics(out, vm);
+        if (qmp.connected()) {
+            collectBlockMetrics(out, vm);
+            collectKVMMetrics(out, vm);
+            collectBalloonMetrics(out, vm);
+        }
+        if (dedup) collectKSMMetrics(out, vm);
+        if (netBackend == "tap") {
+            std::string base = "/sys/class/net/" + tapInterface + "/statistics/";
+            std::string interface = MetricsText::label("interface", tapInterface);
+            for (const std::string counter : {"rx_bytes", "tx_bytes", "rx_packets", "tx_packets", "rx_dropped", "tx_dropped"}) {
+                std::string value = readFirstLine(base + counter);
+                if (value.empty()) continue;
+                out.add("cold_net_" + counter + "_total", "counter",
+                        "Host-side tap counter (rx is traffic sent by the guest)", {vm, interface}, atof(value.c_str()));
+            }
+        }
+    }
+
+    static std::string metricName(const std::string& name) {
+        std::string out;
+        for (char c : name) out += isalnum((unsigned char)c) ? c : '_';
+        return out;
+    }
+
+    // CPU por hilo desde /proc/<pid>/task/*/stat; la espera en cola de
+    // schedstat de un hilo de vCPU es el tiempo robado que ve el invitado
+    void collectThreadMetrics(MetricsText& out, const std::string& vm) {
+        static const double ticks = (double)sysconf(_SC_CLK_TCK);
+        std::map<std::string, std::pair<double, double>> otherThreads;   // comm -> user, system
+        std::string procDir = "/proc/" + std::to_string(qemuPid);
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(procDir + "/task", ec)) {
+            std::string base = entry.path().string();
+            std::string comm = readFirstLine(base + "/comm");
+            std::string stat = readFirstLine(base + "/stat");
+            // comm puede tener espacios: los campos siguen al último ')'
+            size_t close = stat.rfind(')');
+            if (comm.empty() || close == std::string::npos) continue;
+            std::istringstream fields(stat.substr(close + 1));
+            std::string skip;
+            for (int field = 3; field < 14; field++) fields >> skip;
+            double user = 0, system = 0;
+            fields >> user >> system;
+            user /= ticks;
+            system /= ticks;
+
+            int vcpu = -1;
+            if (sscanf(comm.c_str(), "CPU %d/KVM", &vcpu) == 1) {
+                std::string index = MetricsText::label("vcpu", std::to_string(vcpu));
+                out.add("cold_vcpu_cpu_seconds_total", "counter", "Host CPU time of each vCPU thread",
+                        {vm, index, MetricsText::label("mode", "user")}, user);
+                out.add("cold_vcpu_cpu_seconds_total", "counter", "Host CPU time of each vCPU thread",
+                        {vm, index, MetricsText::label("mode", "system")}, system);
+                std::istringstream sched(readFirstLine(base + "/schedstat"));
+                double runNs = 0, waitNs = 0;
+                if (sched >> runNs >> waitNs) {
+                    out.add("cold_vcpu_steal_seconds_total", "counter",
+                            "Time each vCPU thread was runnable but waiting for a host CPU", {vm, index}, waitNs / 1e9);
+                }
+            } else {
+                otherThreads[comm].first += user;
+                otherThreads[comm].second += system;
+            }
+        }
+        for (const auto& [name, times] : otherThreads) {
+            std::string thread = MetricsText::label("thread", name);
+            out.add("cold_qemu_thread_cpu_seconds_total", "counter", "Host CPU time of the other QEMU threads, by name",
+                    {vm, thread, MetricsText::label("mode", "user")}, times.first);
+            out.add("cold_qemu_thread_cpu_seconds_total", "counter", "Host CPU time of the other QEMU threads, by name",
+                    {vm, thread, MetricsText::label("mode", "system")}, times.second);
+        }
+
+        std::ifstream status(procDir + "/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            long kb = 0;
+            if (sscanf(line.c_str(), "VmRSS: %ld kB", &kb) == 1) {
+                out.add("cold_qemu_resident_bytes", "gauge", "Resident memory of the QEMU process", {vm}, kb * 1024.0);
+            }
+        }
+    }
+
+    void collectBlockMetrics(MetricsText& out, const std::string& vm) {
+        struct Counter {
+            const char* field;
+            const char* name;
+            const char* help;
+            double scale;
+        };
+        static const Counter counters[] = {
+            {"rd_bytes", "cold_block_read_bytes_total", "Bytes read by the guest", 1},
+            {"wr_bytes", "cold_block_written_bytes_total", "Bytes written by the guest", 1},
+            {"rd_operations", "cold_block_read_ops_total", "Read requests completed", 1},
+            {"wr_operations", "cold_block_write_ops_total", "Write requests completed", 1},
+            {"flush_operations", "cold_block_flush_ops_total", "Flush requests completed", 1},
+            {"rd_total_time_ns", "cold_block_read_seconds_total", "Time spent on read requests", 1e-9},
+            {"wr_total_time_ns", "cold_block_write_seconds_total", "Time spent on write requests", 1e-9},
+            {"flush_total_time_ns", "cold_block_flush_seconds_total", "Time spent on flush requests", 1e-9},
+        };
+        std::string reply = qmp.execute("query-blockstats", "", 1000);
+        for (const auto& device : jsonArrayObjects(reply, "return")) {
+            std::string name = jsonStringField(device, "node-name");
+            if (name.empty()) name = jsonStringField(device, "device");
+            if (name.empty()) continue;
+            // Un disco con límites tiene el nodo throttle como raíz: misma etiqueta
+            if (name.rfind("throttle", 0) == 0) name = "disk" + name.substr(8);
+            std::string drive = MetricsText::label("drive", name);
+            for (const auto& counter : counters) {
+                double value = jsonNumberField(device, counter.field, std::numeric_limits<double>::quiet_NaN());
+                out.add(counter.name, "counter", counter.help, {vm, drive}, value * counter.scale);
+            }
+        }
+    }
+
+    // Estadísticas binarias de KVM (query-stats, QEMU 7.1+) por vCPU y por VM
+    void collectKVMMetrics(MetricsText& out, const std::string& vm) {
+        for (const std::string target : {"vcpu", "vm"}) {
+            std::string reply = qmp.execute("query-stats", "{\"target\": \"" + target + "\"}", 1000);
+            auto results = jsonArrayObjects(reply, "return");
+            for (size_t i = 0; i < results.size(); i++) {
+                std::vector<std::string> labels = {vm};
+                if (target == "vcpu") labels.push_back(MetricsText::label("vcpu", std::to_string(i)));
+                for (const auto& stat : jsonArrayObjects(results[i], "stats")) {
+                    std::string name = jsonStringField(stat, "name");
+                    if (name.empty()) continue;
+                    // Los histogramas (arrays) se omiten: jsonNumberField devuelve NaN
+                    out.add("cold_kvm_" + target + "_" + metricName(name), "untyped", "KVM statistic " + name,
+                            labels, jsonNumberField(stat, "value", std::numeric_limits<double>::quiet_NaN()));
+                }
+            }
+        }
+    }
+
+    // /proc/<pid>/ksm_stat (Linux 6.1+): páginas de QEMU fusionadas por KSM
+    void collectKSMMetrics(MetricsText& out, const std::string& vm) {
+        std::ifstream stat("/proc/" + std::to_string(qemuPid) + "/ksm_stat");
+        std::string key;
+        double value = 0;
+        while (stat >> key >> value) {
+            if (key == "ksm_merging_pages") {
+                out.add("cold_ksm_merging_pages", "gauge", "Guest pages merged by KSM", {vm}, value);
+            } else if (key == "ksm_zero_pages") {
+                out.add("cold_ksm_zero_pages", "gauge", "Guest zero pages merged into the zero page", {vm}, value);
+            } else if (key == "ksm_process_profit") {
+                out.add("cold_ksm_profit_bytes", "gauge", "Memory saved by KSM minus its metadata", {vm}, value);
+            }
+        }
+    }
+
+    void collectBalloonMetrics(MetricsText& out, const std::string& vm) {
+        std::string reply = qmp.execute("query-balloon", "", 1000);
+        if (reply.find("\"return\"") == std::string::npos) return;
+        out.add("cold_balloon_actual_bytes", "gauge", "Guest RAM left after ballooning", {vm},
+                jsonNumberField(reply, "actual", std::numeric_limits<double>::quiet_NaN()));
+        out.add("cold_balloon_target_bytes", "gauge", "Guest RAM requested by the balloon policy", {vm},
+                (double)balloonTargetMB * 1024 * 1024);
+        out.add("cold_ram_min_bytes", "gauge", "Lowest guest RAM the balloon may leave", {vm},
+                (double)minRAMGB * 1024 * 1024 * 1024);
+        out.add("cold_ram_max_bytes", "gauge", "Guest RAM at boot", {vm},
+                (double)maxRAMGB * 1024 * 1024 * 1024);
+
+        reply = qmp.execute("qom-get", "{\"path\": \"/machine/peripheral/balloon0\", \"property\": \"guest-stats\"}", 1000);
+        for (const std::string stat : {"stat-total-memory", "stat-free-memory", "stat-available-memory", "stat-disk-caches",
+                                       "stat-swap-in", "stat-swap-out", "stat-major-faults", "stat-minor-faults"}) {
+            double value = jsonNumberField(reply, stat, -1);
+            // -1: el invitado no informa esta estadística
+            if (value < 0) continue;
+            bool bytes = stat.find("memory") != std::string::npos || stat == "stat-disk-caches";
+            out.add("cold_guest_" + metricName(stat.substr(5)) + (bytes ? "_bytes" : "_total"), bytes ? "gauge" : "counter",
+                    "Guest-reported balloon statistic " + stat, {vm}, value);
+        }
+    }
+
+    void collectAgentMetrics(MetricsText& out, const std::string& vm) {
+        out.add("cold_guest_agent_up", "gauge", "1 while qemu-guest-agent answers the supervisor's pings", {vm},
+                guestAgentUp() ? 1 : 0);
+        out.add("cold_guest_frozen", "gauge", "1 while the guest filesystems are frozen for a backup", {vm},
+                frozenSinceMs > 0 ? 1 : 0);
+        if (guestReadyMs < 0) return;
+        out.add("cold_guest_ready_seconds", "gauge", "Time from QEMU launch to the first guest agent reply", {vm},
+                guestReadyMs / 1000.0);
+        out.add("cold_guest_agent_ping_seconds", "gauge", "Round trip of the last guest-ping", {vm}, agentRTTUs / 1e6);
+        out.add("cold_guest_agent_last_reply_seconds", "gauge", "Time since the guest agent last answered", {vm},
+                (monotonicMs() - agentReplyMs) / 1000.0);
+    }
+
+    // Parada inmediata (fallos de arranque); el supervisor usa el apagado ACPI
+    void cleanup() {
+        log("Shutting down Cold VM...");
+        qmp.disconnect();
+        agent.disconnect();
+        if (qemuPid != -1) {
+            kill(qemuPid, SIGTERM);
+            waitpid(qemuPid, nullptr, 0);
+            qemuPid = -1;
+            success("QEMU stopped");
+        }
+        leaveCgroup();
+        stopHelpers();
+    }
+
+    // Detiene el servidor web, passt y el tap una vez QEMU ha terminado
+    void stopHelpers() {
+        if (webPid != -1) {
+            kill(webPid, SIGTERM);
+            waitpid(webPid, nullptr, 0);
+            webPid = -1;
+            success(webServerName() + " stopped");
+        }
+        if (passtPid != -1) {
+            kill(passtPid, SIGTERM);
+            waitpid(passtPid, nullptr, 0);
+            passtPid = -1;
+        }
+        stopShares();
+        if (netBackend == "tap") {
+            destroyTapDevice();
+        }
+        restorePassthrough();
+    }
+
+    // Apagado ACPI ordenado a través de QMP
+    bool requestPowerdown() {
+        return qmp.execute("system_powerdown").find("\"return\"") != std::string::npos;
+    }
+
+    // El supervisor ya recogió estos procesos con waitpid
+    void qemuExited() {
         qemuPid = -1;
-        websockifyPid = -1;
+        qmp.disconnect();
+        agent.disconnect();
+        resetAgentState();
+        leaveCgroup();
+    }
+    void webServerExited() { webPid = -1; }
+    void passtExited() { passtPid = -1; }
+    std::vector<SharedFolder>& sharedFolders() { return shares; }
+
+    pid_t getQEMUPid() const { return qemuPid; }
+    pid_t getWebServerPid() const { return webPid; }
+    pid_t getPasstPid() const { return passtPid; }
+    QMPClient& monitor() { return qmp; }
+
+    void printHeader() {
+        std::cout << "\n";
+        std::cout << "╔═══════════════════════════════════════╗\n";
+        std::cout << "║          COLD VM MANAGER v2.0         ║\n";
+        std::cout << "║     Advanced Virtual Machine System   ║\n";
+        std::cout << "╚═══════════════════════════════════════╝\n";
+        std::cout << "\n";
+    }
+
+    void printConfiguration() {
+        log("System Configuration:");
+        std::cout << "  → CPU: " << cpuModel << " (" << cpuCores << " cores)\n";
+        std::cout << "  → RAM: " << maxRAMGB << " GB";
+        if (balloonEnabled() && minRAMGB < maxRAMGB) std::cout << " (balloon down to " << minRAMGB << " GB)";
+        if (dedup) std::cout << (hugepageSize.empty() ? " (KSM dedup)" : " (KSM dedup ignored: hugepages are never merged)");
+        if (!hugepageSize.empty()) std::cout << " (" << hugepageSize << " hugepages requested)";
+        std::cout << "\n";
+        if (!vcpuPlacement.empty()) {
+            std::vector<int> hostCPUs;
+            std::set<int> hostNodes;
+            for (const auto& cpu : vcpuPlacement) {
+                hostCPUs.push_back(cpu.id);
+                hostNodes.insert(cpu.node);
+            }
+            std::cout << "  → Pinning: host CPUs " << formatCPUList(hostCPUs) << " ("
+                      << hostNodes.size() << " NUMA node(s))\n";
+        } else {
+            std::cout << "  → Pinning: " << (enablePinning ? "Unavailable" : "Disabled") << "\n";
+        }
+        for (const auto& device : passthroughDevices) {
+            std::cout << "  → Passthrough: " << device << " (" << PCIHost::description(device)
+                      << (device == assignedVF ? ", SR-IOV VF of " + sriovPF : "") << ")\n";
+        }
+        for (const auto& share : shares) {
+            std::cout << "  → Share: " << share.path << " (virtiofs tag '" << share.tag << "'"
+                      << (share.readOnly ? ", read-only" : "")
+                      << (preflightCache["virtiofs.dax"] == "1" && share.daxGB > 0 ? ", " + std::to_string(share.daxGB) + " GB DAX" : "")
+                      << ")\n";
+        }
+        for (const auto& spec : usbDevices) {
+            std::cout << "  → USB: " << spec << (usbHotplug ? " (hot-attach)" : "") << "\n";
+        }
+        if (latencyMode && vcpuPlacement.empty()) {
+            std::cout << "  → Latency: locked RAM, no balloon (vCPUs not pinned, no isolation)\n";
+        } else if (latencyMode) {
+            std::cout << "  → Latency: isolated cpuset, SCHED_FIFO vCPUs, locked RAM, no balloon";
+            if (housekeepingCPU >= 0) std::cout << ", housekeeping CPU " << housekeepingCPU;
+            std::cout << "\n";
+        }
+        if (needsCgroup() && !resourceSettings.empty()) {
+            std::string limits;
+            for (const auto& [key, value] : resourceSettings) {
+                if (key.rfind("limits.", 0) == 0) limits += (limits.empty() ? "" : ", ") + key.substr(7) + "=" + value;
+            }
+            if (!limits.empty()) std::cout << "  → Limits (cgroup v2): " << limits << "\n";
+        }
+        std::cout << "  → VirtIO: Enabled\n";
+        if (!compiledArgv.empty()) std::cout << "  → QEMU command: compiled profile cache (" << compiledPath() << ")\n";
+        for (size_t i = 0; i < diskPolicies.size() && i < diskFiles.size(); i++) {
+            const auto& policy = diskPolicies[i];
+            std::cout << "  → Disk " << fs::path(diskFiles[i]).filename().string() << ": " << policy.format
+                      << " on " << policy.filesystem << ", cache=" << policy.cache << ", aio=" << policy.aio
+                      << ", discard=" << policy.discard << ", detect-zeroes=" << policy.detectZeroes
+                      << (policy.l2CacheBytes > 0 ? ", l2-cache=" + std::to_string(policy.l2CacheBytes >> 10) + "K" : "")
+                      << (policy.source == "sidecar" ? " (sidecar)" : "") << "\n";
+        }
+        std::cout << "  → OVMF/UEFI: " << (fs::exists(firmwarePath) ? "Enabled" : "Disabled") << "\n";
+        std::cout << "  → Display: ";
+        if (displayMode == "websocket" || displayMode == "websockify") {
+            DisplayTuning tuning = baseDisplayTuning();
+            std::cout << (displayMode == "websocket" ? "VNC over QEMU websocket" : "VNC via websockify")
+                      << " (Remote, " << (adaptiveDisplay() ? "adaptive" : vncLink + " link") << ": "
+                      << tuning.encoding << ", quality " << tuning.quality << ", compression "
+                      << tuning.compression << ", " << tuning.fps << " fps)\n";
+        } else if (displayMode == "spice") {
+            std::cout << (findRenderNode().empty() ? "SPICE (Remote)" : "SPICE with virtio-gpu GL (Local)") << "\n";
+        } else if (displayMode == "none") {
+            std::cout << "None (headless)\n";
+        } else {
+            std::cout << "GTK (Local)\n";
+        }
+        std::cout << "\n";
+    }
+
+    bool boot() {
+        TraceSpan span = traceSpan("boot", "boot");
+        if (instanceIndex <= 0) printHeader();
+        log("Initializing Cold VM...");
         
-        // Configuración por defecto
-        cpuCores = 4;
-        ramGB = 4;
-        cpuModel = "host";
-        enableCamera = true;
-        enableAudio = true;
-        enableMicrophone = true;
+        createDirectories();
+        
+        debug("Checking system requirements...");
+        runPreflight();
+        
+        // Verificar QEMU
+        if (!checkCommand("qemu-system-x86_64", "QEMU")) {
+            error("QEMU is required but not installed!");
+            return false;
+        }
+        
+        // Verificar firmware
+        checkFile(firmwarePath, "OVMF Firmware");
+        
+        // Verificar componentes VNC
+        if (displayMode == "websockify" && !checkCommand("websockify", "Websockify")) {
+            error("Websockify is required for --display=websockify!");
+            return false;
+        }
+        if (displayMode == "websocket" && !checkCommand("python3", "Python 3")) {
+            error("Python 3 is required to serve the noVNC pages!");
+            return false;
+        }
+        if (displayMode == "websocket" || displayMode == "websockify") {
+            checkFile(noVNCPath, "noVNC");
+        }
+        
+        // Verificar bridge
+        if (useBridge) {
+            checkBridgeInterface();
+        }
+        selectNetworkBackend();
+        
+        // Los discos e ISOs ya se escanearon durante el preflight
+        if (diskFiles.empty()) {
+            warning("No disk images found!");
+            if (createDefaultDisk()) {
+                diskFiles = findAllDisks();
+            }
+        }
+        
+        if (diskFiles.empty() && isoFiles.empty()) {
+            error("No bootable media available!");
+            error("Please add disk images to " + diskDir + "/ or ISOs to " + romPath + "/");
+            return false;
+        }
+        
+        if (!preparePassthrough()) return false;
+        prepareShares();
+        
+        std::cout << "\n";
+        if (!loadCompiledCommand()) {
+            planCPUPlacement();
+            resolveDiskPolicies();
+        }
+        if (latencyMode) checkLatencyHost();
+        printConfiguration();
+        saveKeyValueFile(runDir + "/config.export", exportConfiguration());
+        
+        // Determinar modo de arranque
+        if (!isoFiles.empty() && !diskFiles.empty()) {
+            log("Boot Mode: ISO Installation with persistent disk(s)");
+        } else if (!isoFiles.empty()) {
+            log("Boot Mode: Live ISO (no persistent storage)");
+        } else {
+            log("Boot Mode: Disk boot");
+        }
+        
+        std::cout << "\n";
+        log("Starting virtual machine...");
+        std::cout << "\n";
+        
+        if (!startQEMU()) {
+            error("Failed to start QEMU!");
+            return false;
+        }
+        
+        success("QEMU started successfully!");
+        return startDisplay();
+    }
+
+    // Websockify y el aviso de acceso una vez QEMU está en marcha
+    bool startDisplay() {
+        if (displayMode == "websocket" || displayMode == "websockify") {
+            if (!startWebServer()) {
+                cleanup();
+                return false;
+            }
+            
+            success(webServerName() + " started successfully!");
+            std::cout << "\n";
+            std::cout << "╔═══════════════════════════════════════════════════════════════╗\n";
+            std::cout << "║  " << std::left << std::setw(61) << (instanceName.empty() ? "VM" : instanceName) + " is ready! Access via web browser:"
+                      << std::right << "║\n";
+            std::cout << "║                                                               ║\n";
+            std::cout << "║  Features: Remote scaling, auto-connect, full control         ║\n";
+            std::cout << "╚═══════════════════════════════════════════════════════════════╝\n";
+            // El enlace va fuera del recuadro a propósito: con host, puerto
+            // y parámetros de ajuste suele pasar del ancho del marco
+            std::cout << "  🌐 " << noVNCURL() << "\n";
+        } else if (displayMode == "spice") {
+            std::string renderNode = findRenderNode();
+            success("SPICE display ready" + std::string(renderNode.empty() ? "" : " (GL on " + renderNode + ")"));
+            std::cout << "  🖥  remote-viewer "
+                      << (renderNode.empty() ? "spice://localhost:" + std::to_string(5930 + vncDisplay)
+                                             : "spice+unix://" + spiceSocketPath()) << "\n";
+        } else if (displayMode == "none") {
+            success("VM started headless");
+        } else {
+            success("VM started in local display mode!");
+        }
+        
+        std::cout << "\n";
+        log("Press Ctrl+C to shutdown the VM");
+        std::cout << "\n";
+        
+        return true;
+    }
+
+    // Modo flota: rutas, puertos, MAC y tap propios de la instancia 'index'
+    void setInstance(int index, HostReservations* shared) {
+        instanceIndex = index;
+        instanceName = "vm" + std::to_string(index);
+        logPrefix = "[" + instanceName + "] ";
+        diskDir = "./devices/" + instanceName + "/disk";
+        varsPath = "./boot/firmware/" + instanceName + "/OVMF_VARS.fd";
+        runDir = "./run/" + instanceName;
+        vncDisplay = 1 + index;
+        webPort = 8080 + index;
+        tapInterface = "cold-tap" + std::to_string(index);
+        char mac[18];
+        snprintf(mac, sizeof(mac), "52:54:00:12:%02x:%02x", ((0x3456 + index) >> 8) & 0xff, (0x3456 + index) & 0xff);
+        macAddress = mac;
+        reservations = shared;
+
+        // Una cámara USB sólo puede pasarse a un invitado
+        if (index > 0) enableCamera = false;
+    }
+
+    void setDisplayMode(const std::string& mode) { displayMode = mode; }
+    void setVNCLink(const std::string& link) { vncLink = link; }
+    void setVNCQuality(int quality) { vncQuality = quality; }
+    void setVNCCompression(int level) { vncCompression = level; }
+    void setVNCFrameRate(int fps) { vncFPS = fps; }
+    void setVNCEncoding(const std::string& encoding) { vncEncoding = encoding; }
+    void setTuningPort(int port) { tuningPort = port; }
+    void setBridgeMode(bool enabled) { useBridge = enabled; }
+    void setCPUCores(int cores) { cpuCores = cores; }
+    void setRAMRange(int minGB, int maxGB) { minRAMGB = minGB; maxRAMGB = maxGB; }
+    void setCamera(bool enabled) { enableCamera = enabled; }
+    void setMicrophone(bool enabled) { enableMicrophone = enabled; }
+    void setPinning(bool enabled) { enablePinning = enabled; }
+    void setDedup(bool enabled) { dedup = enabled; }
+    void setDiskLayout(const std::string& prealloc, const std::string& cluster, int extendedL2) {
+        if (!prealloc.empty()) diskPrealloc = prealloc;
+        if (!cluster.empty()) diskCluster = cluster;
+        if (extendedL2 >= 0) diskExtendedL2 = extendedL2 == 1;
     }
+    void addUSBDevice(const std::string& spec) { usbDevices.push_back(spec); }
+    void addShare(const SharedFolder& share) { shares.push_back(share); }
+    void setUSBHotplug(bool enabled) { usbHotplug = enabled; }
+    void addPCIDevice(const std::string& address) { pciDevices.push_back(PCIHost::normalize(address)); }
+    void setSRIOV(const std::string& pf, int vfs) { sriovPF = PCIHost::normalize(pf); sriovVFs = vfs; }
+    void setLatencyMode(bool enabled) { latencyMode = enabled; }
+    void setHugepages(const std::string& size) { hugepageSize = size; }
+    void setNATMode(const std::string& mode) { natMode = mode; }
+    void setBaseImage(const std::string& path, const std::string& mode) { baseImage = path; cloneMode = mode; }
+};
 
-    // Sistema de logs mejorado
-    void log(const std::string& message) {
-        std::cout << "- " << message << std::endl;
+// Supervisor de eventos: signalfd + pidfd + QMP + timerfd en un único
+// epoll. Recoge a los hijos al instante, reinicia QEMU/servidor web con
+// backoff y apaga con ACPI -> SIGTERM -> SIGKILL. En reposo no usa CPU.
+class ColdSupervisor {
+public:
+    ColdSupervisor() : epollFd(-1), signalFd(-1), timerFd(-1), shuttingDown(false),
+                       shutdownTimeoutMs(30000), httpPort(0), httpFd(-1), ueventFd(-1), lastDisplaySampleMs(0),
+                       lastBalloonCheckMs(0), ksm(nullptr) {}
+
+    ~ColdSupervisor() {
+        for (auto& entry : vms) closeWatches(entry);
+        for (const auto& client : httpClients) close(client.first);
+        if (httpFd >= 0) close(httpFd);
+        if (ueventFd >= 0) close(ueventFd);
+        if (timerFd >= 0) close(timerFd);
+        if (signalFd >= 0) close(signalFd);
+        if (epollFd >= 0) close(epollFd);
     }
 
-    void warning(const std::string& message) {
-        std::cout << "! " << message << std::endl;
+    // Bloquea las señales para recibirlas por signalfd; llamar antes de fork
+    static void blockSignals() {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, nullptr);
     }
 
-    void debug(const std::string& message) {
-        std::cout << "+ " << message << std::endl;
+    void add(ColdVM* vm) {
+        Entry entry;
+        entry.vm = vm;
+        entry.startedMs = monotonicMs();
+        vms.push_back(entry);
     }
 
-    void error(const std::string& message) {
-        std::cerr << "✗ " << message << std::endl;
+    void setShutdownTimeout(int seconds) { shutdownTimeoutMs = seconds * 1000LL; }
+    void setHTTPPort(int port) { httpPort = port; }
+    void setKSM(KSMTuning* tuning) { ksm = tuning; }
+
+    int run() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGCHLD);
+        signalFd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+        if (epollFd < 0 || timerFd < 0 || signalFd < 0) {
+            std::cerr << "✗ Failed to set up supervisor: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        watch(signalFd, SOURCE_SIGNAL, 0);
+        watch(timerFd, SOURCE_TIMER, 0);
+        for (size_t i = 0; i < vms.size(); i++) {
+            watchVM(i);
+            watchMedia(i);
+        }
+        if (httpPort > 0) openHTTP();
+        if (std::any_of(vms.begin(), vms.end(), [](const Entry& entry) { return entry.vm->usbHotplugEnabled(); })) {
+            openUevents();
+        }
+
+        while (anyRunning()) {
+            armTimer();
+            struct epoll_event events[16];
+            int n = epoll_wait(epollFd, events, 16, -1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) break;
+
+            for (int e = 0; e < n; e++) {
+                uint32_t source = (uint32_t)(events[e].data.u64 & 0xff);
+                size_t index = (size_t)(events[e].data.u64 >> 8);
+                switch (source) {
+                    case SOURCE_SIGNAL: handleSignals(); break;
+                    case SOURCE_TIMER:  handleTimers(); break;
+                    case SOURCE_QEMU:   reapQEMU(index); break;
+                    case SOURCE_WEB:    reapWebServer(index); break;
+                    case SOURCE_QMP:    handleQMP(index); break;
+                    case SOURCE_HTTP:   acceptHTTP(); break;
+                    case SOURCE_HTTP_CLIENT: handleHTTPClient((int)index); break;
+                    case SOURCE_UEVENT: handleUevents(); break;
+                    case SOURCE_MEDIA:  handleMedia(index); break;
+                    case SOURCE_AGENT:  handleAgent(index); break;
+                }
+            }
+        }
+        return 0;
     }
 
-    void success(const std::string& message) {
-        std::cout << "✓ " << message << std::endl;
+private:
+    enum Source { SOURCE_SIGNAL = 1, SOURCE_TIMER, SOURCE_QEMU, SOURCE_WEB, SOURCE_QMP,
+                  SOURCE_HTTP, SOURCE_HTTP_CLIENT, SOURCE_UEVENT, SOURCE_MEDIA, SOURCE_AGENT };   // HTTP_CLIENT: index = fd
+    enum Stage { STAGE_RUNNING, STAGE_POWERDOWN, STAGE_TERM, STAGE_KILL, STAGE_STOPPED };
+
+    struct Entry {
+        ColdVM* vm = nullptr;
+        int qemuPidfd = -1;
+        int webPidfd = -1;
+        int qmpFd = -1;
+        int agentFd = -1;                  // qemu-guest-agent (fd de QMPClient)
+        int freezeClient = -1;             // POST /agent/... esperando a qemu-ga
+        int mediaFd = -1;                  // inotify de diskDir y romPath
+        std::map<int, std::string> mediaWatches;
+        int qemuRestarts = 0;
+        int webRestarts = 0;
+        long long startedMs = 0;
+        long long qemuRestartAt = 0;       // 0 = sin reinicio pendiente
+        long long webRestartAt = 0;
+        long long stageDeadline = 0;
+        long long lastAgentPingMs = 0;
+        Stage stage = STAGE_RUNNING;
+    };
+
+    std::vector<Entry> vms;
+    int epollFd;
+    int signalFd;
+    int timerFd;
+    bool shuttingDown;
+    long long shutdownTimeoutMs;
+
+    // HTTP de control: /metrics y ajustes de pantalla para noVNC
+    struct HTTPClient {
+        std::string peer;
+        std::string request;
+    };
+    int httpPort;
+    int httpFd;
+    std::map<int, HTTPClient> httpClients;
+    int ueventFd;                       // --usb-hotplug: uevents del kernel
+    long long lastDisplaySampleMs;      // gobernador de pantalla, cada 2 s
+    long long lastBalloonCheckMs;       // política del globo, cada 5 s
+    KSMTuning* ksm;                     // --dedup
+
+    static int openPidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+        if (pid > 0) return (int)syscall(SYS_pidfd_open, pid, 0);
+#endif
+        (void)pid;
+        return -1;
     }
 
-    bool checkFile(const std::string& path, const std::string& name) {
-        if (fs::exists(path)) {
-            success(name + " found!");
-            return true;
-        } else {
-            warning(name + " not found at: " + path);
-            return false;
+    void watch(int fd, uint32_t source, size_t index) {
+        if (fd < 0) return;
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = ((uint64_t)index << 8) | source;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void unwatch(int& fd) {
+        if (fd < 0) return;
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        fd = -1;
+    }
+
+    void closeWatches(Entry& entry) {
+        if (entry.mediaFd >= 0) close(entry.mediaFd);
+        entry.mediaFd = -1;
+        if (entry.qemuPidfd >= 0) close(entry.qemuPidfd);
+        if (entry.webPidfd >= 0) close(entry.webPidfd);
+        entry.qemuPidfd = entry.webPidfd = -1;
+    }
+
+    // (Re)registra los descriptores de los procesos vivos de una VM
+    void watchVM(size_t index) {
+        Entry& entry = vms[index];
+        if (entry.qemuPidfd < 0 && entry.vm->getQEMUPid() > 0) {
+            entry.qemuPidfd = openPidfd(entry.vm->getQEMUPid());
+            watch(entry.qemuPidfd, SOURCE_QEMU, index);
+        }
+        if (entry.webPidfd < 0 && entry.vm->getWebServerPid() > 0) {
+            entry.webPidfd = openPidfd(entry.vm->getWebServerPid());
+            watch(entry.webPidfd, SOURCE_WEB, index);
+        }
+        // El fd del QMP lo cierra QMPClient: sólo se registra en epoll
+        int qmpFd = entry.vm->monitor().descriptor();
+        if (qmpFd >= 0 && qmpFd != entry.qmpFd) {
+            entry.qmpFd = qmpFd;
+            watch(qmpFd, SOURCE_QMP, index);
         }
     }
 
-    bool checkCommand(const std::string& cmd, const std::string& name) {
-        std::string checkCmd = "which " + cmd + " > /dev/null 2>&1";
-        if (system(checkCmd.c_str()) == 0) {
-            success(name + " is available!");
-            return true;
-        } else {
-            warning(name + " is not installed!");
-            return false;
+    void openHTTP() {
+        httpFd = ControlChannel::listenOn(httpPort);
+        if (httpFd < 0) {
+            std::cerr << "! Control HTTP port " << httpPort << " unavailable: " << strerror(errno) << std::endl;
+            return;
         }
+        fcntl(httpFd, F_SETFL, fcntl(httpFd, F_GETFL) | O_NONBLOCK);
+        watch(httpFd, SOURCE_HTTP, 0);
     }
 
-    bool checkBridgeInterface() {
-        std::string cmd = "ip link show " + bridgeInterface + " > /dev/null 2>&1";
-        if (system(cmd.c_str()) == 0) {
-            success("Bridge interface '" + bridgeInterface + "' is available!");
-            return true;
-        } else {
-            warning("Bridge interface '" + bridgeInterface + "' not found!");
-            warning("Falling back to user networking (NAT)");
-            useBridge = false;
-            return false;
+    // Altas y bajas en los directorios de medios mientras la VM corre; el
+    // siguiente arranque lee el índice sin recorrerlos. En NFS sólo se ven
+    // los cambios hechos desde este host: los demás cambian el mtime del
+    // directorio y provocan un recorrido al arrancar
+    void watchMedia(size_t index) {
+        Entry& entry = vms[index];
+        auto dirs = entry.vm->mediaDirectories();
+        if (dirs.empty()) return;
+        entry.mediaFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (entry.mediaFd < 0) return;
+        for (const auto& dir : dirs) {
+            int wd = inotify_add_watch(entry.mediaFd, dir.c_str(),
+                                       IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR);
+            if (wd >= 0) entry.mediaWatches[wd] = dir;
         }
+        watch(entry.mediaFd, SOURCE_MEDIA, index);
     }
 
-    std::vector<std::string> findAllDisks() {
-        debug("Scanning for disk images...");
-        std::vector<std::string> disks;
-        try {
-            if (fs::exists(diskDir) && fs::is_directory(diskDir)) {
-                for (const auto& entry : fs::directory_iterator(diskDir)) {
-                    std::string ext = entry.path().extension().string();
-                    if (ext == ".qcow2" || ext == ".img" || ext == ".raw" || ext == ".vdi" || ext == ".vmdk") {
-                        disks.push_back(entry.path().string());
-                        debug("Found disk: " + entry.path().filename().string());
-                    }
-                }
-                std::sort(disks.begin(), disks.end());
+    void handleMedia(size_t index) {
+        Entry& entry = vms[index];
+        if (entry.mediaFd < 0) return;
+        alignas(struct inotify_event) char buffer[16384];
+        bool changed = false, overflow = false;
+        ssize_t n;
+        while ((n = read(entry.mediaFd, buffer, sizeof(buffer))) > 0) {
+            for (char* p = buffer; p < buffer + n;) {
+                auto* event = (struct inotify_event*)p;
+                p += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) overflow = true;
+                auto dir = entry.mediaWatches.find(event->wd);
+                if (event->len == 0 || dir == entry.mediaWatches.end()) continue;
+                entry.vm->mediaChanged(dir->second + "/" + event->name, event->mask & (IN_DELETE | IN_MOVED_FROM));
+                changed = true;
             }
-        } catch (const fs::filesystem_error& e) {
-            error("Failed to scan disk directory: " + std::string(e.what()));
         }
-        return disks;
+        if (overflow) entry.vm->rebuildMediaIndex();
+        else if (changed) entry.vm->saveMediaIndex();
     }
 
-    std::vector<std::string> findAllISOs() {
-        debug("Scanning for ISO files...");
-        std::vector<std::string> isos;
-        try {
-            if (fs::exists(romPath) && fs::is_directory(romPath)) {
-                for (const auto& entry : fs::directory_iterator(romPath)) {
-                    if (entry.path().extension() == ".iso") {
-                        isos.push_back(entry.path().string());
-                        debug("Found ISO: " + entry.path().filename().string());
-                    }
+    // Uevents del kernel (lo mismo que escucha udev), sin depender de udev
+    void openUevents() {
+        ueventFd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+        struct sockaddr_nl addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = 1;
+        if (ueventFd < 0 || bind(ueventFd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            std::cerr << "! USB hotplug unavailable: " << strerror(errno) << std::endl;
+            if (ueventFd >= 0) close(ueventFd);
+            ueventFd = -1;
+            return;
+        }
+        watch(ueventFd, SOURCE_UEVENT, 0);
+    }
+
+    // "ACTION@DEVPATH\0CLAVE=valor\0...". Se conecta en bind, cuando las
+    // interfaces ya existen y la clase es legible; se suelta en remove
+    void handleUevents() {
+        char buffer[8192];
+        ssize_t n;
+        while ((n = recv(ueventFd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+            buffer[n] = '\0';
+            std::map<std::string, std::string> fields;
+            for (ssize_t i = 0; i < n; i += strlen(buffer + i) + 1) {
+                std::string field = buffer + i;
+                size_t eq = field.find('=');
+                if (eq != std::string::npos) fields[field.substr(0, eq)] = field.substr(eq + 1);
+            }
+            if (fields["SUBSYSTEM"] != "usb" || fields["DEVTYPE"] != "usb_device") continue;
+            std::string sysName = fs::path(fields["DEVPATH"]).filename().string();
+            if (fields["ACTION"] == "bind") {
+                for (auto& entry : vms) {
+                    if (entry.stage == STAGE_RUNNING && entry.vm->attachUSB(sysName)) break;
                 }
-                std::sort(isos.begin(), isos.end());
+            } else if (fields["ACTION"] == "remove") {
+                for (auto& entry : vms) entry.vm->detachUSB(sysName);
             }
-        } catch (const fs::filesystem_error& e) {
-            error("Failed to scan ROM directory: " + std::string(e.what()));
         }
-        return isos;
     }
 
-    void createDirectories() {
-        debug("Creating required directories...");
-        try {
-            fs::create_directories(diskDir);
-            fs::create_directories(romPath);
-            fs::create_directories("./boot/firmware");
-            fs::create_directories("./libraries");
-            success("Directory structure created!");
-        } catch (const fs::filesystem_error& e) {
-            error("Failed to create directories: " + std::string(e.what()));
+    void acceptHTTP() {
+        while (true) {
+            struct sockaddr_storage addr;
+            socklen_t len = sizeof(addr);
+            int fd = accept4(httpFd, (struct sockaddr*)&addr, &len, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd < 0) return;
+            char host[NI_MAXHOST] = "";
+            getnameinfo((struct sockaddr*)&addr, len, host, sizeof(host), nullptr, 0, NI_NUMERICHOST);
+            std::string peer = host;
+            if (peer.rfind("::ffff:", 0) == 0) peer = peer.substr(7);
+            httpClients[fd].peer = peer;
+            watch(fd, SOURCE_HTTP_CLIENT, (size_t)fd);
         }
     }
 
-    bool createDefaultDisk() {
-        std::string defaultDiskPath = diskDir + "/disk.qcow2";
-        if (!fs::exists(defaultDiskPath)) {
-            log("Creating default 30GB disk image...");
-            std::string cmd = "qemu-img create -f qcow2 \"" + defaultDiskPath + "\" 30G 2>&1";
-            int result = system(cmd.c_str());
-            if (result == 0) {
-                success("Default disk created successfully!");
-                return true;
-            } else {
-                error("Failed to create default disk!");
-                return false;
+    void handleHTTPClient(int fd) {
+        auto it = httpClients.find(fd);
+        if (it == httpClients.end()) return;
+        char chunk[2048];
+        ssize_t n;
+        while ((n = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT)) > 0) it->second.request.append(chunk, (size_t)n);
+        bool complete = it->second.request.find("\r\n\r\n") != std::string::npos;
+        bool closed = n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+        if (!complete && !closed && it->second.request.size() < 8192) return;
+
+        if (complete) {
+            const std::string& request = it->second.request;
+            size_t start = request.find(' ');
+            size_t end = start == std::string::npos ? start : request.find(' ', start + 1);
+            std::string path = end == std::string::npos ? "" : request.substr(start + 1, end - start - 1);
+            std::string method = start == std::string::npos ? "" : request.substr(0, start);
+            std::string response = method == "POST" && path.rfind("/agent/", 0) == 0
+                                 ? routeAgent(path.substr(7), it->second.peer, fd)
+                                 : routeHTTP(method, path, it->second.peer);
+            if (response.empty()) {
+                // Espera la respuesta de qemu-ga: la contesta answerFreeze()
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+                return;
             }
+            sendHTTPResponse(fd, response);
         }
-        return true;
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        httpClients.erase(it);
     }
 
-    bool createVarsFile() {
-        if (!fs::exists(varsPath)) {
-            log("Creating OVMF VARS file...");
-            
-            // Intentar copiar desde ubicaciones comunes
-            std::vector<std::string> varsSources = {
-                "/usr/share/OVMF/OVMF_VARS.fd",
-                "/usr/share/edk2-ovmf/x64/OVMF_VARS.fd",
-                "/usr/share/qemu/OVMF_VARS.fd"
-            };
-            
-            for (const auto& source : varsSources) {
-                if (fs::exists(source)) {
-                    try {
-                        fs::copy_file(source, varsPath);
-                        success("OVMF VARS file created from system template!");
-                        return true;
-                    } catch (const fs::filesystem_error& e) {
-                        debug("Failed to copy from " + source);
-                    }
-                }
+    // Las respuestas son pequeñas; un cliente lento no retiene el bucle más de 1 s
+    static void sendHTTPResponse(int fd, const std::string& response) {
+        long long deadline = monotonicMs() + 1000;
+        size_t sent = 0;
+        while (sent < response.size() && monotonicMs() < deadline) {
+            ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0) {
+                sent += (size_t)n;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, (int)std::max(1LL, deadline - monotonicMs()));
+            } else {
+                return;
             }
-            
-            // Si no se encuentra, crear uno vacío
-            warning("Creating empty OVMF VARS file (not recommended)");
-            std::ofstream varsFile(varsPath, std::ios::binary);
-            std::vector<char> emptyVars(64 * 1024 * 1024, 0);
-            varsFile.write(emptyVars.data(), emptyVars.size());
-            varsFile.close();
-            return true;
         }
-        return true;
     }
 
-    std::vector<std::string> buildQEMUCommand() {
-        std::vector<std::string> cmd;
-        
-        cmd.push_back("qemu-system-x86_64");
-        
-        // Aceleración KVM
-        cmd.push_back("-enable-kvm");
-        
-        // CPU
-        cmd.push_back("-cpu");
-        cmd.push_back(cpuModel);
-        cmd.push_back("-smp");
-        cmd.push_back(std::to_string(cpuCores));
-        
-        // RAM
-        cmd.push_back("-m");
-        cmd.push_back(std::to_string(ramGB) + "G");
-        
-        // VirtIO GPU para mejor rendimiento
-        cmd.push_back("-vga");
-        cmd.push_back("virtio");
-        cmd.push_back("-display");
-        if (useVNC) {
-            cmd.push_back("none");
-            cmd.push_back("-vnc");
-            cmd.push_back(":1");
-        } else {
-            cmd.push_back("gtk,gl=on");
-        }
-        
-        // UEFI Firmware (OVMF)
-        if (fs::exists(firmwarePath)) {
-            cmd.push_back("-drive");
-            cmd.push_back("if=pflash,format=raw,readonly=on,file=" + firmwarePath);
-            
-            if (createVarsFile()) {
-                cmd.push_back("-drive");
-                cmd.push_back("if=pflash,format=raw,file=" + varsPath);
+    static std::string httpResponse(const std::string& status, const std::string& type, const std::string& body) {
+        return "HTTP/1.1 " + status + "\r\nContent-Type: " + type + "\r\nContent-Length: " +
+               std::to_string(body.size()) + "\r\nAccess-Control-Allow-Origin: *\r\n"
+               "Cache-Control: no-store\r\nConnection: close\r\n\r\n" + body;
+    }
+
+    std::string routeHTTP(const std::string& method, const std::string& path, const std::string& peer) {
+        if (method != "GET") return httpResponse("405 Method Not Allowed", "text/plain", "method not allowed\n");
+        if (path == "/metrics") {
+            MetricsText out;
+            for (auto& entry : vms) {
+                entry.vm->collectMetrics(out);
+                out.add("cold_qemu_restarts_total", "counter", "QEMU restarts after a crash",
+                        {MetricsText::label("vm", entry.vm->displayName())}, entry.qemuRestarts);
             }
+            if (ksm) {
+                out.add("cold_ksm_pages_shared", "gauge", "KSM pages kept, each backing several guest pages", {},
+                        KSMTuning::stat("pages_shared"));
+                out.add("cold_ksm_pages_sharing", "gauge", "Guest pages mapped onto a shared KSM page", {},
+                        KSMTuning::stat("pages_sharing"));
+                out.add("cold_ksm_full_scans_total", "counter", "Complete KSM passes over mergeable memory", {},
+                        KSMTuning::stat("full_scans"));
+                out.add("cold_ksm_host_profit_bytes", "gauge", "Host memory saved by KSM minus its metadata", {},
+                        KSMTuning::stat("general_profit"));
+            }
+            return httpResponse("200 OK", "text/plain; version=0.0.4", out.str());
         }
-        
-        // Discos
-        if (!diskFiles.empty()) {
-            log("Attaching " + std::to_string(diskFiles.size()) + " disk(s):");
-            for (size_t i = 0; i < diskFiles.size(); i++) {
-                std::string diskPath = diskFiles[i];
-                std::string format = "qcow2";
-                
-                if (diskPath.find(".img") != std::string::npos || 
-                    diskPath.find(".raw") != std::string::npos) {
-                    format = "raw";
-                } else if (diskPath.find(".vdi") != std::string::npos) {
-                    format = "vdi";
-                } else if (diskPath.find(".vmdk") != std::string::npos) {
-                    format = "vmdk";
+        if (path.rfind("/display/", 0) == 0) {
+            std::string name = path.substr(9);
+            for (auto& entry : vms) {
+                if (entry.stage == STAGE_RUNNING && entry.vm->displayName() == name) {
+                    return httpResponse("200 OK", "application/json", entry.vm->displayTuningJSON(peer));
                 }
-                
-                cmd.push_back("-drive");
-                cmd.push_back("file=" + diskPath + ",format=" + format + ",if=virtio,cache=writeback");
-                
-                std::string bootFlag = (i == 0) ? " [PRIMARY BOOT]" : "";
-                log("  → " + fs::path(diskPath).filename().string() + bootFlag);
             }
         }
-        
-        // ISOs
-        if (!isoFiles.empty()) {
-            log("Attaching " + std::to_string(isoFiles.size()) + " ISO(s):");
-            for (size_t i = 0; i < isoFiles.size(); i++) {
-                std::string isoPath = isoFiles[i];
-                
-                if (i == 0) {
-                    cmd.push_back("-cdrom");
-                    cmd.push_back(isoPath);
-                    log("  → " + fs::path(isoPath).filename().string() + " [CDROM - BOOT PRIORITY]");
-                } else {
-                    cmd.push_back("-drive");
-                    cmd.push_back("file=" + isoPath + ",media=cdrom,readonly=on,if=ide,index=" + std::to_string(i));
-                    log("  → " + fs::path(isoPath).filename().string() + " [CDROM " + std::to_string(i) + "]");
-                }
+        return httpResponse("404 Not Found", "text/plain", "not found\n");
+    }
+
+    // POST /agent/<vm>/freeze|thaw desde cold backup; congelar un invitado
+    // es sólo para el propio host. Vacío = respuesta aplazada hasta qemu-ga.
+    std::string routeAgent(const std::string& request, const std::string& peer, int fd) {
+        if (peer != "127.0.0.1" && peer != "::1") return httpResponse("403 Forbidden", "text/plain", "loopback only\n");
+        size_t slash = request.rfind('/');
+        std::string name = slash == std::string::npos ? "" : request.substr(0, slash);
+        std::string action = slash == std::string::npos ? "" : request.substr(slash + 1);
+        for (auto& entry : vms) {
+            if (entry.stage != STAGE_RUNNING || entry.vm->displayName() != name) continue;
+            if (action != "freeze" && action != "thaw") break;
+            bool freeze = action == "freeze";
+            if (freeze == entry.vm->guestFrozen()) return freezeResponse(0);
+            if (entry.freezeClient >= 0 || entry.vm->freezePending()) {
+                return httpResponse("409 Conflict", "application/json", "{\"error\": \"freeze in progress\"}\n");
             }
+            if (!entry.vm->submitFreeze(freeze)) return freezeResponse(-1);
+            entry.freezeClient = fd;
+            return "";
         }
-        
-        // Audio con ALSA
-        if (enableAudio) {
-            cmd.push_back("-audiodev");
-            cmd.push_back("alsa,id=audio0");
-            cmd.push_back("-device");
-            cmd.push_back("intel-hda");
-            
-            if (enableMicrophone) {
-                cmd.push_back("-device");
-                cmd.push_back("hda-duplex,audiodev=audio0");
-                success("Audio & Microphone enabled!");
-            } else {
-                cmd.push_back("-device");
-                cmd.push_back("hda-output,audiodev=audio0");
-                success("Audio enabled (no microphone)");
-                warning("Microphone is disabled!");
+        return httpResponse("404 Not Found", "text/plain", "not found\n");
+    }
+
+    static std::string freezeResponse(int count) {
+        if (count < 0) return httpResponse("503 Service Unavailable", "application/json", "{\"error\": \"guest agent\"}\n");
+        return httpResponse("200 OK", "application/json", "{\"filesystems\": " + std::to_string(count) + "}\n");
+    }
+
+    // Entrega el resultado de guest-fsfreeze-* al cliente aplazado, si lo hay
+    void answerFreeze(Entry& entry) {
+        int count;
+        if (!entry.vm->takeFreezeResult(count) || entry.freezeClient < 0) return;
+        int fd = entry.freezeClient;
+        entry.freezeClient = -1;
+        sendHTTPResponse(fd, freezeResponse(count));
+        close(fd);
+        httpClients.erase(fd);
+    }
+
+    bool anyAdaptiveDisplay() const {
+        for (const auto& entry : vms) {
+            if (entry.stage == STAGE_RUNNING && entry.vm->adaptiveDisplay()) return true;
+        }
+        return false;
+    }
+
+    bool anyBalloonAdjustable() const {
+        for (const auto& entry : vms) {
+            if (entry.stage == STAGE_RUNNING && entry.vm->balloonAdjustable()) return true;
+        }
+        return false;
+    }
+
+    // Con presión de memoria (PSI some avg10 > 10%) todos los globos se
+    // inflan un cuarto de su margen; sin presión y con MemAvailable de sobra
+    // se desinflan, primero los invitados más apretados
+    void balanceBalloons() {
+        double pressure = HostMemory::pressure();
+        if (std::isnan(pressure)) return;
+        char reason[64];
+        snprintf(reason, sizeof(reason), "memory pressure %.1f%%", pressure);
+
+        std::vector<ColdVM*> adjustable;
+        for (auto& entry : vms) {
+            if (entry.stage == STAGE_RUNNING && entry.vm->balloonAdjustable()) adjustable.push_back(entry.vm);
+        }
+        auto step = [](ColdVM* vm) { return std::max(256LL, (vm->maxRAMMB() - vm->minRAMMB()) / 4); };
+        if (pressure > 10.0) {
+            for (ColdVM* vm : adjustable) vm->setBalloonTarget(vm->balloonTarget() - step(vm), reason);
+        } else if (pressure < 1.0) {
+            std::sort(adjustable.begin(), adjustable.end(), [](ColdVM* a, ColdVM* b) {
+                return a->balloonTarget() * b->maxRAMMB() < b->balloonTarget() * a->maxRAMMB();
+            });
+            // Se deja al host un colchón de 1 GB para no provocar la presión de vuelta
+            long available = HostMemory::availableMB() - 1024;
+            for (ColdVM* vm : adjustable) {
+                long long grow = std::min(step(vm), vm->maxRAMMB() - vm->balloonTarget());
+                if (grow <= 0 || grow > available) continue;
+                if (vm->setBalloonTarget(vm->balloonTarget() + grow, reason)) available -= grow;
             }
-        } else {
-            warning("Audio is disabled!");
         }
-        
-        // Red con bridge o NAT
-        if (useBridge) {
-            cmd.push_back("-netdev");
-            cmd.push_back("bridge,id=net0,br=" + bridgeInterface);
-            cmd.push_back("-device");
-            cmd.push_back("virtio-net-pci,netdev=net0,mac=52:54:00:12:34:56");
-            success("Network: Bridge mode (" + bridgeInterface + ") with internet access!");
-        } else {
-            cmd.push_back("-netdev");
-            cmd.push_back("user,id=net0");
-            cmd.push_back("-device");
-            cmd.push_back("virtio-net-pci,netdev=net0");
-            success("Network: NAT mode with internet access!");
+    }
+
+    bool anyRunning() const {
+        for (const auto& entry : vms) {
+            if (entry.stage != STAGE_STOPPED) return true;
         }
-        
-        // USB Controller y dispositivos
-        cmd.push_back("-device");
-        cmd.push_back("qemu-xhci,id=xhci");
-        
-        // Tablet para mejor precisión del mouse
-        cmd.push_back("-device");
-        cmd.push_back("usb-tablet");
-        
-        // Cámara web (USB passthrough)
-        if (enableCamera) {
-            debug("Detecting USB camera devices...");
-            
-            // Ejecutar lsusb y buscar cámaras comunes
-            FILE* pipe = popen("lsusb 2>/dev/null", "r");
-            if (pipe) {
-                char buffer[256];
-                bool cameraFound = false;
-                std::string cameraVendor, cameraProduct, cameraName;
-                
-                while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-                    std::string line(buffer);
-                    
-                    // Buscar palabras clave de cámaras
-                    if (line.find("Camera") != std::string::npos || 
-                        line.find("Webcam") != std::string::npos ||
-                        line.find("HD Webcam") != std::string::npos ||
-                        line.find("Integrated Camera") != std::string::npos) {
-                        
-                        // Extraer vendor:product ID
-                        size_t idPos = line.find("ID ");
-                        if (idPos != std::string::npos) {
-                            std::string ids = line.substr(idPos + 3, 9); // "xxxx:yyyy"
-                            cameraVendor = ids.substr(0, 4);
-                            cameraProduct = ids.substr(5, 4);
-                            
-                            // Extraer nombre
-                            size_t namePos = line.find(ids) + 10;
-                            cameraName = line.substr(namePos);
-                            cameraName.erase(cameraName.find_last_not_of(" \n\r\t") + 1);
-                            
-                            cameraFound = true;
-                            break;
-                        }
-                    }
-                }
-                pclose(pipe);
-                
-                if (cameraFound) {
-                    // Usar USB passthrough con los IDs detectados
-                    cmd.push_back("-device");
-                    cmd.push_back("usb-host,vendorid=0x" + cameraVendor + ",productid=0x" + cameraProduct);
-                    success("Camera enabled: " + cameraName);
-                    debug("Camera IDs: " + cameraVendor + ":" + cameraProduct);
-                } else {
-                    warning("No camera device found! Camera disabled.");
-                    warning("Make sure your camera is connected and working");
+        return false;
+    }
+
+    // Programa el timerfd para el plazo más próximo (o lo desarma)
+    void armTimer() {
+        long long next = 0;
+        for (const auto& entry : vms) {
+            long long ping = entry.stage == STAGE_RUNNING && entry.vm->getQEMUPid() > 0
+                           ? entry.lastAgentPingMs + entry.vm->agentPingInterval() : 0;
+            for (long long t : {entry.qemuRestartAt, entry.webRestartAt, entry.stageDeadline, ping,
+                                entry.vm->thawDeadline(), entry.vm->freezeReplyDeadline()}) {
+                if (t > 0 && (next == 0 || t < next)) next = t;
+            }
+        }
+        if (anyAdaptiveDisplay()) {
+            long long sample = lastDisplaySampleMs + 2000;
+            if (next == 0 || sample < next) next = sample;
+        }
+        if (anyBalloonAdjustable()) {
+            long long check = lastBalloonCheckMs + 5000;
+            if (next == 0 || check < next) next = check;
+        }
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        if (next > 0) {
+            long long delay = std::max(1LL, next - monotonicMs());
+            spec.it_value.tv_sec = delay / 1000;
+            spec.it_value.tv_nsec = (delay % 1000) * 1000000;
+        }
+        timerfd_settime(timerFd, 0, &spec, nullptr);
+    }
+
+    void handleSignals() {
+        struct signalfd_siginfo info;
+        while (read(signalFd, &info, sizeof(info)) == (ssize_t)sizeof(info)) {
+            if (info.ssi_signo == SIGCHLD) {
+                // Sin pidfd (kernel < 5.3) los hijos se recogen por SIGCHLD
+                for (size_t i = 0; i < vms.size(); i++) {
+                    reapQEMU(i);
+                    reapWebServer(i);
+                    reapPasst(i);
+                    reapShares(i);
                 }
+            } else if (!shuttingDown) {
+                std::cout << "\n";
+                shuttingDown = true;
+                for (auto& entry : vms) beginShutdown(entry);
             } else {
-                warning("Could not execute lsusb to detect camera!");
+                // Segundo Ctrl+C: no esperar al invitado
+                for (auto& entry : vms) {
+                    if (entry.vm->getQEMUPid() > 0) {
+                        kill(entry.vm->getQEMUPid(), SIGKILL);
+                        entry.stage = STAGE_KILL;
+                    }
+                }
             }
-        } else {
-            warning("Camera is disabled!");
-        }
-        
-        // RTC
-        cmd.push_back("-rtc");
-        cmd.push_back("base=localtime,clock=host,driftfix=slew");
-        
-        // Boot order
-        if (!isoFiles.empty()) {
-            cmd.push_back("-boot");
-            cmd.push_back("order=dc,menu=on");
-        } else {
-            cmd.push_back("-boot");
-            cmd.push_back("order=c,menu=on");
         }
-        
-        // Mejoras de rendimiento
-        cmd.push_back("-machine");
-        cmd.push_back("type=q35,accel=kvm");
-        
-        return cmd;
     }
 
-    bool startWebsockify() {
-        if (!useVNC) return true;
-        
-        log("Starting websockify for noVNC...");
-        
-        if (!fs::exists(noVNCPath)) {
-            error("noVNC directory not found at: " + noVNCPath);
-            return false;
+    void beginShutdown(Entry& entry) {
+        entry.qemuRestartAt = entry.webRestartAt = 0;
+        if (entry.vm->getQEMUPid() <= 0) {
+            finishVM(entry);
+            return;
         }
-        
-        pid_t pid = fork();
-        if (pid == 0) {
-            std::string cmd = "websockify --web=" + noVNCPath + " 8080 localhost:5901 2>&1";
-            execl("/bin/sh", "sh", "-c", cmd.c_str(), (char*)NULL);
-            exit(1);
-        } else if (pid > 0) {
-            websockifyPid = pid;
-            sleep(2);
-            return true;
+        entry.vm->log("Requesting ACPI powerdown...");
+        if (entry.vm->requestPowerdown()) {
+            entry.stage = STAGE_POWERDOWN;
+            entry.stageDeadline = monotonicMs() + shutdownTimeoutMs;
         } else {
-            error("Failed to fork websockify process!");
-            return false;
+            kill(entry.vm->getQEMUPid(), SIGTERM);
+            entry.stage = STAGE_TERM;
+            entry.stageDeadline = monotonicMs() + 5000;
         }
     }
 
-    bool startQEMU() {
-        log("Starting QEMU virtual machine...");
-        
-        auto cmd = buildQEMUCommand();
-        
-        // Mostrar comando completo en debug
-        debug("QEMU Command:");
-        std::string fullCmd = "";
-        for (const auto& arg : cmd) {
-            fullCmd += arg + " ";
+    void handleTimers() {
+        uint64_t expirations;
+        ssize_t ignored = read(timerFd, &expirations, sizeof(expirations));
+        (void)ignored;
+
+        long long now = monotonicMs();
+        if (anyAdaptiveDisplay() && now >= lastDisplaySampleMs + 2000) {
+            lastDisplaySampleMs = now;
+            for (auto& entry : vms) {
+                if (entry.stage == STAGE_RUNNING && entry.vm->adaptiveDisplay()) entry.vm->sampleDisplayClients();
+            }
         }
-        debug(fullCmd);
-        
-        std::vector<char*> args;
-        for (const auto& arg : cmd) {
-            args.push_back(const_cast<char*>(arg.c_str()));
+        if (anyBalloonAdjustable() && now >= lastBalloonCheckMs + 5000) {
+            lastBalloonCheckMs = now;
+            balanceBalloons();
         }
-        args.push_back(nullptr);
-        
-        pid_t pid = fork();
-        if (pid == 0) {
-            execvp(args[0], args.data());
-            exit(1);
-        } else if (pid > 0) {
-            qemuPid = pid;
-            sleep(3);
-            return true;
-        } else {
-            error("Failed to fork QEMU process!");
-            return false;
+        for (size_t i = 0; i < vms.size(); i++) {
+            Entry& entry = vms[i];
+            if (entry.stage == STAGE_RUNNING && entry.vm->getQEMUPid() > 0 &&
+                now >= entry.lastAgentPingMs + entry.vm->agentPingInterval()) {
+                entry.lastAgentPingMs = now;
+                pingAgent(i);
+            }
+            if (entry.vm->freezeReplyDeadline() > 0 && now >= entry.vm->freezeReplyDeadline()) {
+                entry.vm->abandonFreeze("no answer from the guest agent");
+                answerFreeze(entry);
+            }
+            if (entry.vm->thawDeadline() > 0 && now >= entry.vm->thawDeadline()) entry.vm->expireFreeze();
+            if (entry.stageDeadline > 0 && now >= entry.stageDeadline && entry.vm->getQEMUPid() > 0) {
+                if (entry.stage == STAGE_POWERDOWN) {
+                    entry.vm->warning("Guest did not power off in time, sending SIGTERM");
+                    kill(entry.vm->getQEMUPid(), SIGTERM);
+                    entry.stage = STAGE_TERM;
+                    entry.stageDeadline = now + 5000;
+                } else {
+                    entry.vm->warning("QEMU ignored SIGTERM, killing it");
+                    kill(entry.vm->getQEMUPid(), SIGKILL);
+                    entry.stage = STAGE_KILL;
+                    entry.stageDeadline = 0;
+                }
+            }
+            if (entry.qemuRestartAt > 0 && now >= entry.qemuRestartAt) {
+                entry.qemuRestartAt = 0;
+                entry.vm->log("Restarting QEMU (attempt " + std::to_string(entry.qemuRestarts) + ")...");
+                if (entry.vm->startQEMU()) {
+                    entry.startedMs = monotonicMs();
+                    entry.vm->success("QEMU restarted");
+                    watchVM(i);
+                } else {
+                    scheduleQEMURestart(entry);
+                }
+            }
+            if (entry.webRestartAt > 0 && now >= entry.webRestartAt) {
+                entry.webRestartAt = 0;
+                if (entry.vm->startWebServer()) {
+                    entry.vm->success(entry.vm->webServerName() + " restarted");
+                    watchVM(i);
+                } else {
+                    entry.webRestartAt = monotonicMs() + backoffMs(++entry.webRestarts);
+                }
+            }
         }
     }
 
-    void cleanup() {
-        log("Shutting down Cold VM...");
-        if (qemuPid != -1) {
-            kill(qemuPid, SIGTERM);
-            waitpid(qemuPid, nullptr, 0);
-            success("QEMU stopped");
+    // 1 s, 2 s, 4 s... hasta 60 s
+    static long long backoffMs(int attempt) {
+        return std::min(60000LL, 1000LL << std::min(attempt - 1, 6));
+    }
+
+    void scheduleQEMURestart(Entry& entry) {
+        // Si llevaba un rato estable, el contador vuelve a empezar
+        if (monotonicMs() - entry.startedMs > 60000) entry.qemuRestarts = 0;
+        entry.qemuRestarts++;
+        long long delay = backoffMs(entry.qemuRestarts);
+        entry.qemuRestartAt = monotonicMs() + delay;
+        entry.vm->warning("Restarting QEMU in " + std::to_string(delay / 1000) + " s");
+    }
+
+    static std::string describeStatus(int status) {
+        if (WIFEXITED(status)) return "exited with status " + std::to_string(WEXITSTATUS(status));
+        if (WIFSIGNALED(status)) return "killed by signal " + std::to_string(WTERMSIG(status));
+        return "stopped";
+    }
+
+    void reapQEMU(size_t index) {
+        Entry& entry = vms[index];
+        pid_t pid = entry.vm->getQEMUPid();
+        int status = 0;
+        if (pid <= 0 || waitpid(pid, &status, WNOHANG) != pid) return;
+
+        unwatch(entry.qemuPidfd);
+        if (entry.qmpFd >= 0) epoll_ctl(epollFd, EPOLL_CTL_DEL, entry.qmpFd, nullptr);
+        if (entry.agentFd >= 0) epoll_ctl(epollFd, EPOLL_CTL_DEL, entry.agentFd, nullptr);
+        entry.qmpFd = entry.agentFd = -1;
+        entry.vm->abandonFreeze("QEMU exited");
+        answerFreeze(entry);
+        entry.vm->qemuExited();
+
+        bool crashed = !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        if (shuttingDown || entry.stage != STAGE_RUNNING) {
+            entry.vm->success("QEMU stopped (" + describeStatus(status) + ")");
+            finishVM(entry);
+        } else if (crashed) {
+            entry.vm->error("QEMU " + describeStatus(status));
+            scheduleQEMURestart(entry);
+        } else {
+            // El invitado se apagó por sí mismo, se suspendió a disco o migró
+            entry.vm->success(entry.vm->hasSavedState() ? "Guest suspended to disk"
+                              : entry.vm->migratedAway() ? "Guest migrated to another host" : "Guest powered off");
+            finishVM(entry);
         }
-        if (websockifyPid != -1) {
-            kill(websockifyPid, SIGTERM);
-            waitpid(websockifyPid, nullptr, 0);
-            success("Websockify stopped");
+    }
+
+    void reapWebServer(size_t index) {
+        Entry& entry = vms[index];
+        pid_t pid = entry.vm->getWebServerPid();
+        int status = 0;
+        if (pid <= 0 || waitpid(pid, &status, WNOHANG) != pid) return;
+
+        unwatch(entry.webPidfd);
+        entry.vm->webServerExited();
+        if (entry.stage == STAGE_RUNNING && !shuttingDown) {
+            entry.vm->error(entry.vm->webServerName() + " " + describeStatus(status));
+            entry.webRestartAt = monotonicMs() + backoffMs(++entry.webRestarts);
         }
     }
 
-    void printHeader() {
-        std::cout << "\n";
-        std::cout << "╔═══════════════════════════════════════╗\n";
-        std::cout << "║          COLD VM MANAGER v2.0         ║\n";
-        std::cout << "║     Advanced Virtual Machine System   ║\n";
-        std::cout << "╚═══════════════════════════════════════╝\n";
-        std::cout << "\n";
+    void reapPasst(size_t index) {
+        Entry& entry = vms[index];
+        pid_t pid = entry.vm->getPasstPid();
+        int status = 0;
+        if (pid <= 0 || waitpid(pid, &status, WNOHANG) != pid) return;
+        entry.vm->passtExited();
+        if (entry.stage == STAGE_RUNNING) entry.vm->warning("passt " + describeStatus(status) + ", guest NAT is down");
     }
 
-    void printConfiguration() {
-        log("System Configuration:");
-        std::cout << "  → CPU: " << cpuModel << " (" << cpuCores << " cores)\n";
-        std::cout << "  → RAM: " << ramGB << " GB\n";
-        std::cout << "  → VirtIO: Enabled\n";
-        std::cout << "  → OVMF/UEFI: " << (fs::exists(firmwarePath) ? "Enabled" : "Disabled") << "\n";
-        std::cout << "  → Display: " << (useVNC ? "VNC (Remote)" : "GTK (Local)") << "\n";
-        std::cout << "\n";
+    // Un virtiofsd caído no se puede reconectar: la carpeta vuelve cuando
+    // QEMU se reinicia
+    void reapShares(size_t index) {
+        Entry& entry = vms[index];
+        for (auto& share : entry.vm->sharedFolders()) {
+            int status = 0;
+            if (share.daemon <= 0 || waitpid(share.daemon, &status, WNOHANG) != share.daemon) continue;
+            share.daemon = -1;
+            if (entry.stage == STAGE_RUNNING && entry.vm->getQEMUPid() > 0) {
+                entry.vm->warning("virtiofsd for share '" + share.tag + "' " + describeStatus(status) +
+                                  ", folder unavailable until QEMU restarts");
+            }
+        }
     }
 
-    bool boot() {
-        printHeader();
-        log("Initializing Cold VM...");
-        
-        createDirectories();
-        
-        debug("Checking system requirements...");
-        
-        // Verificar QEMU
-        if (!checkCommand("qemu-system-x86_64", "QEMU")) {
-            error("QEMU is required but not installed!");
-            return false;
+    void handleQMP(size_t index) {
+        Entry& entry = vms[index];
+        QMPClient& qmp = entry.vm->monitor();
+        if (!qmp.readAvailable()) {
+            // QEMU cerró el monitor; el pidfd/SIGCHLD confirmará la salida
+            if (entry.qmpFd >= 0) epoll_ctl(epollFd, EPOLL_CTL_DEL, entry.qmpFd, nullptr);
+            entry.qmpFd = -1;
+            return;
         }
-        
-        // Verificar firmware
-        checkFile(firmwarePath, "OVMF Firmware");
-        
-        // Verificar componentes VNC
-        if (useVNC) {
-            if (!checkCommand("websockify", "Websockify")) {
-                error("Websockify is required for VNC mode!");
-                return false;
+        for (const auto& event : qmp.takeEvents()) {
+            std::string name = jsonStringField(event, "event");
+            if (name == "SHUTDOWN" || name == "POWERDOWN" || name == "RESET" || name == "GUEST_PANICKED") {
+                entry.vm->debug("QEMU event: " + name);
             }
-            checkFile(noVNCPath, "noVNC");
         }
-        
-        // Verificar bridge
-        if (useBridge) {
-            checkBridgeInterface();
+    }
+
+    // El fd del agente cambia con cada reconexión de pingAgent()
+    void pingAgent(size_t index) {
+        Entry& entry = vms[index];
+        QMPClient& agent = entry.vm->guestAgent();
+        if (!agent.connected()) entry.agentFd = -1;
+        entry.vm->pingAgent();
+        if (!agent.connected()) {
+            entry.agentFd = -1;
+        } else if (agent.descriptor() != entry.agentFd) {
+            entry.agentFd = agent.descriptor();
+            watch(entry.agentFd, SOURCE_AGENT, index);
         }
+    }
+
+    void handleAgent(size_t index) {
+        Entry& entry = vms[index];
+        if (!entry.vm->handleAgentReplies()) {
+            // QEMU cerró el chardev; el siguiente ping reconecta
+            if (entry.agentFd >= 0) epoll_ctl(epollFd, EPOLL_CTL_DEL, entry.agentFd, nullptr);
+            entry.agentFd = -1;
+        }
+        answerFreeze(entry);
+    }
+
+    // QEMU terminó definitivamente: parar los auxiliares
+    void finishVM(Entry& entry) {
+        // QEMU cerró ya sus discos: el IN_CLOSE_WRITE pendiente actualiza el índice
+        handleMedia((size_t)(&entry - vms.data()));
+        entry.stage = STAGE_STOPPED;
+        entry.stageDeadline = 0;
+        entry.qemuRestartAt = entry.webRestartAt = 0;
+        unwatch(entry.webPidfd);
+        entry.vm->stopHelpers();
+        if (ksm && !shuttingDown) {
+            int running = 0;
+            for (const auto& other : vms) running += other.stage == STAGE_RUNNING;
+            if (running > 0) ksm->apply(running);
+        }
+    }
+};
+
+// cold bench: arranque hasta el agente, fio e iperf3 dentro del invitado,
+// repetido N veces y comparado con una línea base guardada
+class ColdBench {
+public:
+    ColdBench(ColdVM& vm, int runs) : vm(vm), runs(runs) {}
+
+    int run(bool saveBaseline) {
+        std::map<std::string, std::vector<double>> samples;
+        bool hostIperf = !findInPath("iperf3").empty();
+        if (!hostIperf) vm.warning("iperf3 not found on the host, skipping network tests");
         
-        // Buscar discos e ISOs
-        diskFiles = findAllDisks();
-        isoFiles = findAllISOs();
-        
-        if (diskFiles.empty()) {
-            warning("No disk images found!");
-            if (createDefaultDisk()) {
-                diskFiles = findAllDisks();
+        for (int round = 1; round <= runs && !interruptPending(); round++) {
+            vm.log("Benchmark run " + std::to_string(round) + "/" + std::to_string(runs));
+            vm.resetBenchDisk();
+            if (!vm.boot()) {
+                vm.cleanup();
+                return 1;
+            }
+            long long agentMs = vm.waitForAgent(180000);
+            if (agentMs < 0) {
+                vm.error("Guest agent did not answer (is qemu-guest-agent installed in the image?)");
+                vm.cleanup();
+                return 1;
             }
+            samples["boot_to_agent_ms"].push_back((double)agentMs);
+            runFio("randread", samples);
+            runFio("randwrite", samples);
+            if (hostIperf) {
+                runIperf(false, samples);
+                runIperf(true, samples);
+            }
+            vm.cleanup();
         }
+        if (samples.empty()) return 1;
         
-        if (diskFiles.empty() && isoFiles.empty()) {
-            error("No bootable media available!");
-            error("Please add disk images to ./devices/disk/ or ISOs to ./devices/rom/");
-            return false;
+        int regressions = report(samples);
+        if (saveBaseline) {
+            std::map<std::string, std::string> baseline;
+            baseline["config"] = configHash();
+            for (const auto& entry : samples) {
+                baseline[entry.first + ".p50"] = formatValue(percentile(entry.second, 50));
+                baseline[entry.first + ".p99"] = formatValue(percentile(entry.second, 99));
+            }
+            if (saveKeyValueFile(baselinePath(), baseline)) {
+                vm.success("Baseline saved to " + baselinePath());
+            }
         }
-        
-        std::cout << "\n";
-        printConfiguration();
-        
-        // Determinar modo de arranque
-        if (!isoFiles.empty() && !diskFiles.empty()) {
-            log("Boot Mode: ISO Installation with persistent disk(s)");
-        } else if (!isoFiles.empty()) {
-            log("Boot Mode: Live ISO (no persistent storage)");
-        } else {
-            log("Boot Mode: Disk boot");
+        // Al guardar una línea base nueva la comparación sólo informa
+        return regressions > 0 && !saveBaseline ? 2 : 0;
+    }
+
+private:
+    ColdVM& vm;
+    int runs;
+
+    std::string baselinePath() const { return vm.runDirectory() + "/baseline"; }
+
+    // La línea base sólo es comparable con la misma configuración
+    std::string configHash() {
+        auto config = vm.exportConfiguration();
+        std::string joined;
+        for (const auto& entry : config) joined += entry.first + "=" + entry.second + '\0';
+        return hashString(joined);
+    }
+
+    // Percentil por rango más cercano
+    static double percentile(std::vector<double> values, int rank) {
+        std::sort(values.begin(), values.end());
+        size_t index = (size_t)std::ceil(rank / 100.0 * values.size());
+        return values[std::max<size_t>(index, 1) - 1];
+    }
+
+    static std::string formatValue(double value) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.2f", value);
+        return buffer;
+    }
+
+    // Latencias y tiempos: menos es mejor; IOPS y ancho de banda: más
+    static bool lowerIsBetter(const std::string& metric) {
+        return metric.find("_ms") != std::string::npos || metric.find("_us") != std::string::npos;
+    }
+
+    // 4k aleatorio a QD32 con O_DIRECT, sobre un fichero del disco del invitado
+    void runFio(const std::string& mode, std::map<std::string, std::vector<double>>& samples) {
+        std::string output;
+        std::string script = "fio --name=cold-" + mode + " --filename=/var/tmp/cold-bench.dat --size=1G"
+                             " --rw=" + mode + " --bs=4k --iodepth=32 --ioengine=libaio --direct=1"
+                             " --time_based --runtime=15 --output-format=json";
+        if (!vm.guestExec(script, output, 120000)) {
+            vm.warning("fio " + mode + " failed in the guest");
+            return;
         }
-        
-        std::cout << "\n";
-        log("Starting virtual machine...");
-        std::cout << "\n";
-        
-        if (!startQEMU()) {
-            error("Failed to start QEMU!");
-            return false;
+        std::string section = mode == "randread" ? "\"read\"" : "\"write\"";
+        size_t pos = output.find(section);
+        if (pos == std::string::npos) return;
+        std::string job = output.substr(pos);
+        samples[mode + "_iops"].push_back(jsonNumberField(job, "iops", 0));
+        size_t clat = job.find("\"clat_ns\"");
+        if (clat == std::string::npos) return;
+        std::string latency = job.substr(clat);
+        samples[mode + "_clat_p50_us"].push_back(jsonNumberField(latency, "50.000000", 0) / 1000.0);
+        samples[mode + "_clat_p99_us"].push_back(jsonNumberField(latency, "99.000000", 0) / 1000.0);
+    }
+
+    // iperf3 contra el host a través de la pasarela del invitado; -R invierte el sentido
+    void runIperf(bool reverse, std::map<std::string, std::vector<double>>& samples) {
+        std::string failure;
+        pid_t server = spawnProcess({"iperf3", "-s", "-1", "-p", "5201"}, failure,
+                                    vm.runDirectory() + "/iperf3.log");
+        if (server < 0) {
+            vm.warning("Cannot start iperf3 server: " + failure);
+            return;
+        }
+        std::string output;
+        std::string script = "iperf3 -c $(ip route | awk '/default/ {print $3; exit}') -p 5201 -t 10 -J";
+        if (reverse) script += " -R";
+        bool ok = vm.guestExec(script, output, 60000);
+        kill(server, SIGTERM);
+        waitpid(server, nullptr, 0);
+        std::string metric = reverse ? "net_host_to_guest_gbps" : "net_guest_to_host_gbps";
+        size_t pos = output.find("\"sum_received\"");
+        if (!ok || pos == std::string::npos) {
+            vm.warning("iperf3 " + std::string(reverse ? "reverse " : "") + "test failed in the guest");
+            return;
+        }
+        samples[metric].push_back(jsonNumberField(output.substr(pos), "bits_per_second", 0) / 1e9);
+    }
+
+    // Devuelve cuántas métricas empeoran más de un 10% frente a la línea base
+    int report(const std::map<std::string, std::vector<double>>& samples) {
+        auto baseline = loadKeyValueFile(baselinePath());
+        bool comparable = !baseline.empty() && baseline["config"] == configHash();
+        if (!baseline.empty() && !comparable) {
+            vm.warning("Baseline was recorded with a different configuration, not comparing");
         }
         
-        success("QEMU started successfully!");
-        
-        if (useVNC) {
-            if (!startWebsockify()) {
-                cleanup();
-                return false;
+        int regressions = 0;
+        std::cout << "\n=== Benchmark (" << runs << " runs) ===\n";
+        for (const auto& entry : samples) {
+            double p50 = percentile(entry.second, 50);
+            double p99 = percentile(entry.second, 99);
+            std::cout << std::left << std::setw(28) << entry.first
+                      << " p50 " << std::setw(12) << formatValue(p50)
+                      << " p99 " << std::setw(12) << formatValue(p99);
+            auto known = baseline.find(entry.first + ".p50");
+            if (comparable && known != baseline.end()) {
+                double reference = atof(known->second.c_str());
+                double change = reference != 0 ? (p50 - reference) / reference * 100.0 : 0;
+                bool worse = lowerIsBetter(entry.first) ? change > 10.0 : change < -10.0;
+                std::cout << " baseline " << known->second << " (" << (change >= 0 ? "+" : "")
+                          << formatValue(change) << "%)" << (worse ? "  REGRESSION" : "");
+                if (worse) regressions++;
             }
-            
-            success("Websockify started successfully!");
             std::cout << "\n";
-            std::cout << "╔═══════════════════════════════════════════════════════════════╗\n";
-            std::cout << "║  VM is ready! Access via web browser:                         ║\n";
-            std::cout << "║                                                               ║\n";
-            std::cout << "║  🌐 http://localhost:8080/vnc.html?resize=remote&autoconnect=true  ║\n";
-            std::cout << "║                                                               ║\n";
-            std::cout << "║  Features: Remote scaling, auto-connect, full control         ║\n";
-            std::cout << "╚═══════════════════════════════════════════════════════════════╝\n";
-        } else {
-            success("VM started in local display mode!");
         }
-        
-        std::cout << "\n";
-        log("Press Ctrl+C to shutdown the VM");
-        std::cout << "\n";
-        
-        return true;
+        std::cout << std::endl;
+        if (regressions > 0) {
+            vm.warning(std::to_string(regressions) + " metric(s) regressed more than 10% against the baseline");
+        }
+        return regressions;
     }
-
-    void setVNCMode(bool enabled) { useVNC = enabled; }
-    void setBridgeMode(bool enabled) { useBridge = enabled; }
-    void setCPUCores(int cores) { cpuCores = cores; }
-    void setRAM(int gb) { ramGB = gb; }
-    void setCamera(bool enabled) { enableCamera = enabled; }
-    void setMicrophone(bool enabled) { enableMicrophone = enabled; }
 };
 
-// Variable global para cleanup
-ColdVM* globalVM = nullptr;
-
-void signalHandler(int sig) {
-    std::cout << "\n";
-    if (globalVM) {
-        globalVM->cleanup();
-    }
-    std::cout << "\n✓ Cold VM shutdown complete!\n" << std::endl;
-    exit(0);
-}
-
 int main(int argc, char* argv[]) {
-    signal(SIGINT, signalHandler);
-    signal(SIGTERM, signalHandler);
-    
-    ColdVM vm;
-    globalVM = &vm;
+    // Las señales se atienden en el bucle del supervisor (signalfd)
+    ColdSupervisor::blockSignals();
     
-    // Procesar argumentos
+    // "cold run --instances N": N invitados en un mismo proceso
+    int instances = 0;
+    std::string command = "run";
+    std::vector<std::string> options;
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
+        if (i == 1 && (arg == "run" || arg == "suspend" || arg == "resume" ||
+                       arg == "migrate" || arg == "receive" || arg == "bench" || arg == "backup")) {
+            command = arg;
+            continue;
+        }
+        // cold disk optimize
+        if (i == 1 && arg == "disk") {
+            command = i + 1 < argc ? "disk " + std::string(argv[++i]) : "disk";
+            continue;
+        }
+        if (arg == "--instances" || arg.rfind("--instances=", 0) == 0) {
+            std::string value = arg == "--instances" ? (i + 1 < argc ? argv[++i] : "") : arg.substr(12);
+            instances = atoi(value.c_str());
+            if (instances < 1) {
+                std::cerr << "✗ Invalid instance count '" << value << "'" << std::endl;
+                return 1;
+            }
+            continue;
+        }
+        if ((arg == "--from-base" || arg == "--to" || arg == "--listen" || arg == "--profile") && i + 1 < argc) {
+            options.push_back(arg + "=" + std::string(argv[++i]));
+            continue;
+        }
+        options.push_back(arg);
+    }
+    
+    std::string cloneMode = "overlay";
+    for (const auto& arg : options) {
+        if (arg.rfind("--clone=", 0) == 0) cloneMode = arg.substr(8);
+    }
+    if (cloneMode != "overlay" && cloneMode != "reflink") {
+        std::cerr << "✗ Invalid clone mode '" << cloneMode << "' (use overlay or reflink)" << std::endl;
+        return 1;
+    }
+    
+    HostReservations reservations;
+    std::vector<std::unique_ptr<ColdVM>> vms;
+    for (int i = 0; i < std::max(1, instances); i++) {
+        vms.push_back(std::make_unique<ColdVM>());
+        if (instances > 0) vms.back()->setInstance(i, &reservations);
+    }
+    // Perfiles antes que las opciones, que los sobrescriben; sin --profile
+    // cada VM carga el suyo si existe
+    std::string profile;
+    for (const auto& arg : options) {
+        if (arg.rfind("--profile=", 0) == 0) profile = arg.substr(10);
+    }
+    for (auto& vm : vms) {
+        std::string path = profile.empty() ? vm->defaultProfilePath() : profile;
+        if ((!profile.empty() || fs::exists(path)) && !vm->loadProfile(path)) return 1;
+    }
+    
+    ColdSupervisor supervisor;
+    std::string migrateHost;
+    int migratePort = 0;
+    int listenPort = 0;
+    bool postcopy = false;
+    int httpPort = 9180;
+    int benchRuns = 3;
+    bool saveBaseline = false;
+    bool dedup = false;
+    KSMTuning ksm;
+    std::string benchImage = "./devices/bench/bench.qcow2";
+    std::string backupTarget;
+    bool fullBackup = false;
+    long long backupSpeed = 0;
+    
+    // Los ajustes se aplican a todas las instancias
+    auto forEachVM = [&vms](const std::function<void(ColdVM&)>& apply) {
+        for (auto& vm : vms) apply(*vm);
+    };
+    
+    // Procesar argumentos
+    for (const auto& arg : options) {
         if (arg == "--no-vnc") {
-            vm.setVNCMode(false);
+            forEachVM([](ColdVM& vm) { vm.setDisplayMode("gtk"); });
+        } else if (arg.rfind("--display=", 0) == 0) {
+            std::string mode = arg.substr(10);
+            if (mode != "websocket" && mode != "websockify" && mode != "spice" && mode != "gtk") {
+                std::cerr << "✗ Invalid display '" << mode << "' (use websocket, websockify, spice or gtk)" << std::endl;
+                return 1;
+            }
+            forEachVM([&mode](ColdVM& vm) { vm.setDisplayMode(mode); });
+        } else if (arg.rfind("--vnc-link=", 0) == 0) {
+            std::string link = arg.substr(11);
+            if (link != "auto" && link != "lan" && link != "wan") {
+                std::cerr << "✗ Invalid VNC link '" << link << "' (use auto, lan or wan)" << std::endl;
+                return 1;
+            }
+            forEachVM([&link](ColdVM& vm) { vm.setVNCLink(link); });
+        } else if (arg.rfind("--vnc-quality=", 0) == 0 || arg.rfind("--vnc-compression=", 0) == 0) {
+            bool quality = arg.rfind("--vnc-quality=", 0) == 0;
+            std::string value = arg.substr(arg.find('=') + 1);
+            int level = atoi(value.c_str());
+            if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || level > 9) {
+                std::cerr << "✗ Invalid VNC " << (quality ? "quality" : "compression") << " '" << value << "' (use 0-9)" << std::endl;
+                return 1;
+            }
+            forEachVM([quality, level](ColdVM& vm) {
+                if (quality) vm.setVNCQuality(level); else vm.setVNCCompression(level);
+            });
+        } else if (arg.rfind("--vnc-fps=", 0) == 0) {
+            int fps = atoi(arg.c_str() + 10);
+            if (fps < 1 || fps > 120) {
+                std::cerr << "✗ Invalid frame rate '" << arg.substr(10) << "' (use 1-120)" << std::endl;
+                return 1;
+            }
+            forEachVM([fps](ColdVM& vm) { vm.setVNCFrameRate(fps); });
+        } else if (arg.rfind("--vnc-encoding=", 0) == 0) {
+            std::string encoding = arg.substr(15);
+            if (encoding != "auto" && encoding != "tight" && encoding != "zrle" && encoding != "raw") {
+                std::cerr << "✗ Invalid VNC encoding '" << encoding << "' (use auto, tight, zrle or raw)" << std::endl;
+                return 1;
+            }
+            forEachVM([&encoding](ColdVM& vm) { vm.setVNCEncoding(encoding); });
+        } else if (arg.rfind("--http-port=", 0) == 0) {
+            httpPort = atoi(arg.c_str() + 12);
+            if (httpPort < 0 || httpPort > 65535) {
+                std::cerr << "✗ Invalid HTTP port '" << arg.substr(12) << "'" << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--ram=", 0) == 0) {
+            // GB o MIN-MAX en GB: el invitado arranca con MAX y el globo
+            // puede recuperar hasta MAX - MIN cuando el host va justo
+            std::string value = arg.substr(6);
+            size_t dash = value.find('-');
+            int maxGB = atoi(value.c_str() + (dash == std::string::npos ? 0 : dash + 1));
+            int minGB = dash == std::string::npos ? maxGB : atoi(value.c_str());
+            if (minGB < 1 || maxGB < minGB) {
+                std::cerr << "✗ Invalid RAM '" << value << "' (use GB or MIN-MAX)" << std::endl;
+                return 1;
+            }
+            forEachVM([minGB, maxGB](ColdVM& vm) { vm.setRAMRange(minGB, maxGB); });
         } else if (arg == "--no-bridge") {
-            vm.setBridgeMode(false);
+            forEachVM([](ColdVM& vm) { vm.setBridgeMode(false); });
         } else if (arg == "--no-camera") {
-            vm.setCamera(false);
+            forEachVM([](ColdVM& vm) { vm.setCamera(false); });
         } else if (arg == "--no-mic") {
-            vm.setMicrophone(false);
+            forEachVM([](ColdVM& vm) { vm.setMicrophone(false); });
+        } else if (arg == "--no-pin") {
+            forEachVM([](ColdVM& vm) { vm.setPinning(false); });
+        } else if (arg.rfind("--share=", 0) == 0) {
+            SharedFolder share;
+            std::string failure;
+            if (!SharedFolder::parse(arg.substr(8), share, failure)) {
+                std::cerr << "✗ Invalid --share: " << failure << std::endl;
+                return 1;
+            }
+            forEachVM([&share](ColdVM& vm) { vm.addShare(share); });
+        } else if (arg.rfind("--usb=", 0) == 0) {
+            std::string spec = arg.substr(6);
+            if (!ColdVM::validUSBSpec(spec)) {
+                std::cerr << "✗ Invalid USB device '" << spec << "' (use VENDOR:PRODUCT, BUS-PORT or class:video|audio|storage|hid)" << std::endl;
+                return 1;
+            }
+            forEachVM([&spec](ColdVM& vm) { vm.addUSBDevice(spec); });
+        } else if (arg == "--usb-hotplug") {
+            forEachVM([](ColdVM& vm) { vm.setUSBHotplug(true); });
+        } else if (arg.rfind("--pci=", 0) == 0) {
+            std::string address = arg.substr(6);
+            forEachVM([&address](ColdVM& vm) { vm.addPCIDevice(address); });
+        } else if (arg.rfind("--sriov=", 0) == 0) {
+            // PF[,vfs=N]: crea N VFs si no hay y cada VM toma una libre
+            std::string value = arg.substr(8);
+            size_t comma = value.find(",vfs=");
+            int vfs = comma == std::string::npos ? (int)vms.size() : atoi(value.c_str() + comma + 5);
+            if (vfs < 1) {
+                std::cerr << "✗ Invalid VF count in '" << value << "'" << std::endl;
+                return 1;
+            }
+            std::string pf = value.substr(0, comma);
+            forEachVM([&pf, vfs](ColdVM& vm) { vm.setSRIOV(pf, vfs); });
+        } else if (arg == "--latency") {
+            forEachVM([](ColdVM& vm) { vm.setLatencyMode(true); });
+        } else if (arg == "--dedup") {
+            dedup = true;
+            forEachVM([](ColdVM& vm) { vm.setDedup(true); });
+        } else if (arg == "--hugepages" || arg.rfind("--hugepages=", 0) == 0) {
+            std::string size = arg == "--hugepages" ? "2M" : arg.substr(12);
+            if (HugepagePool::pageKB(size) == 0) {
+                std::cerr << "✗ Invalid hugepage size '" << size << "' (use 2M or 1G)" << std::endl;
+                return 1;
+            }
+            forEachVM([&size](ColdVM& vm) { vm.setHugepages(size); });
+        } else if (arg.rfind("--nat=", 0) == 0) {
+            std::string mode = arg.substr(6);
+            if (mode != "auto" && mode != "passt" && mode != "user") {
+                std::cerr << "✗ Invalid NAT mode '" << mode << "' (use auto, passt or user)" << std::endl;
+                return 1;
+            }
+            forEachVM([&mode](ColdVM& vm) { vm.setNATMode(mode); });
+        } else if (arg.rfind("--from-base=", 0) == 0) {
+            std::string base = arg.substr(12);
+            if (!fs::exists(base)) {
+                std::cerr << "✗ Base image not found: " << base << std::endl;
+                return 1;
+            }
+            forEachVM([&base, &cloneMode](ColdVM& vm) { vm.setBaseImage(base, cloneMode); });
+        } else if (arg.rfind("--clone=", 0) == 0 || arg.rfind("--profile=", 0) == 0) {
+            // Ya procesados: --clone junto a --from-base, --profile antes del bucle
+        } else if (arg.rfind("--to=", 0) == 0) {
+            // HOST:PORT, con corchetes para IPv6 ([::1]:4444)
+            std::string target = arg.substr(5);
+            size_t colon = target.rfind(':');
+            migratePort = colon == std::string::npos ? 0 : atoi(target.c_str() + colon + 1);
+            migrateHost = colon == std::string::npos ? "" : target.substr(0, colon);
+            if (migrateHost.size() > 2 && migrateHost.front() == '[' && migrateHost.back() == ']') {
+                migrateHost = migrateHost.substr(1, migrateHost.size() - 2);
+            }
+            if (migrateHost.empty() || migratePort <= 0 || migratePort > 65535) {
+                std::cerr << "✗ Invalid migration target '" << target << "' (use HOST:PORT)" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--postcopy") {
+            postcopy = true;
+        } else if (arg.rfind("--listen=", 0) == 0) {
+            listenPort = atoi(arg.c_str() + 9);
+            if (listenPort <= 0 || listenPort > 65535 - (int)vms.size()) {
+                std::cerr << "✗ Invalid listen port '" << arg.substr(9) << "'" << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--trace-startup=", 0) == 0) {
+            // json o json:RUTA (por defecto ./run/startup-trace.json)
+            std::string value = arg.substr(16);
+            if (value != "json" && value.rfind("json:", 0) != 0) {
+                std::cerr << "✗ Invalid trace format '" << value << "' (use json or json:PATH)" << std::endl;
+                return 1;
+            }
+            StartupTrace::instance().enable(value == "json" ? "./run/startup-trace.json" : value.substr(5));
+        } else if (arg.rfind("--runs=", 0) == 0) {
+            benchRuns = atoi(arg.c_str() + 7);
+            if (benchRuns < 1) {
+                std::cerr << "✗ Invalid run count '" << arg.substr(7) << "'" << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--bench-image=", 0) == 0) {
+            benchImage = arg.substr(14);
+        } else if (arg == "--save-baseline") {
+            saveBaseline = true;
+        } else if (arg.rfind("--prealloc=", 0) == 0) {
+            std::string mode = arg.substr(11);
+            if (mode != "off" && mode != "metadata" && mode != "falloc" && mode != "full") {
+                std::cerr << "✗ Invalid preallocation '" << mode << "' (use off, metadata, falloc or full)" << std::endl;
+                return 1;
+            }
+            forEachVM([&mode](ColdVM& vm) { vm.setDiskLayout(mode, "", -1); });
+        } else if (arg.rfind("--cluster-size=", 0) == 0) {
+            std::string size = arg.substr(15);
+            long long bytes = parseByteSize(size);
+            if (bytes < 16384 || bytes > (2LL << 20) || (bytes & (bytes - 1)) != 0) {
+                std::cerr << "✗ Invalid cluster size '" << size << "' (a power of two from 16K to 2M)" << std::endl;
+                return 1;
+            }
+            forEachVM([&size](ColdVM& vm) { vm.setDiskLayout("", size, -1); });
+        } else if (arg == "--extended-l2") {
+            forEachVM([](ColdVM& vm) { vm.setDiskLayout("", "", 1); });
+        } else if (arg.rfind("--backup-to=", 0) == 0) {
+            backupTarget = arg.substr(12);
+        } else if (arg == "--full") {
+            fullBackup = true;
+        } else if (arg.rfind("--backup-limit=", 0) == 0) {
+            // MB/s por disco; 0 = sin límite
+            backupSpeed = atoll(arg.c_str() + 15) * 1024 * 1024;
+            if (backupSpeed < 0 || arg.find_first_not_of("0123456789", 15) != std::string::npos) {
+                std::cerr << "✗ Invalid backup limit '" << arg.substr(15) << "' (MB/s)" << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--shutdown-timeout=", 0) == 0) {
+            supervisor.setShutdownTimeout(std::max(1, atoi(arg.c_str() + 19)));
         } else if (arg == "--help" || arg == "-h") {
             std::cout << "Cold VM Manager - Advanced Virtual Machine System\n\n";
-            std::cout << "Usage: " << argv[0] << " [options]\n\n";
+            std::cout << "Usage: " << argv[0] << " [run|suspend|resume|migrate|receive|bench|backup|disk optimize]\n";
+            std::cout << "       [--instances N] [options]\n\n";
+            std::cout << "Commands:\n";
+            std::cout << "  run           Boot the VM(s), resuming a saved state when one matches (default)\n";
+            std::cout << "  suspend       Save guest RAM and device state next to the disks and stop QEMU\n";
+            std::cout << "  resume        Same as run, warning when there is no saved state\n";
+            std::cout << "  migrate       Live-migrate the running VM(s) to a cold receive on another host\n";
+            std::cout << "                (disks must be on storage shared by both hosts)\n";
+            std::cout << "  receive       Wait for cold migrate and run the incoming VM(s) here\n";
+            std::cout << "  bench         Boot a headless guest N times and measure boot-to-agent time,\n";
+            std::cout << "                fio 4k random I/O and iperf3 throughput (p50/p99 vs baseline)\n";
+            std::cout << "  backup        Copy the running VM's disks without stopping it: full the first\n";
+            std::cout << "                time, then only the clusters changed since (dirty bitmaps), with the\n";
+            std::cout << "                guest filesystems frozen through qemu-guest-agent while it starts\n";
+            std::cout << "  disk optimize Rewrite every image in the disk dir (VM shut down) with parallel\n";
+            std::cout << "                qemu-img convert: compacted, preallocated, new cluster layout\n\n";
             std::cout << "Options:\n";
-            std::cout << "  --no-vnc      Use local GTK display instead of VNC\n";
+            std::cout << "  --instances N Run N guests from this process, each with its own disks,\n";
+            std::cout << "                VNC display, port, MAC and host CPUs (./devices/vmN, ./run/vmN)\n";
+            std::cout << "  --profile FILE  Load VM settings from a TOML profile (default: profile.toml\n";
+            std::cout << "                next to each VM's disk dir); options given here override it.\n";
+            std::cout << "                The QEMU command is cached until the profile or host changes\n";
+            std::cout << "  --from-base IMAGE  Provision empty disk dirs as thin qcow2 overlays on IMAGE\n";
+            std::cout << "  --clone=overlay|reflink  Use a FICLONE copy of IMAGE instead when the filesystem allows\n";
+            std::cout << "  --display=websocket|websockify|spice|gtk  Remote display (default websocket:\n";
+            std::cout << "                noVNC straight to QEMU's websocket, no relay process)\n";
+            std::cout << "  --vnc-link=auto|lan|wan  Link profile; auto measures each client's RTT and\n";
+            std::cout << "                bandwidth and retunes its session every 2 s (default)\n";
+            std::cout << "  --vnc-quality=0-9, --vnc-compression=0-9  Pin JPEG quality / zlib level\n";
+            std::cout << "  --vnc-encoding=auto|tight|zrle|raw  Pin the framebuffer encoding\n";
+            std::cout << "  --vnc-fps=N   Cap the frame rate sent to noVNC clients\n";
+            std::cout << "  --http-port=PORT  Supervisor HTTP port for /metrics (Prometheus) and display\n";
+            std::cout << "                tuning and backup guest freeze (default 9180, 0 = off)\n";
+            std::cout << "  --no-vnc      Use local GTK display instead of VNC (--display=gtk)\n";
             std::cout << "  --no-bridge   Use NAT networking instead of bridge\n";
             std::cout << "  --no-camera   Disable camera passthrough\n";
             std::cout << "  --no-mic      Disable microphone\n";
+            std::cout << "  --no-pin      Let vCPUs float instead of pinning them to host cores\n";
+            std::cout << "  --ram=GB|MIN-MAX  Guest RAM; with a range the supervisor balloons each guest\n";
+            std::cout << "                between MIN and MAX following host memory pressure (PSI)\n";
+            std::cout << "  --share=DIR[,tag=NAME][,ro][,dax=GB]  Share a host directory over virtiofs\n";
+            std::cout << "                (guest: mount -t virtiofs NAME /mnt); repeatable. ./devices/share\n";
+            std::cout << "                is shared as 'share' when no --share is given\n";
+            std::cout << "  --usb=SPEC    Pass a USB device through: VENDOR:PRODUCT (046d:0825), BUS-PORT\n";
+            std::cout << "                (1-2.3, see /sys/bus/usb/devices) or class:video|audio|storage|hid;\n";
+            std::cout << "                repeatable\n";
+            std::cout << "  --usb-hotplug Attach matching --usb devices with device_add as they are\n";
+            std::cout << "                plugged in, and detach them on removal, without a restart\n";
+            std::cout << "  --pci=ADDR    Pass a host PCI device (and its IOMMU group) through with VFIO;\n";
+            std::cout << "                repeatable. The original driver is restored on exit\n";
+            std::cout << "  --sriov=PF[,vfs=N]  Create N VFs on an SR-IOV NIC if it has none (default:\n";
+            std::cout << "                one per instance) and give each VM a free one\n";
+            std::cout << "  --latency     Isolate the vCPU cores in a cgroup v2 cpuset partition, run\n";
+            std::cout << "                vCPUs SCHED_FIFO, lock guest RAM (no balloon) and move\n";
+            std::cout << "                emulator threads to a housekeeping core\n";
+            std::cout << "  --dedup       Let KSM merge identical guest pages (mem-merge=on), scanning\n";
+            std::cout << "                faster the more instances run; merged pages show in /metrics\n";
+            std::cout << "  --hugepages[=2M|1G]  Back guest RAM with preallocated hugepages (no balloon)\n";
+            std::cout << "  --nat=auto|passt|user  NAT backend when not bridged (auto prefers passt)\n";
+            std::cout << "  --to HOST:PORT  migrate: destination cold receive\n";
+            std::cout << "  --postcopy    migrate: switch to postcopy after the first RAM pass (single\n";
+            std::cout << "                channel: QEMU < 10.1 cannot combine postcopy with multifd)\n";
+            std::cout << "                (needs userfaultfd on the destination)\n";
+            std::cout << "  --listen PORT receive: control port; VM i streams on PORT+1+i\n";
+            std::cout << "  --runs=N      bench: number of boots to measure (default 3)\n";
+            std::cout << "  --bench-image=PATH  bench: base image with qemu-guest-agent, fio and iperf3\n";
+            std::cout << "                (default ./devices/bench/bench.qcow2)\n";
+            std::cout << "  --save-baseline  bench: store this run as ./run/bench/baseline; without it,\n";
+            std::cout << "                a >10% regression against the baseline exits with status 2\n";
+            std::cout << "  --prealloc=off|metadata|falloc|full  New and optimized qcow2 images (default\n";
+            std::cout << "                metadata)\n";
+            std::cout << "  --cluster-size=SIZE  qcow2 cluster size, 16K-2M (default 64K)\n";
+            std::cout << "  --extended-l2 qcow2 subclusters: cheaper copy-on-write with large clusters\n";
+            std::cout << "  --backup-to=DIR|nbd://HOST:PORT  backup: qcow2 chain in DIR (default\n";
+            std::cout << "                ./devices/backup), or update the NBD exports diskN (vmN-diskN) in place\n";
+            std::cout << "  --full        backup: start a new full backup instead of an incremental one\n";
+            std::cout << "  --backup-limit=MB  backup: cap each disk's copy at MB/s to spare guest I/O\n";
+            std::cout << "  --trace-startup=json[:PATH]  Write startup spans in Chrome trace format\n";
+            std::cout << "                (default ./run/startup-trace.json)\n";
+            std::cout << "  --shutdown-timeout=SECONDS  Wait for ACPI powerdown before SIGTERM (default 30)\n";
             std::cout << "  --help, -h    Show this help message\n\n";
             std::cout << "Default configuration:\n";
-            std::cout << "  - 6 GB RAM\n";
-            std::cout << "  - 4 CPU cores (host model)\n";
+            std::cout << "  - 4 GB RAM\n";
+            std::cout << "  - 4 CPU cores (host model), pinned to host cores sharing an L3\n";
             std::cout << "  - VirtIO devices\n";
-            std::cout << "  - VNC with remote scaling\n";
-            std::cout << "  - Bridge networking (virbr0)\n";
+            std::cout << "  - noVNC on QEMU's built-in websocket with remote scaling\n";
+            std::cout << "  - Bridge networking (virbr0) on a multiqueue vhost-net tap\n";
             std::cout << "  - Camera, audio & microphone enabled\n";
             std::cout << "\n";
             return 0;
         }
     }
     
-    if (vm.boot()) {
-        while (true) {
-            sleep(1);
+    // cold suspend: guardar el estado de las VMs en marcha y salir
+    if (command == "suspend") {
+        int failures = 0;
+        for (auto& vm : vms) {
+            if (!vm->suspendToDisk()) failures++;
         }
-    } else {
-        std::cerr << "\n✗ Failed to start Cold VM!\n" << std::endl;
-        return 1;
+        return failures == 0 ? 0 : 1;
     }
     
-    return 0;
+    // cold disk optimize: mantenimiento de imágenes con las VMs apagadas
+    if (command.rfind("disk", 0) == 0) {
+        if (command != "disk optimize") {
+            std::cerr << "✗ Unknown disk action (use: cold disk optimize)" << std::endl;
+            return 1;
+        }
+        int failures = 0;
+        for (auto& vm : vms) {
+            if (!vm->optimizeDisks()) failures++;
+        }
+        return failures == 0 ? 0 : 1;
+    }
+    
+    supervisor.setHTTPPort(httpPort);
+    forEachVM([httpPort](ColdVM& vm) { vm.setTuningPort(httpPort); });
+    
+    // cold backup: copia en caliente de los discos de las VMs en marcha; el freeze
+    // del invitado se pide al supervisor por --http-port
+    if (command == "backup") {
+        int failures = 0;
+        for (auto& vm : vms) {
+            std::string target = backupTarget.empty() ? vm->defaultBackupDir()
+                               : vms.size() > 1 && backupTarget.rfind("nbd://", 0) != 0 ? backupTarget + "/" + vm->displayName()
+                               : backupTarget;
+            if (!vm->backupTo(target, fullBackup, backupSpeed)) failures++;
+        }
+        return failures == 0 ? 0 : 1;
+    }
+    
+    // cold bench: una sola VM de pruebas, fuera del supervisor
+    if (command == "bench") {
+        if (!fs::exists(benchImage)) {
+            std::cerr << "✗ Benchmark image not found: " << benchImage << std::endl;
+            return 1;
+        }
+        vms.front()->setBenchMode(benchImage);
+        return ColdBench(*vms.front(), benchRuns).run(saveBaseline);
+    }
+    
+    // cold migrate: cada VM viaja en orden al mismo cold receive
+    if (command == "migrate") {
+        if (migrateHost.empty()) {
+            std::cerr << "✗ cold migrate needs --to HOST:PORT" << std::endl;
+            return 1;
+        }
+        int failures = 0;
+        for (auto& vm : vms) {
+            if (!vm->migrateTo(migrateHost, migratePort, postcopy)) failures++;
+        }
+        return failures == 0 ? 0 : 1;
+    }
+    
+    // cold receive: las VMs llegan en el orden en que el origen las envía
+    if (command == "receive") {
+        if (listenPort == 0) {
+            std::cerr << "✗ cold receive needs --listen PORT" << std::endl;
+            return 1;
+        }
+        int listener = ControlChannel::listenOn(listenPort);
+        if (listener < 0) {
+            std::cerr << "✗ Cannot listen on port " << listenPort << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+        int received = 0;
+        for (size_t i = 0; i < vms.size(); i++) {
+            if (vms[i]->receiveMigration(listener, listenPort + 1 + (int)i)) {
+                supervisor.add(vms[i].get());
+                received++;
+            }
+        }
+        close(listener);
+        if (received == 0) return 1;
+        if (dedup) {
+            ksm.apply(received);
+            if (KSMTuning::available()) supervisor.setKSM(&ksm);
+        }
+        int status = supervisor.run();
+        ksm.restore();
+        std::cout << "\n✓ Cold VM shutdown complete!\n" << std::endl;
+        return status;
+    }
+    
+    // cold resume: igual que run, pero avisa si no hay nada que restaurar
+    if (command == "resume") {
+        for (auto& vm : vms) {
+            if (!vm->hasSavedState()) vm->warning("No saved state found, cold booting");
+        }
+    }
+    
+    // Arranque secuencial: cada VM ve las CPUs y páginas enormes que dejaron
+    // libres las anteriores
+    int booted = 0;
+    for (auto& vm : vms) {
+        if (vm->boot()) {
+            supervisor.add(vm.get());
+            booted++;
+        } else {
+            std::cerr << "\n✗ Failed to start Cold VM!\n" << std::endl;
+        }
+    }
+    // Se reescriben al salir con los hitos posteriores (reinicios, invitado)
+    StartupTrace& trace = StartupTrace::instance();
+    if (trace.enabled() && trace.write()) {
+        std::cout << "- Startup trace written to " << trace.outputPath() << "\n" << std::endl;
+    }
+    if (booted == 0) return 1;
+    if (dedup) {
+        ksm.apply(booted);
+        if (KSMTuning::available()) supervisor.setKSM(&ksm);
+    }
+    
+    int status = supervisor.run();
+    ksm.restore();
+    trace.write();
+    std::cout << "\n✓ Cold VM shutdown complete!\n" << std::endl;
+    return status;
 }